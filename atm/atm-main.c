@@ -3,20 +3,185 @@
 #include "atm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
 
 static const char prompt[] = "ATM: ";
 
+// Batch mode timing, per command name
+#define BATCH_MAX_KINDS 8
+
+typedef struct
+{
+    char name[16];
+    unsigned long long *samples_us;
+    size_t count, cap;
+    unsigned long long total_us;
+} CommandTiming;
+
+static CommandTiming *find_timing(CommandTiming *t, int *nkinds, const char *name)
+{
+    for (int i = 0; i < *nkinds; i++) {
+        if (strcmp(t[i].name, name) == 0) {
+            return &t[i];
+        }
+    }
+    // Unknown commands all land in the last slot
+    if (*nkinds == BATCH_MAX_KINDS) {
+        return &t[BATCH_MAX_KINDS - 1];
+    }
+    CommandTiming *ct = &t[(*nkinds)++];
+    snprintf(ct->name, sizeof(ct->name), "%s", name);
+    return ct;
+}
+
+static void add_sample(CommandTiming *ct, unsigned long long us)
+{
+    if (ct->count == ct->cap) {
+        size_t cap = ct->cap ? ct->cap * 2 : 256;
+        unsigned long long *s = realloc(ct->samples_us, cap * sizeof(*s));
+        if (s == NULL) {
+            return;
+        }
+        ct->samples_us = s;
+        ct->cap = cap;
+    }
+    ct->samples_us[ct->count++] = us;
+    ct->total_us += us;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_timing(CommandTiming *t, int nkinds, unsigned long long elapsed_us)
+{
+    size_t total = 0;
+
+    fprintf(stderr, "%-16s %8s %10s %9s %9s %9s %9s\n",
+            "command", "count", "total_ms", "mean_us", "p50_us", "p99_us", "max_us");
+    for (int i = 0; i < nkinds; i++) {
+        CommandTiming *ct = &t[i];
+        if (ct->count == 0) {
+            continue;
+        }
+        qsort(ct->samples_us, ct->count, sizeof(unsigned long long), compare_ull);
+        fprintf(stderr, "%-16s %8zu %10.1f %9llu %9llu %9llu %9llu\n",
+                ct->name, ct->count, ct->total_us / 1000.0, ct->total_us / ct->count,
+                ct->samples_us[ct->count / 2], ct->samples_us[(ct->count * 99) / 100],
+                ct->samples_us[ct->count - 1]);
+        total += ct->count;
+        free(ct->samples_us);
+    }
+    fprintf(stderr, "%zu commands in %.1f ms (%.0f commands/s)\n", total, elapsed_us / 1000.0,
+            elapsed_us ? total * 1e6 / elapsed_us : 0.0);
+}
+
+// Run a transaction file: one command per line, PINs inline as
+// "begin-session <user> <pin>", no prompts, output fully buffered.
+// With -w > 1 a balance/withdraw is timed until it is sent, not answered.
+static int run_batch(ATM *atm, FILE *in)
+{
+    static char outbuf[1 << 16];
+    char line[1000];
+    CommandTiming timing[BATCH_MAX_KINDS];
+    int nkinds = 0;
+
+    memset(timing, 0, sizeof(timing));
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+    atm->batch = 1;
+
+    unsigned long long start = atm_now_us();
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char name[16];
+        if (sscanf(line, "%15s", name) != 1) {
+            continue;
+        }
+
+        unsigned long long t0 = atm_now_us();
+        atm_process_command(atm, line);
+        add_sample(find_timing(timing, &nkinds, name), atm_now_us() - t0);
+    }
+    atm_flush(atm);
+    fflush(stdout);
+
+    print_timing(timing, nkinds, atm_now_us() - start);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
     char user_input[1000];
+    int window = 1;
+    int c;
+
+    int envelope = 0;
+    int verbose = 0;
+    const char *batch_file = NULL;
+    int cache_cards = 0;
+    long lease_ms = -1;
+
+    // Options: -w <n> keeps up to n balance/withdraw requests in flight,
+    // -r adds a routing envelope for a sharded bank cluster, -v prints
+    // retransmission statistics to stderr on exit, -f <file> runs a
+    // transaction file in batch mode ("-" for stdin), -c keeps card
+    // secrets in memory (see card_cache.h), -l <ms> sets the balance
+    // cache lease (0 = always ask the bank)
+    while ((c = getopt(argc, argv, "w:rvf:cl:")) != -1) {
+        if (c == 'w') {
+            window = atoi(optarg);
+        } else if (c == 'r') {
+            envelope = 1;
+        } else if (c == 'v') {
+            verbose = 1;
+        } else if (c == 'f') {
+            batch_file = optarg;
+        } else if (c == 'c') {
+            cache_cards = 1;
+        } else if (c == 'l') {
+            lease_ms = atol(optarg);
+        } else {
+            printf("Error opening ATM initialization file\n");
+            return 64;
+        }
+    }
 
     // Check command line arguments
-    if (argc != 2) {
+    if (argc - optind != 1) {
         printf("Error opening ATM initialization file\n");
         return 64;
     }
 
-    ATM *atm = atm_create(argv[1]);
+    if (window < 1 || window > ATM_MAX_WINDOW) {
+        window = (window < 1) ? 1 : ATM_MAX_WINDOW;
+    }
+
+    ATM *atm = atm_create(argv[optind]);
+    atm->window = window;
+    atm->use_envelope = envelope;
+    if (cache_cards) {
+        atm->cards = card_cache_create(".");
+    }
+    if (lease_ms >= 0) {
+        atm->balance_lease_us = (unsigned long long)lease_ms * 1000ULL;
+    }
+
+    if (batch_file != NULL) {
+        FILE *in = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+        if (in == NULL) {
+            fprintf(stderr, "atm: can't open %s\n", batch_file);
+            atm_free(atm);
+            return 64;
+        }
+        int ret = run_batch(atm, in);
+        if (verbose) {
+            atm_print_stats(atm, stderr);
+        }
+        atm_free(atm);
+        return ret;
+    }
 
     printf("%s", prompt);
     fflush(stdout);
@@ -33,5 +198,11 @@ int main(int argc, char **argv)
         }
         fflush(stdout);
     }
+
+    atm_flush(atm);
+    fflush(stdout);
+    if (verbose) {
+        atm_print_stats(atm, stderr);
+    }
 	return EXIT_SUCCESS;
 }
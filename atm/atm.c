@@ -2,11 +2,13 @@
 #include "ports.h"
 #include "protocol.h"
 #include "crypto.h"
+#include "wire.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/select.h>
@@ -37,23 +39,30 @@ ATM* atm_create(const char *atm_init_file)
     // Initialize protocol / session state
     atm->logged_in = 0;
     atm->current_user[0] = '\0';
+    atm->account_id = 0;
+    atm->wire_version = WIRE_COMPACT;
+    atm->use_envelope = 0;
+    atm->route_tag = 0;
+    atm->batch = 0;
+    atm->cards = NULL;
+    atm->balance_lease_us = ATM_BALANCE_LEASE_US;
+    atm->balance_cached = 0;
+    atm->balance_epoch = 0;
+    atm->session_first_seq = 0;
     
     atm->seq = 1;
+    atm->window = 1;
+    atm->pending_head = 0;
+    atm->pending_count = 0;
+    memset(atm->pending, 0, sizeof(atm->pending));
+    rtt_init(&atm->rtt);
+    memset(&atm->stats, 0, sizeof(atm->stats));
     atm->key_loaded = 0;
     memset(atm->key_K, 0, KEY_SIZE);
+    atm->key_id = 0;
     memset(atm->card_secret, 0, CARD_SECRET_SIZE);
     
-    FILE *key_file = fopen(atm_init_file, "rb");
-    if (key_file == NULL) {
-        printf("Error opening ATM initialization file\n");
-        free(atm);
-        exit(64);
-    }
-    
-    size_t bytes_read = fread(atm->key_K, 1, KEY_SIZE, key_file);
-    fclose(key_file);
-    
-    if (bytes_read != KEY_SIZE) {
+    if (atm_load_key(atm_init_file, atm->key_K, &atm->key_id) != 0) {
         printf("Error opening ATM initialization file\n");
         free(atm);
         exit(64);
@@ -69,6 +78,7 @@ void atm_free(ATM *atm)
     if(atm != NULL)
     {
         close(atm->sockfd);
+        card_cache_free(atm->cards);
         free(atm);
     }
 }
@@ -80,11 +90,23 @@ ssize_t atm_send(ATM *atm, char *data, size_t data_len)
                   (struct sockaddr*) &atm->rtr_addr, sizeof(atm->rtr_addr));
 }
 
-ssize_t atm_recv(ATM *atm, char *data, size_t max_data_len)
+#define ATM_RESPONSE_TIMEOUT_US 5000000ULL  // atm_recv only; requests use the RTO
+
+// Monotonic, for timers and RTT samples; never use it as a wall-clock time
+unsigned long long atm_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Wait up to timeout_us for a datagram
+static ssize_t atm_recv_timeout(ATM *atm, char *data, size_t max_data_len,
+                                unsigned long long timeout_us)
 {
     struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
+    tv.tv_sec = timeout_us / 1000000ULL;
+    tv.tv_usec = timeout_us % 1000000ULL;
     
     fd_set readfds;
     FD_ZERO(&readfds);
@@ -99,6 +121,11 @@ ssize_t atm_recv(ATM *atm, char *data, size_t max_data_len)
     return recvfrom(atm->sockfd, data, max_data_len, 0, NULL, NULL);
 }
 
+ssize_t atm_recv(ATM *atm, char *data, size_t max_data_len)
+{
+    return atm_recv_timeout(atm, data, max_data_len, ATM_RESPONSE_TIMEOUT_US);
+}
+
 static void trim_newline(char *s)
 {
     size_t n = strlen(s);
@@ -144,78 +171,504 @@ static int parse_amount(const char *s, int *out)
     return 1;
 }
 
-// Encrypt and send message
-static int atm_send_encrypted(ATM *atm, const unsigned char *plaintext, size_t plaintext_len)
+_Static_assert(ATM_MAX_PACKET >= MAX_ENCRYPTED_SIZE + sizeof(envelope_t),
+               "ATM_MAX_PACKET too small for a sealed request");
+
+// Build a login request for user; the PIN is sent alongside the token
+int atm_build_login(wire_msg_t *req, const char *user, const char *pin,
+                    const unsigned char *card_secret)
 {
-    unsigned char encrypted[MAX_ENCRYPTED_SIZE];
-    unsigned char iv[16];
-    unsigned char ciphertext[MAX_ENCRYPTED_SIZE];
-    size_t ciphertext_len = 0;
-    unsigned char hmac[32];
-    
-    if (aes_encrypt(atm->key_K, plaintext, plaintext_len, 
-                    ciphertext, &ciphertext_len, iv) != 0) {
+    unsigned char auth_token[AUTH_TOKEN_SIZE];
+
+    // auth_token = HMAC(card_secret || PIN)
+    if (compute_auth_token(card_secret, pin, auth_token) != 0) {
         return -1;
     }
-    
-    // Build the packet: IV || ciphertext
-    memcpy(encrypted, iv, 16);
-    memcpy(encrypted + 16, ciphertext, ciphertext_len);
-    size_t data_len = 16 + ciphertext_len;
-    
-    // HMAC over IV + ciphertext
-    if (hmac_sha256(atm->key_K, encrypted, data_len, hmac) != 0) {
+
+    req->msg_type = MSG_LOGIN_REQ;
+    wire_set_username(req, user);
+    memcpy(req->auth_token, auth_token, AUTH_TOKEN_SIZE);
+    memcpy(req->pin, pin, PIN_SIZE);
+    return 0;
+}
+
+// Build a balance or withdraw request.  Only the legacy format names
+// the user; compact requests carry the account ID from the login.
+void atm_build_request(wire_msg_t *req, uint8_t msg_type, uint8_t version,
+                       uint32_t account_id, const char *user, int32_t amount)
+{
+    req->msg_type = msg_type;
+    req->account_id = account_id;
+    if (version == WIRE_LEGACY) {
+        wire_set_username(req, user);
+    }
+    req->amount = amount;
+}
+
+int atm_load_key(const char *atm_init_file, unsigned char *key, uint16_t *key_id)
+{
+    unsigned char buf[KEY_SIZE + sizeof(uint16_t) + 1];
+
+    FILE *f = fopen(atm_init_file, "rb");
+    if (f == NULL) {
         return -1;
     }
-    
-    // Append HMAC
-    memcpy(encrypted + data_len, hmac, 32);
-    size_t total_len = data_len + 32;
-    
-    // Send to bank via router
-    ssize_t sent = atm_send(atm, (char*)encrypted, total_len);
-    if (sent < 0 || (size_t)sent != total_len) {
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    uint16_t id = 0;
+    if (n == KEY_SIZE + sizeof(uint16_t)) {
+        memcpy(&id, buf + KEY_SIZE, sizeof(id));
+        id = ntohs(id);
+        if (id == 0) {
+            return -1;
+        }
+    } else if (n != KEY_SIZE) {
         return -1;
     }
-    
+
+    memcpy(key, buf, KEY_SIZE);
+    *key_id = id;
     return 0;
 }
 
-// Receive and decrypt message
-static int atm_recv_encrypted(ATM *atm, unsigned char *plaintext, size_t max_plaintext_len)
+// Encode and encrypt req into packet, ready to send (and resend)
+int atm_seal_request(const unsigned char *key, uint16_t key_id, int use_envelope,
+                     uint32_t route_tag, const wire_msg_t *req,
+                     unsigned char *packet, size_t *packet_len)
 {
-    unsigned char encrypted[MAX_ENCRYPTED_SIZE];
-    
-    // Receive encrypted packet
-    ssize_t recv_len = atm_recv(atm, (char*)encrypted, sizeof(encrypted));
-    if (recv_len < (16 + 32)) {  // Minimum: IV + HMAC
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+
+    int len = wire_encode(req, buf, sizeof(buf));
+    if (len < 0) {
         return -1;
     }
-    
-    // Extract components
-    unsigned char *iv = encrypted;
-    size_t data_len = recv_len - 32;  // Everything except HMAC
-    unsigned char *received_hmac = encrypted + data_len;
-    
-    if (hmac_verify(atm->key_K, encrypted, data_len, received_hmac) != 0) {
+
+    // Build [envelope ||] IV || ciphertext || HMAC directly in the packet buffer
+    if (use_envelope || key_id != 0) {
+        envelope_t env;
+        memset(&env, 0, sizeof(env));
+        env.magic = ENVELOPE_MAGIC;
+        env.key_id = htons(key_id);
+        env.route_tag = htonl(route_tag);
+        return seal_message_with_header(key, (unsigned char*)&env, sizeof(env),
+                                        buf, len, packet, packet_len);
+    }
+    return seal_message(key, buf, len, packet, packet_len);
+}
+
+// Send a sealed packet to the bank via the router
+static int atm_send_packet(ATM *atm, const unsigned char *packet, size_t packet_len)
+{
+    ssize_t sent = atm_send(atm, (char*)packet, packet_len);
+    if (sent < 0 || (size_t)sent != packet_len) {
         return -1;
     }
-    
-    // Decrypt ciphertext
-    unsigned char *ciphertext = encrypted + 16;
-    size_t ciphertext_len = data_len - 16;
-    size_t plaintext_len = 0;
-    
-    if (aes_decrypt(atm->key_K, ciphertext, ciphertext_len, iv,
-                    plaintext, &plaintext_len) != 0) {
+    return 0;
+}
+
+// Receive and decrypt message
+static int atm_recv_encrypted(ATM *atm, unsigned char *plaintext, size_t max_plaintext_len,
+                              unsigned long long timeout_us)
+{
+    unsigned char packet[MAX_ENCRYPTED_SIZE];
+
+    ssize_t recv_len = atm_recv_timeout(atm, (char*)packet, sizeof(packet), timeout_us);
+    if (recv_len < 0) {
         return -1;
     }
-    
-    if (plaintext_len > max_plaintext_len) {
+
+    return open_message(atm->key_K, packet, recv_len, plaintext, max_plaintext_len);
+}
+
+void rtt_init(RttEstimator *rtt)
+{
+    rtt->srtt_us = 0;
+    rtt->rttvar_us = 0;
+    rtt->rto_us = ATM_RTO_INIT_US;
+}
+
+// Fold a round-trip sample into SRTT/RTTVAR and recompute the RTO.
+// Only requests that were never retransmitted give samples (Karn).
+void rtt_sample(RttEstimator *rtt, unsigned long long rtt_us)
+{
+    if (rtt->srtt_us == 0) {
+        rtt->srtt_us = rtt_us > 0 ? rtt_us : 1;
+        rtt->rttvar_us = rtt_us / 2;
+    } else {
+        unsigned long long err = (rtt_us > rtt->srtt_us) ? rtt_us - rtt->srtt_us
+                                                         : rtt->srtt_us - rtt_us;
+        rtt->rttvar_us = (3 * rtt->rttvar_us + err) / 4;
+        rtt->srtt_us = (7 * rtt->srtt_us + rtt_us) / 8;
+    }
+
+    unsigned long long rto = rtt->srtt_us + 4 * rtt->rttvar_us;
+    if (rto < ATM_RTO_MIN_US) rto = ATM_RTO_MIN_US;
+    if (rto > ATM_RTO_MAX_US) rto = ATM_RTO_MAX_US;
+    rtt->rto_us = rto;
+}
+
+// Timeout to use after another retransmission
+unsigned long long rtt_backoff(unsigned long long rto_us)
+{
+    return (rto_us * 2 > ATM_RTO_MAX_US) ? ATM_RTO_MAX_US : rto_us * 2;
+}
+
+// Seal and send req, and start its retransmission timer in p
+static int atm_start_request(ATM *atm, wire_msg_t *req, uint8_t resp_type, ATMPending *p)
+{
+    req->version = atm->wire_version;
+    req->seq_num = atm->seq;
+
+    if (atm_seal_request(atm->key_K, atm->key_id, atm->use_envelope, atm->route_tag, req,
+                         p->packet, &p->packet_len) != 0 ||
+        atm_send_packet(atm, p->packet, p->packet_len) != 0) {
         return -1;
     }
-    
-    return (int)plaintext_len;
+    atm->seq++;
+    atm->stats.requests++;
+
+    p->seq = req->seq_num;
+    p->resp_type = resp_type;
+    p->sent_us = atm_now_us();
+    p->rto_us = atm->rtt.rto_us;
+    p->deadline_us = p->sent_us + p->rto_us;
+    p->retries = 0;
+    p->done = 0;
+    p->failed = 0;
+    p->cacheable = 1;
+    p->epoch = atm->balance_epoch;
+    return 0;
+}
+
+// The request's timer fired: resend it with the timeout doubled, or
+// give up once ATM_REQUEST_DEADLINE_US has passed since it was first sent
+static void atm_expire(ATM *atm, ATMPending *p, unsigned long long now)
+{
+    unsigned long long give_up = p->sent_us + ATM_REQUEST_DEADLINE_US;
+
+    if (now >= give_up) {
+        p->done = 1;
+        p->failed = 1;
+        atm->stats.timeouts++;
+        return;
+    }
+
+    atm_send_packet(atm, p->packet, p->packet_len);
+    p->retries++;
+    p->rto_us = rtt_backoff(p->rto_us);
+    p->deadline_us = (now + p->rto_us < give_up) ? now + p->rto_us : give_up;
+    atm->stats.retransmits++;
+}
+
+static void atm_drop_balance(ATM *atm)
+{
+    atm->balance_cached = 0;
+    atm->balance_epoch++;
+}
+
+// 1 if seq is a withdraw of this session that the bank has answered.
+// Seqs are only unique per ATM, so a seq alone doesn't make a withdraw
+// ours.  The ring still holds the last ATM_MAX_WINDOW requests after
+// their results are printed; an answer older than that is not found and
+// its push just drops the cache.
+static int atm_answered_withdraw(const ATM *atm, uint64_t seq)
+{
+    if (seq == 0 || seq < atm->session_first_seq) {
+        return 0;
+    }
+    for (int i = 0; i < ATM_MAX_WINDOW; i++) {
+        const ATMPending *p = &atm->pending[i];
+        if (p->seq == seq && p->resp_type == MSG_WITHDRAW_RESP && p->done && !p->failed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Handle a message the bank sent on its own; returns 0 if msg is a
+// response instead.  Invalidations caused by our own answered withdraws
+// are ignored: the withdraw's response carries the new balance.
+static int atm_handle_push(ATM *atm, const wire_msg_t *msg)
+{
+    if (msg->msg_type != MSG_BALANCE_INVAL) {
+        return 0;
+    }
+    if (!atm->logged_in) {
+        return 1;
+    }
+
+    int ours = (msg->version == WIRE_COMPACT) ? msg->account_id == atm->account_id
+                                              : strcmp(msg->username, atm->current_user) == 0;
+    if (ours && !atm_answered_withdraw(atm, msg->seq_num)) {
+        atm_drop_balance(atm);
+        atm->stats.invalidations++;
+    }
+    return 1;
+}
+
+// The response for p arrived
+static void atm_complete(ATM *atm, ATMPending *p, const wire_msg_t *resp)
+{
+    if (p->retries == 0) {
+        rtt_sample(&atm->rtt, atm_now_us() - p->sent_us);
+        atm->stats.rtt_samples++;
+    }
+    p->done = 1;
+    p->success = resp->success;
+    p->balance = resp->balance;
+
+    // With other requests in flight the bank may have run them in either
+    // order, and an invalidation since p was sent may predate its answer;
+    // either way the balance can't be trusted beyond this one result
+    if ((p->resp_type == MSG_BALANCE_RESP || p->resp_type == MSG_WITHDRAW_RESP) &&
+        p->cacheable && p->epoch == atm->balance_epoch && atm->balance_lease_us > 0) {
+        atm->balance_cached = 1;
+        atm->cached_balance = resp->balance;
+        atm->balance_expires_us = atm_now_us() + atm->balance_lease_us;
+    }
+}
+
+// Send req and wait for the matching response of type resp_type,
+// retransmitting as needed.  Fills in the version and sequence number
+// of req.
+static int atm_transact(ATM *atm, wire_msg_t *req, uint8_t resp_type, wire_msg_t *resp)
+{
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+    ATMPending p;
+
+    if (atm_start_request(atm, req, resp_type, &p) != 0) {
+        return -1;
+    }
+
+    // Skip stale responses to earlier requests that timed out
+    for (;;) {
+        unsigned long long now = atm_now_us();
+        if (now >= p.deadline_us) {
+            atm_expire(atm, &p, now);
+            if (p.failed) {
+                return -1;
+            }
+            continue;
+        }
+
+        int len = atm_recv_encrypted(atm, buf, sizeof(buf), p.deadline_us - now);
+        if (len >= 0 && wire_decode(buf, len, resp) == 0 && !atm_handle_push(atm, resp) &&
+            resp->msg_type == resp_type && resp->seq_num == p.seq) {
+            atm_complete(atm, &p, resp);
+            return 0;
+        }
+    }
+}
+
+// Print the result of a completed request.  A withdraw we gave up on
+// may still have been run by the bank, so it is reported as unknown
+// rather than as not dispensed; a lost balance prints nothing.
+static void atm_deliver(ATM *atm, const ATMPending *p)
+{
+    if (p->failed) {
+        if (p->resp_type == MSG_WITHDRAW_RESP) {
+            printf("Withdraw of $%d: outcome unknown\n", p->amount);
+        }
+        return;
+    }
+
+    if (p->resp_type == MSG_WITHDRAW_RESP) {
+        if (p->success == 1) {
+            printf("$%d dispensed\n", p->amount);
+        } else {
+            printf("Insufficient funds\n");
+        }
+    } else if (p->resp_type == MSG_BALANCE_RESP) {
+        printf("$%d\n", p->balance);
+    }
+}
+
+// Match a response to its outstanding request by sequence number.
+// Responses for anything outside the window are stale and dropped.
+static void atm_handle_response(ATM *atm, const unsigned char *buf, int len)
+{
+    wire_msg_t resp;
+    if (wire_decode(buf, len, &resp) != 0 || atm_handle_push(atm, &resp) ||
+        atm->pending_count == 0) {
+        return;
+    }
+
+    ATMPending *head = &atm->pending[atm->pending_head];
+    if (resp.seq_num < head->seq || resp.seq_num - head->seq >= (uint64_t)atm->pending_count) {
+        return;
+    }
+
+    int idx = (atm->pending_head + (int)(resp.seq_num - head->seq)) % ATM_MAX_WINDOW;
+    ATMPending *p = &atm->pending[idx];
+    if (p->done || resp.msg_type != p->resp_type) {
+        return;
+    }
+
+    atm_complete(atm, p, &resp);
+}
+
+// Print and retire completed requests from the head of the window
+static void atm_deliver_ready(ATM *atm)
+{
+    while (atm->pending_count > 0 && atm->pending[atm->pending_head].done) {
+        atm_deliver(atm, &atm->pending[atm->pending_head]);
+        atm->pending_head = (atm->pending_head + 1) % ATM_MAX_WINDOW;
+        atm->pending_count--;
+    }
+}
+
+// Fire every expired retransmission timer and return the next deadline
+static unsigned long long atm_run_timers(ATM *atm, unsigned long long now)
+{
+    unsigned long long next = ULLONG_MAX;
+
+    for (int i = 0; i < atm->pending_count; i++) {
+        ATMPending *p = &atm->pending[(atm->pending_head + i) % ATM_MAX_WINDOW];
+        if (p->done) {
+            continue;
+        }
+        if (now >= p->deadline_us) {
+            atm_expire(atm, p, now);
+            if (p->done) {
+                continue;
+            }
+        }
+        if (p->deadline_us < next) {
+            next = p->deadline_us;
+        }
+    }
+    return next;
+}
+
+// Wait until the oldest outstanding request completes or is given up
+static void atm_complete_head(ATM *atm)
+{
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+
+    while (!atm->pending[atm->pending_head].done) {
+        unsigned long long now = atm_now_us();
+        unsigned long long next = atm_run_timers(atm, now);
+
+        if (atm->pending[atm->pending_head].done) {
+            break;
+        }
+
+        int len = atm_recv_encrypted(atm, buf, sizeof(buf), next > now ? next - now : 0);
+        if (len >= 0) {
+            atm_handle_response(atm, buf, len);
+        }
+    }
+
+    atm_deliver_ready(atm);
+}
+
+// Handle responses that have already arrived, without blocking
+static void atm_poll_responses(ATM *atm)
+{
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+    int len;
+
+    while (atm->pending_count > 0 &&
+           (len = atm_recv_encrypted(atm, buf, sizeof(buf), 0)) >= 0) {
+        atm_handle_response(atm, buf, len);
+    }
+    if (atm->pending_count > 0) {
+        atm_run_timers(atm, atm_now_us());
+    }
+    atm_deliver_ready(atm);
+}
+
+// Serve a balance from the cache, after taking in any invalidations
+// already waiting on the socket.  Only with nothing in flight, so the
+// answer reflects every earlier withdraw.
+static int atm_cached_balance(ATM *atm, int32_t *balance)
+{
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+    int len;
+
+    if (!atm->balance_cached || atm->pending_count > 0) {
+        return 0;
+    }
+
+    while ((len = atm_recv_encrypted(atm, buf, sizeof(buf), 0)) >= 0) {
+        atm_handle_response(atm, buf, len);
+    }
+
+    if (!atm->balance_cached || atm_now_us() >= atm->balance_expires_us) {
+        return 0;
+    }
+    *balance = atm->cached_balance;
+    atm->stats.balance_hits++;
+    return 1;
+}
+
+void atm_flush(ATM *atm)
+{
+    while (atm->pending_count > 0) {
+        atm_complete_head(atm);
+    }
+}
+
+void atm_print_stats(ATM *atm, FILE *out)
+{
+    fprintf(out, "atm: %llu requests, %llu retransmits, %llu timeouts, "
+                 "srtt %llu us, rttvar %llu us, rto %llu us, "
+                 "%llu cached balances, %llu invalidations\n",
+            atm->stats.requests, atm->stats.retransmits, atm->stats.timeouts,
+            atm->rtt.srtt_us, atm->rtt.rttvar_us, atm->rtt.rto_us,
+            atm->stats.balance_hits, atm->stats.invalidations);
+}
+
+// Send a balance or withdraw request without waiting for its response.
+// Blocks only while the window is full.
+static void atm_submit(ATM *atm, wire_msg_t *req, uint8_t resp_type, int32_t amount)
+{
+    while (atm->pending_count >= atm->window) {
+        atm_complete_head(atm);
+    }
+
+    // A lost withdraw is retransmitted and may reach the bank after a
+    // later request, so a balance waits until earlier withdraws are done
+    if (resp_type == MSG_BALANCE_RESP) {
+        for (int i = atm->pending_count - 1; i >= 0; i--) {
+            if (atm->pending[(atm->pending_head + i) % ATM_MAX_WINDOW].resp_type == MSG_WITHDRAW_RESP) {
+                int remaining = atm->pending_count - (i + 1);
+                while (atm->pending_count > remaining) {
+                    atm_complete_head(atm);
+                }
+                break;
+            }
+        }
+    }
+
+    // A withdraw changes the balance; its response refills the cache
+    if (resp_type == MSG_WITHDRAW_RESP) {
+        atm_drop_balance(atm);
+    }
+
+    int idx = (atm->pending_head + atm->pending_count) % ATM_MAX_WINDOW;
+    ATMPending *p = &atm->pending[idx];
+    if (atm_start_request(atm, req, resp_type, p) != 0) {
+        return;
+    }
+    p->amount = amount;
+
+    // Overlapping requests may be run in any order, so none of them
+    // can refill the cache
+    if (atm->pending_count > 0) {
+        for (int i = 0; i <= atm->pending_count; i++) {
+            atm->pending[(atm->pending_head + i) % ATM_MAX_WINDOW].cacheable = 0;
+        }
+    }
+    atm->pending_count++;
+
+    // Stop-and-wait: the result is printed before the next prompt
+    if (atm->window == 1) {
+        atm_flush(atm);
+    } else {
+        atm_poll_responses(atm);
+    }
 }
 
 void atm_process_command(ATM *atm, char *command)
@@ -230,10 +683,17 @@ void atm_process_command(ATM *atm, char *command)
         return;
     }
 
+    // Only balance and withdraw requests are pipelined.  Everything else
+    // prints right away, so earlier results have to come out first.
+    if (strcmp(cmd, "withdraw") != 0 && strcmp(cmd, "balance") != 0) {
+        atm_flush(atm);
+    }
+
     // BEGIN-SESSION
     if (strcmp(cmd, "begin-session") == 0)
     {
         char *user = strtok(NULL, " \t");
+        char *inline_pin = atm->batch ? strtok(NULL, " \t") : NULL;
         char *extra = strtok(NULL, " \t");
 
         // If someone is already logged in
@@ -243,100 +703,77 @@ void atm_process_command(ATM *atm, char *command)
         }
 
         // Invalid inputs: wrong number of arguments or invalid username
-        if (user == NULL || extra != NULL || !is_valid_username(user)) {
-            printf("Usage: begin-session <user-name>\n");
+        if (user == NULL || extra != NULL || !is_valid_username(user) ||
+            (atm->batch && inline_pin == NULL)) {
+            printf(atm->batch ? "Usage: begin-session <user-name> <pin>\n"
+                              : "Usage: begin-session <user-name>\n");
             return;
         }
 
         // Read card file to get card_secret
-        char card_filename[300];
-        snprintf(card_filename, sizeof(card_filename), "%s.card", user);
-
-        FILE *cf = fopen(card_filename, "rb");
-        if (cf == NULL) {
-            printf("Unable to access %s's card\n", user);
-            return;
-        }
-        
-        size_t bytes_read = fread(atm->card_secret, 1, CARD_SECRET_SIZE, cf);
-        fclose(cf);
-        
-        if (bytes_read != CARD_SECRET_SIZE) {
-            printf("Unable to access %s's card\n", user);
-            return;
+        if (atm->cards != NULL) {
+            if (card_cache_get(atm->cards, user, atm->card_secret) != 0) {
+                printf("Unable to access %s's card\n", user);
+                return;
+            }
+        } else {
+            char card_filename[300];
+            snprintf(card_filename, sizeof(card_filename), "%s.card", user);
+
+            FILE *cf = fopen(card_filename, "rb");
+            if (cf == NULL) {
+                printf("Unable to access %s's card\n", user);
+                return;
+            }
+
+            size_t bytes_read = fread(atm->card_secret, 1, CARD_SECRET_SIZE, cf);
+            fclose(cf);
+
+            if (bytes_read != CARD_SECRET_SIZE) {
+                printf("Unable to access %s's card\n", user);
+                return;
+            }
         }
 
-        // Prompt for PIN
-        printf("PIN? ");
-        fflush(stdout);
-
+        // Prompt for PIN, unless it came with the command
         char pinbuf[100];
-        if (fgets(pinbuf, sizeof(pinbuf), stdin) == NULL) {
-            printf("Not authorized\n");
-            return;
+        if (atm->batch) {
+            snprintf(pinbuf, sizeof(pinbuf), "%s", inline_pin);
+        } else {
+            printf("PIN? ");
+            fflush(stdout);
+
+            if (fgets(pinbuf, sizeof(pinbuf), stdin) == NULL) {
+                printf("Not authorized\n");
+                return;
+            }
+            trim_newline(pinbuf);
         }
-        trim_newline(pinbuf);
 
         if (!is_valid_pin(pinbuf)) {
             printf("Not authorized\n");
             return;
         }
 
-        // Compute auth_token = HMAC(card_secret || PIN)
-        unsigned char auth_token[AUTH_TOKEN_SIZE];
-        if (compute_auth_token(atm->card_secret, pinbuf, auth_token) != 0) {
-            printf("Not authorized\n");
-            return;
-        }
-
         // Build login request message
-        msg_login_req_t login_req;
-        memset(&login_req, 0, sizeof(login_req));
-        login_req.header.msg_type = MSG_LOGIN_REQ;
-        prepare_username(login_req.header.username, user);
-        memcpy(login_req.auth_token, auth_token, AUTH_TOKEN_SIZE);
-        memcpy(login_req.pin, pinbuf, PIN_SIZE);
-        login_req.seq_num = htonll(atm->seq);
-
-        // Send encrypted login request
-        if (atm_send_encrypted(atm, (unsigned char*)&login_req, sizeof(login_req)) != 0) {
-            printf("Not authorized\n");
-            return;
-        }
-        
-        atm->seq++;
-
-        // Receive encrypted login response
-        unsigned char response_buf[MAX_PLAINTEXT_SIZE];
-        int response_len = atm_recv_encrypted(atm, response_buf, sizeof(response_buf));
-        
-        if (response_len < (int)sizeof(msg_login_resp_t)) {
+        wire_msg_t req, resp;
+        if (atm_build_login(&req, user, pinbuf, atm->card_secret) != 0) {
             printf("Not authorized\n");
             return;
         }
+        atm->route_tag = routing_tag(user, strlen(user));
 
-        // Parse login response
-        msg_login_resp_t *login_resp = (msg_login_resp_t*)response_buf;
-        
-        // Verify message type
-        if (login_resp->header.msg_type != MSG_LOGIN_RESP) {
-            printf("Not authorized\n");
-            return;
-        }
-        
-        uint64_t resp_seq = ntohll(login_resp->seq_num);
-        if (resp_seq != atm->seq - 1) {
-            printf("Not authorized\n");
-            return;
-        }
-
-        if (login_resp->success != 1) {
+        if (atm_transact(atm, &req, MSG_LOGIN_RESP, &resp) != 0 ||
+            resp.success != 1) {
             printf("Not authorized\n");
             return;
         }
 
         printf("Authorized\n");
         atm->logged_in = 1;
+        atm->account_id = resp.account_id;
+        atm->session_first_seq = atm->seq;
+        atm_drop_balance(atm);
         strncpy(atm->current_user, user, sizeof(atm->current_user));
         atm->current_user[sizeof(atm->current_user)-1] = '\0';
         return;
@@ -349,57 +786,30 @@ void atm_process_command(ATM *atm, char *command)
         char *extra = strtok(NULL, " \t");
 
         if (!atm->logged_in) {
+            atm_flush(atm);
             printf("No user logged in\n");
             return;
         }
 
         if (amt_str == NULL || extra != NULL) {
+            atm_flush(atm);
             printf("Usage: withdraw <amt>\n");
             return;
         }
 
         int amt = 0;
         if (!parse_amount(amt_str, &amt)) {
+            atm_flush(atm);
             printf("Usage: withdraw <amt>\n");
             return;
         }
 
         // Build withdraw request
-        msg_withdraw_req_t req;
-        memset(&req, 0, sizeof(req));
-        req.header.msg_type = MSG_WITHDRAW_REQ;
-        prepare_username(req.header.username, atm->current_user);
-        req.amount = htonl(amt);
-        req.seq_num = htonll(atm->seq);
-
-        // Send encrypted request
-        if (atm_send_encrypted(atm, (unsigned char*)&req, sizeof(req)) != 0) {
-            return;
-        }
-        atm->seq++;
-
-        // Receive encrypted response
-        unsigned char resp_buf[MAX_PLAINTEXT_SIZE];
-        int resp_len = atm_recv_encrypted(atm, resp_buf, sizeof(resp_buf));
-        if (resp_len < (int)sizeof(msg_withdraw_resp_t)) {
-            return;
-        }
+        wire_msg_t req;
+        atm_build_request(&req, MSG_WITHDRAW_REQ, atm->wire_version, atm->account_id,
+                          atm->current_user, amt);
 
-        msg_withdraw_resp_t *resp = (msg_withdraw_resp_t*)resp_buf;
-        if (resp->header.msg_type != MSG_WITHDRAW_RESP) {
-            return;
-        }
-
-        uint64_t resp_seq = ntohll(resp->seq_num);
-        if (resp_seq != atm->seq - 1) {
-            return;
-        }
-
-        if (resp->success == 1) {
-            printf("$%d dispensed\n", amt);
-        } else {
-            printf("Insufficient funds\n");
-        }
+        atm_submit(atm, &req, MSG_WITHDRAW_RESP, amt);
         return;
     }
 
@@ -409,47 +819,29 @@ void atm_process_command(ATM *atm, char *command)
         char *extra = strtok(NULL, " \t");
 
         if (!atm->logged_in) {
+            atm_flush(atm);
             printf("No user logged in\n");
             return;
         }
 
         if (extra != NULL) {
+            atm_flush(atm);
             printf("Usage: balance\n");
             return;
         }
 
-        // Build balance request
-        msg_balance_req_t req;
-        memset(&req, 0, sizeof(req));
-        req.header.msg_type = MSG_BALANCE_REQ;
-        prepare_username(req.header.username, atm->current_user);
-        req.seq_num = htonll(atm->seq);
-
-        // Send encrypted request
-        if (atm_send_encrypted(atm, (unsigned char*)&req, sizeof(req)) != 0) {
+        int32_t balance;
+        if (atm_cached_balance(atm, &balance)) {
+            printf("$%d\n", balance);
             return;
         }
-        atm->seq++;
 
-        // Receive encrypted response
-        unsigned char resp_buf[MAX_PLAINTEXT_SIZE];
-        int resp_len = atm_recv_encrypted(atm, resp_buf, sizeof(resp_buf));
-        if (resp_len < (int)sizeof(msg_balance_resp_t)) {
-            return;
-        }
-
-        msg_balance_resp_t *resp = (msg_balance_resp_t*)resp_buf;
-        if (resp->header.msg_type != MSG_BALANCE_RESP) {
-            return;
-        }
-
-        uint64_t resp_seq = ntohll(resp->seq_num);
-        if (resp_seq != atm->seq - 1) {
-            return;
-        }
+        // Build balance request
+        wire_msg_t req;
+        atm_build_request(&req, MSG_BALANCE_REQ, atm->wire_version, atm->account_id,
+                          atm->current_user, 0);
 
-        int32_t balance = ntohl(resp->balance);
-        printf("$%d\n", balance);
+        atm_submit(atm, &req, MSG_BALANCE_RESP, 0);
         return;
     }
 
@@ -470,6 +862,8 @@ void atm_process_command(ATM *atm, char *command)
 
         atm->logged_in = 0;
         atm->current_user[0] = '\0';
+        atm->account_id = 0;
+        atm_drop_balance(atm);
         printf("User logged out\n");
         return;
     }
@@ -7,9 +7,67 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdint.h>
+#include "wire.h"
+#include "card_cache.h"
 
 #define KEY_SIZE 32             // 256 bits for AES-256
 #define CARD_SECRET_SIZE 32     // 256 bits for card secret
+#define ATM_MAX_WINDOW 64       // most requests that can be in flight at once
+#define ATM_MAX_PACKET 600      // largest sealed request (MAX_ENCRYPTED_SIZE)
+
+// Retransmission timer (RFC 6298 style): RTO = SRTT + 4 * RTTVAR,
+// doubled on every retransmission, clamped to [MIN, MAX].  A request is
+// retransmitted until ATM_REQUEST_DEADLINE_US after it was first sent,
+// however small the RTO, so a slow bank gets as long as it always did.
+#define ATM_RTO_INIT_US 200000ULL   // before the first RTT sample
+#define ATM_RTO_MIN_US 10000ULL
+#define ATM_RTO_MAX_US 2000000ULL
+#define ATM_REQUEST_DEADLINE_US 5000000ULL
+
+// How long a cached balance is trusted without hearing from the bank.
+// The bank pushes MSG_BALANCE_INVAL when a balance changes; the lease
+// bounds how stale a balance can get if that push is lost.
+#define ATM_BALANCE_LEASE_US 1000000ULL
+
+// A request that has been sent but whose result has not been printed
+typedef struct _ATMPending
+{
+    unsigned long long seq;      // sequence number of the request
+    uint8_t resp_type;           // expected response type
+    int32_t amount;              // withdraw amount, for the result message
+    unsigned long long sent_us;  // first transmission, for RTT samples
+    unsigned long long deadline_us; // retransmit (or give up) at this time
+    unsigned long long rto_us;   // current timeout for this request
+    int retries;                 // retransmissions so far
+    int done;                    // 1 once the response has arrived or we gave up
+    int failed;                  // 1 if we gave up; a withdraw's outcome is unknown
+    int cacheable;               // 1 if nothing else was in flight with it
+    unsigned long long epoch;    // ATM balance_epoch when it was sent
+    uint8_t success;             // from the response
+    int32_t balance;             // from the response
+    size_t packet_len;
+    unsigned char packet[ATM_MAX_PACKET]; // sealed request, resent as is
+} ATMPending;
+
+// Round-trip time estimate in microseconds; srtt_us == 0 until the
+// first sample
+typedef struct _RttEstimator
+{
+    unsigned long long srtt_us;
+    unsigned long long rttvar_us;
+    unsigned long long rto_us;
+} RttEstimator;
+
+typedef struct _ATMStats
+{
+    unsigned long long requests;     // distinct requests sent
+    unsigned long long retransmits;
+    unsigned long long timeouts;     // requests abandoned at ATM_REQUEST_DEADLINE_US
+    unsigned long long rtt_samples;
+    unsigned long long balance_hits;  // balance commands answered from the cache
+    unsigned long long invalidations; // pushed by the bank for the current user
+} ATMStats;
 
 typedef struct _ATM
 {
@@ -21,13 +79,40 @@ typedef struct _ATM
     // Protocol / session state
     int  logged_in;              // 0 = no user logged in, 1 = user logged in
     char current_user[251];      // currently logged-in username (if any)
+    uint32_t account_id;         // bank-assigned account ID (compact format only)
+    uint8_t wire_version;        // WIRE_COMPACT or WIRE_LEGACY
+    int use_envelope;            // 1 = prefix packets with a routing envelope
+    uint32_t route_tag;          // routing_tag() of the user being served
+    int batch;                   // 1 = PINs inline in begin-session, no prompts
+    CardCache *cards;            // NULL = read <user>.card on every begin-session
 
     // Cryptographic state (Idea 1)
-    unsigned char key_K[KEY_SIZE];                  // shared symmetric key from *.atm file
+    unsigned char key_K[KEY_SIZE];                  // symmetric key from *.atm file
+    uint16_t key_id;                                // its keystore ID (init -n), 0 = shared key
     unsigned long long seq;                         // sequence number for replay protection
     unsigned char card_secret[CARD_SECRET_SIZE];   // current user's card secret (loaded from .card)
     int key_loaded;                                 // 1 if key_K has been loaded, 0 otherwise
 
+    // Pipelining: up to `window` balance/withdraw requests in flight,
+    // results printed in request order
+    int window;                                     // 1 = stop-and-wait
+    ATMPending pending[ATM_MAX_WINDOW];             // ring of outstanding requests
+    int pending_head;                               // index of the oldest
+    int pending_count;
+
+    // Balance cache for the logged-in user.  Filled from balance and
+    // withdraw responses, dropped on an invalidation from the bank or
+    // when the lease runs out.
+    unsigned long long balance_lease_us;            // 0 = always ask the bank
+    int balance_cached;
+    int32_t cached_balance;
+    unsigned long long balance_expires_us;
+    unsigned long long balance_epoch;               // bumped whenever the cache is dropped
+    unsigned long long session_first_seq;           // our own withdraws this session are >= this
+
+    RttEstimator rtt;
+    ATMStats stats;
+
 } ATM;
 
 ATM* atm_create(const char *atm_init_file);
@@ -35,5 +120,26 @@ void atm_free(ATM *atm);
 ssize_t atm_send(ATM *atm, char *data, size_t data_len);
 ssize_t atm_recv(ATM *atm, char *data, size_t max_data_len);
 void atm_process_command(ATM *atm, char *command);
+void atm_flush(ATM *atm);
+void atm_print_stats(ATM *atm, FILE *out);
+
+void rtt_init(RttEstimator *rtt);
+void rtt_sample(RttEstimator *rtt, unsigned long long rtt_us);
+unsigned long long rtt_backoff(unsigned long long rto_us);
+unsigned long long atm_now_us(void);
+
+// Request construction and sealing, shared with bin/loadgen and the
+// session engine
+int atm_build_login(wire_msg_t *req, const char *user, const char *pin,
+                    const unsigned char *card_secret);
+void atm_build_request(wire_msg_t *req, uint8_t msg_type, uint8_t version,
+                       uint32_t account_id, const char *user, int32_t amount);
+// key_id != 0 always adds the envelope, which carries it
+int atm_seal_request(const unsigned char *key, uint16_t key_id, int use_envelope,
+                     uint32_t route_tag, const wire_msg_t *req,
+                     unsigned char *packet, size_t *packet_len);
+// Read an *.atm file: a shared key, or a terminal's key and key ID from
+// `init -n`
+int atm_load_key(const char *atm_init_file, unsigned char *key, uint16_t *key_id);
 
 #endif
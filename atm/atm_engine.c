@@ -0,0 +1,580 @@
+#include "atm_engine.h"
+#include "atm.h"
+#include "card_cache.h"
+#include "ports.h"
+#include "protocol.h"
+#include "crypto.h"
+#include "wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+// Seq counter values reserved on disk at a time
+#define SEQ_RESERVE_BLOCK (1ULL << 20)
+
+typedef struct
+{
+    AtmOp op;
+    int32_t amount;
+    char pin[PIN_SIZE + 1];
+    AtmCallback cb;
+    void *arg;
+} QueuedOp;
+
+struct _AtmSession
+{
+    AtmEngine *engine;
+    uint32_t id;
+    char user[251];
+    uint32_t route_tag;
+    uint32_t account_id;         // 0 until a login succeeds
+    void *user_data;
+    int in_callback;
+    int closed;                  // closed from inside a callback; freed after it returns
+
+    QueuedOp queue[ATM_SESSION_QUEUE];
+    int head, count;
+
+    // The request for queue[head], once started
+    uint64_t seq;                // 0 = nothing in flight
+    uint8_t resp_type;
+    int immediate;               // finish with `status` at the next run, no request sent
+    AtmStatus status;
+    unsigned long long sent_us, deadline_us, rto_us;
+    int retries;
+    int heap_idx;                // position in the timer heap, -1 if not in it
+    size_t packet_len;
+    unsigned char packet[ATM_MAX_PACKET];
+};
+
+struct _AtmEngine
+{
+    int sockfd;
+    struct sockaddr_in rtr_addr;
+    unsigned char key[KEY_SIZE];
+    uint16_t key_id;             // 0 = shared key
+    CardCache *cards;
+    RttEstimator rtt;
+    uint64_t counter;            // high bits of every seq
+    uint64_t reserved;           // counter values below this are recorded on disk
+    int seq_fd;                  // <atm_init_file>.seq; -1 = none
+
+    AtmSession *slots[ATM_ENGINE_MAX_SESSIONS];
+    uint32_t free_ids[ATM_ENGINE_MAX_SESSIONS];
+    int nfree;
+
+    // Sessions with a timer running, as a binary min-heap on deadline
+    AtmSession *heap[ATM_ENGINE_MAX_SESSIONS];
+    int heap_len;
+
+    int pending;
+    int callbacks;               // run during the current atm_engine_run
+};
+
+// Timer heap
+
+static void heap_set(AtmEngine *e, int i, AtmSession *s)
+{
+    e->heap[i] = s;
+    s->heap_idx = i;
+}
+
+static void heap_up(AtmEngine *e, int i)
+{
+    AtmSession *s = e->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (e->heap[parent]->deadline_us <= s->deadline_us)
+            break;
+        heap_set(e, i, e->heap[parent]);
+        i = parent;
+    }
+    heap_set(e, i, s);
+}
+
+static void heap_down(AtmEngine *e, int i)
+{
+    AtmSession *s = e->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= e->heap_len)
+            break;
+        if (child + 1 < e->heap_len &&
+            e->heap[child + 1]->deadline_us < e->heap[child]->deadline_us)
+            child++;
+        if (s->deadline_us <= e->heap[child]->deadline_us)
+            break;
+        heap_set(e, i, e->heap[child]);
+        i = child;
+    }
+    heap_set(e, i, s);
+}
+
+static void timer_set(AtmEngine *e, AtmSession *s, unsigned long long deadline_us)
+{
+    s->deadline_us = deadline_us;
+    if (s->heap_idx < 0) {
+        heap_set(e, e->heap_len++, s);
+        heap_up(e, s->heap_idx);
+    } else {
+        heap_up(e, s->heap_idx);
+        heap_down(e, s->heap_idx);
+    }
+}
+
+static void timer_clear(AtmEngine *e, AtmSession *s)
+{
+    int i = s->heap_idx;
+    if (i < 0)
+        return;
+
+    s->heap_idx = -1;
+    AtmSession *last = e->heap[--e->heap_len];
+    if (last != s) {
+        heap_set(e, i, last);
+        heap_up(e, i);
+        heap_down(e, last->heap_idx);
+    }
+}
+
+// Sequence numbers.  The counter has to stay above every value a
+// previous run used, or the bank drops our requests as replays.  The
+// highest value that may have been used is kept in <atm_init_file>.seq,
+// reserved SEQ_RESERVE_BLOCK at a time so the file is written once per
+// block, not once per request.
+
+static int seq_reserve(AtmEngine *e, uint64_t upto)
+{
+    unsigned char buf[8];
+    if (upto > ATM_ENGINE_COUNTER_MAX)
+        upto = ATM_ENGINE_COUNTER_MAX;
+    for (int i = 0; i < 8; i++)
+        buf[i] = (unsigned char)(upto >> (56 - 8 * i));
+
+    if (e->seq_fd >= 0 &&
+        (pwrite(e->seq_fd, buf, sizeof(buf), 0) != (ssize_t)sizeof(buf) ||
+         fdatasync(e->seq_fd) != 0))
+        return -1;
+    e->reserved = upto;
+    return 0;
+}
+
+// Start above both the recorded high-water mark and the clock, so seqs
+// also rise across runs that lost (or never had) the file
+static int seq_init(AtmEngine *e, const char *atm_init_file)
+{
+    char path[512];
+    unsigned char buf[8];
+    uint64_t start = 0;
+
+    e->seq_fd = -1;
+    if (snprintf(path, sizeof(path), "%s.seq", atm_init_file) < (int)sizeof(path))
+        e->seq_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (e->seq_fd >= 0 && pread(e->seq_fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf)) {
+        for (int i = 0; i < 8; i++)
+            start = (start << 8) | buf[i];
+    }
+
+    uint64_t floor = atm_engine_counter_floor();
+    e->counter = (floor > start) ? floor : start;
+    if (e->counter > ATM_ENGINE_COUNTER_MAX - SEQ_RESERVE_BLOCK) {
+        fprintf(stderr, "atm engine: seq counter in %s is too large to go on from\n", path);
+        return -1;
+    }
+    return seq_reserve(e, e->counter + SEQ_RESERVE_BLOCK);
+}
+
+// The counter must not be shifted past 64 bits: the seqs would wrap to
+// values the bank has already seen and every request would be dropped
+static int seq_next(AtmEngine *e, AtmSession *s, uint64_t *seq)
+{
+    if (e->counter >= ATM_ENGINE_COUNTER_MAX) {
+        fprintf(stderr, "atm engine: out of seqs\n");
+        return -1;
+    }
+    if (e->counter + 1 >= e->reserved &&
+        seq_reserve(e, e->counter + 1 + SEQ_RESERVE_BLOCK) != 0)
+        return -1;
+    *seq = (++e->counter << ATM_ENGINE_ID_BITS) | s->id;
+    return 0;
+}
+
+// Sessions
+
+static int valid_user(const char *u)
+{
+    size_t n = strlen(u);
+    if (n == 0 || n > 250)
+        return 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!isalpha((unsigned char)u[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static int valid_pin(const char *pin)
+{
+    if (strlen(pin) != PIN_SIZE)
+        return 0;
+    for (int i = 0; i < PIN_SIZE; i++) {
+        if (!isdigit((unsigned char)pin[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static int read_card(AtmEngine *e, const char *user, unsigned char *secret)
+{
+    if (e->cards != NULL)
+        return card_cache_get(e->cards, user, secret);
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s.card", user);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    size_t n = fread(secret, 1, CARD_SECRET_SIZE, f);
+    fclose(f);
+    return n == CARD_SECRET_SIZE ? 0 : -1;
+}
+
+// Finish the queued operation at the head without a request
+static void finish_now(AtmEngine *e, AtmSession *s, AtmStatus status)
+{
+    s->immediate = 1;
+    s->status = status;
+    s->seq = 0;
+    timer_set(e, s, 0);
+}
+
+// Send the request for the operation at the head of s's queue
+static void start_next(AtmEngine *e, AtmSession *s)
+{
+    if (s->count == 0 || s->seq != 0 || s->immediate)
+        return;
+
+    QueuedOp *op = &s->queue[s->head];
+    wire_msg_t req;
+
+    if (op->op == ATM_OP_LOGIN) {
+        unsigned char secret[CARD_SECRET_SIZE];
+        int ok = valid_pin(op->pin) && read_card(e, s->user, secret) == 0 &&
+                 atm_build_login(&req, s->user, op->pin, secret) == 0;
+        memset(secret, 0, sizeof(secret));
+        if (!ok) {
+            finish_now(e, s, ATM_DENIED);
+            return;
+        }
+        s->resp_type = MSG_LOGIN_RESP;
+    } else if (s->account_id == 0) {
+        finish_now(e, s, ATM_NOT_LOGGED_IN);
+        return;
+    } else if (op->op == ATM_OP_BALANCE) {
+        atm_build_request(&req, MSG_BALANCE_REQ, WIRE_COMPACT, s->account_id, s->user, 0);
+        s->resp_type = MSG_BALANCE_RESP;
+    } else {
+        atm_build_request(&req, MSG_WITHDRAW_REQ, WIRE_COMPACT, s->account_id, s->user, op->amount);
+        s->resp_type = MSG_WITHDRAW_RESP;
+    }
+
+    unsigned long long now = atm_now_us();
+    req.version = WIRE_COMPACT;
+
+    if (seq_next(e, s, &req.seq_num) != 0 ||
+        atm_seal_request(e->key, e->key_id, 1, s->route_tag, &req, s->packet, &s->packet_len) != 0) {
+        finish_now(e, s, ATM_DENIED);
+        return;
+    }
+
+    s->seq = req.seq_num;
+    s->sent_us = now;
+    s->rto_us = e->rtt.rto_us;
+    s->retries = 0;
+    sendto(e->sockfd, s->packet, s->packet_len, 0, (struct sockaddr*)&e->rtr_addr, sizeof(e->rtr_addr));
+    timer_set(e, s, now + s->rto_us);
+}
+
+static void free_session(AtmEngine *e, AtmSession *s)
+{
+    timer_clear(e, s);
+    e->pending -= s->count;
+    e->slots[s->id] = NULL;
+    e->free_ids[e->nfree++] = s->id;
+    free(s);
+}
+
+// Report the head operation's result and move on to the next one
+static void complete(AtmEngine *e, AtmSession *s, AtmResult *result)
+{
+    QueuedOp op = s->queue[s->head];
+    s->head = (s->head + 1) % ATM_SESSION_QUEUE;
+    s->count--;
+    e->pending--;
+    s->seq = 0;
+    s->immediate = 0;
+    timer_clear(e, s);
+
+    result->op = op.op;
+    result->amount = op.amount;
+
+    if (op.cb != NULL) {
+        s->in_callback++;
+        op.cb(s, result, op.arg);
+        s->in_callback--;
+        e->callbacks++;
+    }
+
+    if (s->closed && s->in_callback == 0) {
+        free_session(e, s);
+        return;
+    }
+
+    start_next(e, s);
+}
+
+static void handle_response(AtmEngine *e, const unsigned char *packet, ssize_t len)
+{
+    unsigned char plaintext[MAX_PLAINTEXT_SIZE];
+    wire_msg_t resp;
+
+    int n = open_message(e->key, packet, len, plaintext, sizeof(plaintext));
+    if (n < 0 || wire_decode(plaintext, n, &resp) != 0)
+        return;
+
+    AtmSession *s = e->slots[resp.seq_num & (ATM_ENGINE_MAX_SESSIONS - 1)];
+    if (s == NULL || s->closed || s->seq == 0 || s->seq != resp.seq_num ||
+        s->resp_type != resp.msg_type)
+        return;     // stale, duplicate, or for a closed session
+
+    if (s->retries == 0)
+        rtt_sample(&e->rtt, atm_now_us() - s->sent_us);
+
+    AtmResult result;
+    memset(&result, 0, sizeof(result));
+    if (resp.msg_type == MSG_LOGIN_RESP) {
+        s->account_id = resp.success ? resp.account_id : 0;
+        result.status = resp.success ? ATM_OK : ATM_DENIED;
+    } else if (resp.msg_type == MSG_BALANCE_RESP) {
+        result.status = ATM_OK;
+        result.balance = resp.balance;
+    } else {
+        result.status = resp.success ? ATM_OK : ATM_INSUFFICIENT;
+        result.balance = resp.balance;
+    }
+    complete(e, s, &result);
+}
+
+// Retransmit with the timeout doubled, until ATM_REQUEST_DEADLINE_US
+// after the first send, as bin/atm does
+static void expire(AtmEngine *e, AtmSession *s, unsigned long long now)
+{
+    AtmResult result;
+    memset(&result, 0, sizeof(result));
+    unsigned long long give_up = s->sent_us + ATM_REQUEST_DEADLINE_US;
+
+    if (s->immediate) {
+        result.status = s->status;
+        complete(e, s, &result);
+    } else if (now >= give_up) {
+        result.status = ATM_TIMEOUT;
+        complete(e, s, &result);
+    } else {
+        sendto(e->sockfd, s->packet, s->packet_len, 0, (struct sockaddr*)&e->rtr_addr,
+               sizeof(e->rtr_addr));
+        s->retries++;
+        s->rto_us = rtt_backoff(s->rto_us);
+        timer_set(e, s, (now + s->rto_us < give_up) ? now + s->rto_us : give_up);
+    }
+}
+
+static int enqueue(AtmSession *s, AtmOp kind, const char *pin, int32_t amount,
+                   AtmCallback cb, void *arg)
+{
+    if (s->closed || s->count == ATM_SESSION_QUEUE)
+        return -1;
+
+    QueuedOp *op = &s->queue[(s->head + s->count) % ATM_SESSION_QUEUE];
+    op->op = kind;
+    op->amount = amount;
+    snprintf(op->pin, sizeof(op->pin), "%s", pin != NULL ? pin : "");
+    op->cb = cb;
+    op->arg = arg;
+    s->count++;
+    s->engine->pending++;
+
+    start_next(s->engine, s);
+    return 0;
+}
+
+// Public API
+
+AtmEngine* atm_engine_create(const char *atm_init_file, const char *card_dir)
+{
+    AtmEngine *e = (AtmEngine*) calloc(1, sizeof(AtmEngine));
+    if (e == NULL)
+        return NULL;
+
+    if (atm_load_key(atm_init_file, e->key, &e->key_id) != 0) {
+        free(e);
+        return NULL;
+    }
+    if (seq_init(e, atm_init_file) != 0) {
+        close(e->seq_fd);
+        free(e);
+        return NULL;
+    }
+
+    e->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 4 << 20;
+    setsockopt(e->sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(ATM_PORT);
+    if (bind(e->sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(e->sockfd);
+        if (e->seq_fd >= 0)
+            close(e->seq_fd);
+        free(e);
+        return NULL;
+    }
+
+    memset(&e->rtr_addr, 0, sizeof(e->rtr_addr));
+    e->rtr_addr.sin_family = AF_INET;
+    e->rtr_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    e->rtr_addr.sin_port = htons(ROUTER_PORT);
+
+    if (card_dir != NULL)
+        e->cards = card_cache_create(card_dir);
+
+    rtt_init(&e->rtt);
+
+    // Hand out low IDs first
+    for (int i = 0; i < ATM_ENGINE_MAX_SESSIONS; i++)
+        e->free_ids[i] = ATM_ENGINE_MAX_SESSIONS - 1 - i;
+    e->nfree = ATM_ENGINE_MAX_SESSIONS;
+
+    return e;
+}
+
+void atm_engine_free(AtmEngine *e)
+{
+    if (e == NULL)
+        return;
+
+    for (int i = 0; i < ATM_ENGINE_MAX_SESSIONS; i++) {
+        free(e->slots[i]);
+    }
+    card_cache_free(e->cards);
+    close(e->sockfd);
+    if (e->seq_fd >= 0)
+        close(e->seq_fd);
+    memset(e->key, 0, sizeof(e->key));
+    free(e);
+}
+
+int atm_engine_fd(const AtmEngine *e)
+{
+    return e->sockfd;
+}
+
+int atm_engine_pending(const AtmEngine *e)
+{
+    return e->pending;
+}
+
+int atm_engine_run(AtmEngine *e, int timeout_ms)
+{
+    unsigned char packet[ATM_MAX_PACKET];
+
+    e->callbacks = 0;
+    if (e->pending == 0 && timeout_ms < 0)
+        return 0;
+
+    unsigned long long now = atm_now_us();
+    int wait_ms = timeout_ms;
+    if (e->heap_len > 0) {
+        unsigned long long next = e->heap[0]->deadline_us;
+        int due_ms = next > now ? (int)((next - now + 999) / 1000) : 0;
+        if (wait_ms < 0 || due_ms < wait_ms)
+            wait_ms = due_ms;
+    }
+
+    struct pollfd pfd = { .fd = e->sockfd, .events = POLLIN };
+    if (poll(&pfd, 1, wait_ms) > 0) {
+        ssize_t n;
+        while ((n = recv(e->sockfd, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+            handle_response(e, packet, n);
+    }
+
+    now = atm_now_us();
+    while (e->heap_len > 0 && e->heap[0]->deadline_us <= now)
+        expire(e, e->heap[0], now);
+
+    return e->callbacks;
+}
+
+AtmSession* atm_session_open(AtmEngine *e, const char *user, void *user_data)
+{
+    if (e->nfree == 0 || !valid_user(user))
+        return NULL;
+
+    AtmSession *s = (AtmSession*) calloc(1, sizeof(AtmSession));
+    if (s == NULL)
+        return NULL;
+
+    s->engine = e;
+    s->id = e->free_ids[--e->nfree];
+    snprintf(s->user, sizeof(s->user), "%s", user);
+    s->route_tag = routing_tag(user, strlen(user));
+    s->user_data = user_data;
+    s->heap_idx = -1;
+    e->slots[s->id] = s;
+    return s;
+}
+
+void atm_session_close(AtmSession *s)
+{
+    if (s == NULL || s->closed)
+        return;
+
+    // Late responses for this session no longer match anything
+    s->closed = 1;
+    if (s->in_callback == 0)
+        free_session(s->engine, s);
+}
+
+void* atm_session_data(const AtmSession *s)
+{
+    return s->user_data;
+}
+
+const char* atm_session_user(const AtmSession *s)
+{
+    return s->user;
+}
+
+int atm_session_login(AtmSession *s, const char *pin, AtmCallback cb, void *arg)
+{
+    return enqueue(s, ATM_OP_LOGIN, pin, 0, cb, arg);
+}
+
+int atm_session_balance(AtmSession *s, AtmCallback cb, void *arg)
+{
+    return enqueue(s, ATM_OP_BALANCE, NULL, 0, cb, arg);
+}
+
+int atm_session_withdraw(AtmSession *s, int32_t amount, AtmCallback cb, void *arg)
+{
+    if (amount < 0)
+        return -1;
+    return enqueue(s, ATM_OP_WITHDRAW, NULL, amount, cb, arg);
+}
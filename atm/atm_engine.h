@@ -0,0 +1,110 @@
+/*
+ * Event-driven ATM engine: many customer sessions in one process.
+ *
+ * Each session is one logged-in customer with its own account and
+ * request queue.  Submit calls never block; they queue the operation and
+ * return.  atm_engine_run drives everything over a single socket bound
+ * to ATM_PORT: requests go out one at a time per session, responses are
+ * matched back to their session by sequence number, lost requests are
+ * retransmitted on the same adaptive timer as bin/atm, and each
+ * operation's callback fires once with its result.  Requests always carry
+ * the routing envelope, so a sharded router sends each to its owner.
+ *
+ * Callbacks run inside atm_engine_run and may submit more operations or
+ * close the session.  Sessions for the same user must not be open at
+ * the same time; the bank tracks sequence numbers per account.
+ *
+ *     AtmEngine *e = atm_engine_create("bank.atm", ".");
+ *     AtmSession *s = atm_session_open(e, "alice", NULL);
+ *     atm_session_login(s, "1234", on_done, NULL);
+ *     atm_session_balance(s, on_done, NULL);
+ *     while (atm_engine_pending(e) > 0)
+ *         atm_engine_run(e, -1);
+ */
+
+#ifndef __ATM_ENGINE_H__
+#define __ATM_ENGINE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define ATM_ENGINE_ID_BITS 13                           // low bits of each seq name the session
+#define ATM_ENGINE_MAX_SESSIONS (1 << ATM_ENGINE_ID_BITS)
+#define ATM_SESSION_QUEUE 16                            // operations queued per session
+#define ATM_ENGINE_COUNTER_MAX (UINT64_MAX >> ATM_ENGINE_ID_BITS) // seq counter limit
+
+// The lowest seq counter a run starting now may use: the wall clock in
+// milliseconds.  That keeps seqs rising across runs and leaves the
+// counter room for some 70,000 years.  Shared with replay -k.
+static inline uint64_t atm_engine_counter_floor(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+typedef enum
+{
+    ATM_OP_LOGIN,
+    ATM_OP_BALANCE,
+    ATM_OP_WITHDRAW,
+} AtmOp;
+
+typedef enum
+{
+    ATM_OK,
+    ATM_DENIED,             // wrong PIN, unknown user or no card
+    ATM_INSUFFICIENT,       // withdraw larger than the balance
+    ATM_NOT_LOGGED_IN,      // balance/withdraw before a successful login
+    ATM_TIMEOUT,            // no answer by ATM_REQUEST_DEADLINE_US.  For a withdraw
+                            // the outcome is unknown: the bank may have run it.
+} AtmStatus;
+
+typedef struct _AtmResult
+{
+    AtmOp op;
+    AtmStatus status;
+    int32_t amount;         // withdraw amount requested
+    int32_t balance;        // balance requests only
+} AtmResult;
+
+typedef struct _AtmEngine AtmEngine;
+typedef struct _AtmSession AtmSession;
+
+typedef void (*AtmCallback)(AtmSession *session, const AtmResult *result, void *arg);
+
+// card_dir: directory of <user>.card files, kept in a CardCache; NULL
+// reads the card from the working directory at each login.
+//
+// Seqs keep rising across runs: the highest one handed out is recorded
+// in <atm_init_file>.seq, and a run starts above both that and
+// atm_engine_counter_floor().  If the file can't be created the clock
+// alone seeds them, so a run that averaged more than one request per
+// millisecond, or a clock stepped back since, gets requests dropped as
+// replays until the clock catches up.  Returns NULL if the recorded
+// counter is too close to ATM_ENGINE_COUNTER_MAX.
+AtmEngine* atm_engine_create(const char *atm_init_file, const char *card_dir);
+void atm_engine_free(AtmEngine *engine);
+
+// The socket, for callers that poll() it alongside their own fds
+int atm_engine_fd(const AtmEngine *engine);
+
+// Operations queued or in flight, over all sessions
+int atm_engine_pending(const AtmEngine *engine);
+
+// Wait up to timeout_ms (-1 = until something completes) for responses,
+// handle them and any expired timers.  Returns the number of callbacks run.
+int atm_engine_run(AtmEngine *engine, int timeout_ms);
+
+AtmSession* atm_session_open(AtmEngine *engine, const char *user, void *user_data);
+// Queued operations are dropped without their callbacks
+void atm_session_close(AtmSession *session);
+void* atm_session_data(const AtmSession *session);
+const char* atm_session_user(const AtmSession *session);
+
+// Each returns 0, or -1 if the session's queue is full
+int atm_session_login(AtmSession *session, const char *pin, AtmCallback cb, void *arg);
+int atm_session_balance(AtmSession *session, AtmCallback cb, void *arg);
+int atm_session_withdraw(AtmSession *session, int32_t amount, AtmCallback cb, void *arg);
+
+#endif
@@ -0,0 +1,52 @@
+// Drives one engine session per <user> <pin> pair: log in, check the
+// balance, withdraw $1, check again.  Needs the router and bank running.
+
+#include "atm_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *status_names[] = {
+    "ok", "denied", "insufficient funds", "not logged in", "timed out"
+};
+
+static void on_result(AtmSession *s, const AtmResult *r, void *arg)
+{
+    const char *what = arg;
+
+    if (r->op == ATM_OP_BALANCE && r->status == ATM_OK)
+        printf("%s: %s $%d\n", atm_session_user(s), what, r->balance);
+    else
+        printf("%s: %s %s\n", atm_session_user(s), what, status_names[r->status]);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || argc % 2 != 0) {
+        printf("Usage: %s <file.atm> <user> <pin> [<user> <pin> ...]\n", argv[0]);
+        return 64;
+    }
+
+    AtmEngine *e = atm_engine_create(argv[1], ".");
+    if (e == NULL) {
+        printf("Error opening ATM initialization file\n");
+        return 64;
+    }
+
+    for (int i = 2; i < argc; i += 2) {
+        AtmSession *s = atm_session_open(e, argv[i], NULL);
+        if (s == NULL) {
+            printf("%s: cannot open session\n", argv[i]);
+            continue;
+        }
+        atm_session_login(s, argv[i + 1], on_result, "login");
+        atm_session_balance(s, on_result, "balance");
+        atm_session_withdraw(s, 1, on_result, "withdraw $1");
+        atm_session_balance(s, on_result, "balance");
+    }
+
+    while (atm_engine_pending(e) > 0)
+        atm_engine_run(e, -1);
+
+    atm_engine_free(e);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+#include "card_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define CARD_SUFFIX ".card"
+
+static void card_path(const CardCache *cache, const char *username, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%s" CARD_SUFFIX, cache->dir, username);
+}
+
+// Read a card file into a new entry; NULL if it is missing or short
+static CardEntry* load_card(CardCache *cache, const char *username)
+{
+    char path[600];
+    struct stat st;
+
+    card_path(cache, username, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    CardEntry *e = (CardEntry*) malloc(sizeof(CardEntry));
+    if (e == NULL || fread(e->secret, 1, sizeof(e->secret), f) != sizeof(e->secret) ||
+        fstat(fileno(f), &st) != 0) {
+        free(e);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    snprintf(e->username, sizeof(e->username), "%s", username);
+    e->mtime = st.st_mtime;
+    hash_table_add(cache->table, e->username, e);
+    return e;
+}
+
+static void evict(CardCache *cache, const char *username)
+{
+    CardEntry *e = (CardEntry*) hash_table_find(cache->table, username);
+    if (e != NULL) {
+        hash_table_del(cache->table, username);
+        memset(e->secret, 0, sizeof(e->secret));
+        free(e);
+        cache->evictions++;
+    }
+}
+
+static void evict_all(CardCache *cache)
+{
+    uint32_t pos = 0;
+    char *username;
+    void *e;
+
+    while (hash_table_next(cache->table, &pos, &username, &e)) {
+        evict(cache, username);
+    }
+}
+
+// Turn "<user>.card" into "<user>"; 0 if name isn't a card file
+static int card_user(const char *name, char *user, size_t len)
+{
+    size_t n = strlen(name);
+    size_t suffix = strlen(CARD_SUFFIX);
+    if (n <= suffix || n - suffix >= len || strcmp(name + n - suffix, CARD_SUFFIX) != 0) {
+        return 0;
+    }
+    memcpy(user, name, n - suffix);
+    user[n - suffix] = '\0';
+    return 1;
+}
+
+// Apply queued change notifications; a no-op syscall when there are none
+static void drain_events(CardCache *cache)
+{
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(cache->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event*) p;
+            char user[251];
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                evict_all(cache);
+            } else if (ev->len > 0 && card_user(ev->name, user, sizeof(user))) {
+                evict(cache, user);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#else
+    (void) cache;
+#endif
+}
+
+CardCache* card_cache_create(const char *dir)
+{
+    CardCache *cache = (CardCache*) calloc(1, sizeof(CardCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    cache->table = hash_table_create(CARD_CACHE_BINS);
+    cache->inotify_fd = -1;
+
+#ifdef __linux__
+    // Watch before loading, so a change during the scan is not missed
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd >= 0 &&
+        inotify_add_watch(cache->inotify_fd, dir, IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE |
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB) < 0) {
+        close(cache->inotify_fd);
+        cache->inotify_fd = -1;
+    }
+#endif
+
+    DIR *d = opendir(dir);
+    if (d != NULL) {
+        struct dirent *de;
+        char user[251];
+        while ((de = readdir(d)) != NULL) {
+            if (card_user(de->d_name, user, sizeof(user))) {
+                load_card(cache, user);
+            }
+        }
+        closedir(d);
+    }
+
+    return cache;
+}
+
+void card_cache_free(CardCache *cache)
+{
+    if (cache != NULL) {
+        evict_all(cache);
+        hash_table_free(cache->table);
+        if (cache->inotify_fd >= 0) {
+            close(cache->inotify_fd);
+        }
+        free(cache);
+    }
+}
+
+// Copy username's card secret into secret.  Returns 0, or -1 if the
+// user has no readable card.
+int card_cache_get(CardCache *cache, const char *username, unsigned char *secret)
+{
+    if (cache->inotify_fd >= 0) {
+        drain_events(cache);
+    }
+
+    CardEntry *e = (CardEntry*) hash_table_find(cache->table, username);
+
+    // No inotify: fall back to checking the file hasn't changed
+    if (e != NULL && cache->inotify_fd < 0) {
+        char path[600];
+        struct stat st;
+        card_path(cache, username, path, sizeof(path));
+        if (stat(path, &st) != 0 || st.st_mtime != e->mtime) {
+            evict(cache, username);
+            e = NULL;
+        }
+    }
+
+    if (e != NULL) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+        e = load_card(cache, username);
+        if (e == NULL) {
+            return -1;
+        }
+    }
+
+    memcpy(secret, e->secret, sizeof(e->secret));
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * In-memory cache of card secrets for the ATM.
+ *
+ * Every <user>.card in the directory is read once, up front, into a
+ * hash table; begin-session then looks the secret up instead of opening
+ * the file.  An inotify watch on the directory evicts a user as soon as
+ * their card file is rewritten, renamed or deleted, and the next lookup
+ * reads it again.  Without inotify, each lookup compares the file's
+ * mtime with the cached one instead.
+ */
+
+#ifndef __CARD_CACHE_H__
+#define __CARD_CACHE_H__
+
+#include <time.h>
+#include "hash_table.h"
+
+#define CARD_CACHE_BINS 1024
+
+typedef struct _CardEntry
+{
+    char username[251];
+    unsigned char secret[32];        // CARD_SECRET_SIZE
+    time_t mtime;                    // only checked without inotify
+} CardEntry;
+
+typedef struct _CardCache
+{
+    char dir[256];
+    HashTable *table;                // username -> CardEntry*
+    int inotify_fd;                  // -1 when unavailable
+    unsigned long long hits, misses, evictions;
+} CardCache;
+
+CardCache* card_cache_create(const char *dir);
+void card_cache_free(CardCache *cache);
+int card_cache_get(CardCache *cache, const char *username, unsigned char *secret);
+
+#endif
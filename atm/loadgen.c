@@ -0,0 +1,493 @@
+/*
+ * Load generator: many virtual ATMs driving the bank through the router.
+ *
+ * Usage: loadgen [-u users] [-t threads] [-d secs] [-r rate] [-m login:balance:withdraw]
+ *                [-i interval_secs] [-T timeout_ms] [-c card_dir] [-P pin] [-e] <file.atm>
+ *        loadgen -S [-u users] [-P pin] [-B balance]
+ *
+ * Each virtual user is one ATM session for account lg<index>, with at most
+ * one request in flight.  Requests are built and sealed with the same code
+ * as bin/atm (atm_build_login, atm_build_request, atm_seal_request).  All
+ * threads share one socket bound to ATM_PORT: whichever thread receives a
+ * response completes it, and in closed-loop mode (the default) sends that
+ * user's next request straight away.  With -r, each thread instead sends
+ * at a fixed share of `rate` requests/s to whichever of its users is idle,
+ * and latency is measured from the scheduled send time.
+ *
+ * -S prints create-user lines for the virtual users; feed them to the bank
+ * and point -c at the directory the bank wrote the card files to.
+ *
+ * Prints one JSON line per interval and a total, with throughput and
+ * p50/p99/p999 latency.
+ */
+
+#include "atm.h"
+#include "ports.h"
+#include "protocol.h"
+#include "crypto.h"
+#include "wire.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define LOADGEN_MAX_USERS 4096
+#define LOADGEN_ID_BITS 12               // low bits of every seq name the user
+#define LOADGEN_MAX_THREADS 64
+#define HIST_SUB 16                      // linear sub-buckets per power of two
+#define HIST_BUCKETS 1024
+
+// Request slot states; anything else is the seq of the request in flight
+#define SLOT_IDLE 0
+#define SLOT_CLAIMED 1
+
+typedef struct
+{
+    char name[16];
+    unsigned char card_secret[CARD_SECRET_SIZE];
+    uint32_t route_tag;
+    uint32_t account_id;         // 0 until logged in
+    uint64_t counter;            // per-user request counter, high bits of seq
+    uint64_t sent_ns;            // when the request in flight was (scheduled to be) sent
+    uint8_t resp_type;
+    uint64_t inflight;           // SLOT_IDLE, SLOT_CLAIMED or a seq
+} VUser;
+
+typedef struct
+{
+    uint64_t hist[HIST_BUCKETS]; // latency histogram, written by one thread
+    uint64_t completed;
+    uint64_t timeouts;
+    uint64_t failures;           // logins refused, withdraws declined
+    uint64_t skipped;            // open loop: no idle user at send time
+} __attribute__((aligned(64))) ThreadStats;
+
+typedef struct
+{
+    int index;
+    uint64_t rng;
+    ThreadStats stats;
+} Worker;
+
+static struct
+{
+    int sockfd;
+    struct sockaddr_in rtr_addr;
+    unsigned char key[KEY_SIZE];
+    uint16_t key_id;             // 0 = shared key
+    int envelope;
+    int nusers, nthreads;
+    double rate;                 // requests/s over all threads; 0 = closed loop
+    unsigned mix[3];             // login, balance, withdraw weights
+    uint64_t timeout_ns;
+    char pin[PIN_SIZE + 1];
+    volatile int stop;
+    VUser users[LOADGEN_MAX_USERS];
+} lg;
+
+static void user_name(int i, char *out)
+{
+    // lg + base-26 index: usernames must be letters only
+    char tmp[8];
+    int n = 0;
+    do {
+        tmp[n++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    out[0] = 'l';
+    out[1] = 'g';
+    for (int k = 0; k < n; k++)
+        out[2 + k] = tmp[n - 1 - k];
+    out[2 + n] = '\0';
+}
+
+static uint64_t next_rand(uint64_t *state)
+{
+    // splitmix64
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int hist_bucket(uint64_t us)
+{
+    if (us < HIST_SUB)
+        return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int b = (msb - 3) * HIST_SUB + (int)((us >> (msb - 4)) & (HIST_SUB - 1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_value(int b)
+{
+    if (b < HIST_SUB)
+        return (uint64_t)b;
+    int msb = b / HIST_SUB + 3;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB)) << (msb - 4);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double pct)
+{
+    uint64_t want = (uint64_t)(total * pct), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return hist_value(b);
+    }
+    return 0;
+}
+
+// Pick and send the next request for u, which the caller owns
+static void issue(Worker *w, VUser *u, uint64_t sched_ns)
+{
+    wire_msg_t req;
+    unsigned char packet[MAX_ENCRYPTED_SIZE + sizeof(envelope_t)];
+    size_t packet_len;
+
+    int kind = 0;
+    if (u->account_id != 0) {
+        uint64_t r = next_rand(&w->rng) % (lg.mix[0] + lg.mix[1] + lg.mix[2]);
+        kind = (r < lg.mix[0]) ? 0 : (r < lg.mix[0] + lg.mix[1]) ? 1 : 2;
+    }
+
+    if (kind == 0) {
+        atm_build_login(&req, u->name, lg.pin, u->card_secret);
+        u->resp_type = MSG_LOGIN_RESP;
+    } else if (kind == 1) {
+        atm_build_request(&req, MSG_BALANCE_REQ, WIRE_COMPACT, u->account_id, u->name, 0);
+        u->resp_type = MSG_BALANCE_RESP;
+    } else {
+        atm_build_request(&req, MSG_WITHDRAW_REQ, WIRE_COMPACT, u->account_id, u->name, 1);
+        u->resp_type = MSG_WITHDRAW_RESP;
+    }
+
+    uint64_t seq = (++u->counter << LOADGEN_ID_BITS) | (uint64_t)(u - lg.users);
+    req.version = WIRE_COMPACT;
+    req.seq_num = seq;
+
+    if (atm_seal_request(lg.key, lg.key_id, lg.envelope, u->route_tag, &req, packet, &packet_len) != 0) {
+        __atomic_store_n(&u->inflight, SLOT_IDLE, __ATOMIC_RELEASE);
+        return;
+    }
+
+    u->sent_ns = sched_ns;
+    __atomic_store_n(&u->inflight, seq, __ATOMIC_RELEASE);
+    sendto(lg.sockfd, packet, packet_len, 0, (struct sockaddr*)&lg.rtr_addr, sizeof(lg.rtr_addr));
+}
+
+// Take ownership of u if its request seq is still in flight
+static int claim(VUser *u, uint64_t seq)
+{
+    return seq > SLOT_CLAIMED &&
+           __atomic_compare_exchange_n(&u->inflight, &seq, SLOT_CLAIMED, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static void count(uint64_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void handle_response(Worker *w, const unsigned char *packet, ssize_t len)
+{
+    unsigned char plaintext[MAX_PLAINTEXT_SIZE];
+    wire_msg_t resp;
+
+    int n = open_message(lg.key, packet, len, plaintext, sizeof(plaintext));
+    if (n < 0 || wire_decode(plaintext, n, &resp) != 0 || resp.msg_type == MSG_BALANCE_INVAL)
+        return;
+
+    uint32_t id = (uint32_t)(resp.seq_num & ((1u << LOADGEN_ID_BITS) - 1));
+    if (id >= (uint32_t)lg.nusers)
+        return;
+
+    VUser *u = &lg.users[id];
+    if (!claim(u, resp.seq_num))
+        return;                     // timed out already, or a duplicate
+
+    if (resp.msg_type == MSG_LOGIN_RESP)
+        u->account_id = resp.success ? resp.account_id : 0;
+    if ((resp.msg_type == MSG_LOGIN_RESP || resp.msg_type == MSG_WITHDRAW_RESP) && !resp.success)
+        count(&w->stats.failures);
+
+    uint64_t now = bench_now_ns();
+    count(&w->stats.hist[hist_bucket((now - u->sent_ns) / 1000)]);
+    count(&w->stats.completed);
+
+    if (lg.rate == 0 && !lg.stop)
+        issue(w, u, now);
+    else
+        __atomic_store_n(&u->inflight, SLOT_IDLE, __ATOMIC_RELEASE);
+}
+
+// Abandon requests from this thread's users that have waited too long
+static void expire(Worker *w, uint64_t now)
+{
+    for (int i = w->index; i < lg.nusers; i += lg.nthreads) {
+        VUser *u = &lg.users[i];
+        uint64_t seq = __atomic_load_n(&u->inflight, __ATOMIC_ACQUIRE);
+        if (seq <= SLOT_CLAIMED || now - u->sent_ns < lg.timeout_ns || !claim(u, seq))
+            continue;
+
+        count(&w->stats.timeouts);
+        u->account_id = 0;          // log in again; the session may be gone
+        if (lg.rate == 0 && !lg.stop)
+            issue(w, u, now);
+        else
+            __atomic_store_n(&u->inflight, SLOT_IDLE, __ATOMIC_RELEASE);
+    }
+}
+
+static void *worker_loop(void *arg)
+{
+    Worker *w = (Worker*) arg;
+    unsigned char packet[MAX_ENCRYPTED_SIZE];
+    uint64_t now = bench_now_ns();
+    uint64_t next_expire = now + 10000000ULL;
+    uint64_t interval_ns = lg.rate > 0 ? (uint64_t)(1e9 * lg.nthreads / lg.rate) : 0;
+    uint64_t next_send = now;
+    int cursor = w->index;
+
+    // Closed loop: every user starts with one request
+    if (lg.rate == 0) {
+        for (int i = w->index; i < lg.nusers; i += lg.nthreads) {
+            lg.users[i].inflight = SLOT_CLAIMED;
+            issue(w, &lg.users[i], now);
+        }
+    }
+
+    struct pollfd pfd = { .fd = lg.sockfd, .events = POLLIN };
+
+    while (!lg.stop) {
+        int timeout_ms = 10;
+        if (interval_ns > 0) {
+            now = bench_now_ns();
+            timeout_ms = next_send > now ? (int)((next_send - now) / 1000000ULL) : 0;
+        }
+
+        if (poll(&pfd, 1, timeout_ms) > 0) {
+            ssize_t n;
+            while ((n = recv(lg.sockfd, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+                handle_response(w, packet, n);
+        }
+
+        now = bench_now_ns();
+
+        // Open loop: send everything that is due, to the next idle user
+        while (interval_ns > 0 && now >= next_send && !lg.stop) {
+            VUser *u = NULL;
+            for (int tries = 0; tries < lg.nusers; tries++) {
+                VUser *c = &lg.users[cursor];
+                cursor += lg.nthreads;
+                if (cursor >= lg.nusers)
+                    cursor = w->index;
+                uint64_t idle = SLOT_IDLE;
+                if (__atomic_compare_exchange_n(&c->inflight, &idle, SLOT_CLAIMED, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                    u = c;
+                    break;
+                }
+            }
+            if (u != NULL)
+                issue(w, u, next_send);
+            else
+                count(&w->stats.skipped);
+            next_send += interval_ns;
+        }
+
+        if (now >= next_expire) {
+            expire(w, now);
+            next_expire = now + 10000000ULL;
+        }
+    }
+
+    return NULL;
+}
+
+static void report(const char *phase, double t, double secs, Worker *workers, uint64_t *prev_hist,
+                   uint64_t prev[4])
+{
+    uint64_t hist[HIST_BUCKETS] = { 0 };
+    uint64_t totals[4] = { 0 };
+
+    for (int i = 0; i < lg.nthreads; i++) {
+        ThreadStats *s = &workers[i].stats;
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            hist[b] += __atomic_load_n(&s->hist[b], __ATOMIC_RELAXED);
+        totals[0] += __atomic_load_n(&s->completed, __ATOMIC_RELAXED);
+        totals[1] += __atomic_load_n(&s->timeouts, __ATOMIC_RELAXED);
+        totals[2] += __atomic_load_n(&s->failures, __ATOMIC_RELAXED);
+        totals[3] += __atomic_load_n(&s->skipped, __ATOMIC_RELAXED);
+    }
+
+    // Report the change since the previous call
+    uint64_t delta[HIST_BUCKETS];
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        delta[b] = hist[b] - prev_hist[b];
+        prev_hist[b] = hist[b];
+    }
+    uint64_t d[4];
+    for (int k = 0; k < 4; k++) {
+        d[k] = totals[k] - prev[k];
+        prev[k] = totals[k];
+    }
+
+    printf("{\"bench\":\"loadgen\",\"phase\":\"%s\",\"t\":%.1f,\"mode\":\"%s\",\"users\":%d,"
+           "\"threads\":%d,\"ops\":%llu,\"ops_per_sec\":%.0f,\"p50_us\":%llu,\"p99_us\":%llu,"
+           "\"p999_us\":%llu,\"timeouts\":%llu,\"failures\":%llu,\"skipped\":%llu}\n",
+           phase, t, lg.rate > 0 ? "open" : "closed", lg.nusers, lg.nthreads,
+           (unsigned long long)d[0], secs > 0 ? d[0] / secs : 0.0,
+           (unsigned long long)hist_percentile(delta, d[0], 0.50),
+           (unsigned long long)hist_percentile(delta, d[0], 0.99),
+           (unsigned long long)hist_percentile(delta, d[0], 0.999),
+           (unsigned long long)d[1], (unsigned long long)d[2], (unsigned long long)d[3]);
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: loadgen [-u users] [-t threads] [-d secs] [-r rate] "
+                    "[-m login:balance:withdraw]\n"
+                    "               [-i interval_secs] [-T timeout_ms] [-c card_dir] [-P pin] [-e] "
+                    "<file.atm>\n"
+                    "       loadgen -S [-u users] [-P pin] [-B balance]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *card_dir = ".";
+    int duration = 10, interval = 1, setup = 0, balance = 1000000;
+    int c;
+
+    lg.nusers = 100;
+    lg.nthreads = 1;
+    lg.mix[0] = 5;
+    lg.mix[1] = 50;
+    lg.mix[2] = 45;
+    lg.timeout_ns = 1000000000ULL;
+    strcpy(lg.pin, "1234");
+
+    while ((c = getopt(argc, argv, "u:t:d:r:m:i:T:c:P:B:eS")) != -1) {
+        switch (c) {
+            case 'u': lg.nusers = atoi(optarg); break;
+            case 't': lg.nthreads = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'r': lg.rate = atof(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u:%u", &lg.mix[0], &lg.mix[1], &lg.mix[2]) != 3 ||
+                    lg.mix[0] + lg.mix[1] + lg.mix[2] == 0)
+                    usage();
+                break;
+            case 'i': interval = atoi(optarg); break;
+            case 'T': lg.timeout_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+            case 'c': card_dir = optarg; break;
+            case 'P':
+                if (strlen(optarg) != PIN_SIZE)
+                    usage();
+                strcpy(lg.pin, optarg);
+                break;
+            case 'B': balance = atoi(optarg); break;
+            case 'e': lg.envelope = 1; break;
+            case 'S': setup = 1; break;
+            default: usage();
+        }
+    }
+
+    if (lg.nusers < 1 || lg.nusers > LOADGEN_MAX_USERS ||
+        lg.nthreads < 1 || lg.nthreads > LOADGEN_MAX_THREADS || interval < 1 || lg.rate < 0)
+        usage();
+
+    if (setup) {
+        for (int i = 0; i < lg.nusers; i++) {
+            char name[16];
+            user_name(i, name);
+            printf("create-user %s %s %d\n", name, lg.pin, balance);
+        }
+        return 0;
+    }
+
+    if (argc - optind != 1)
+        usage();
+
+    if (atm_load_key(argv[optind], lg.key, &lg.key_id) != 0) {
+        fprintf(stderr, "loadgen: can't read key from %s\n", argv[optind]);
+        return 1;
+    }
+
+    // Seqs must keep rising across runs against the same bank, reboots
+    // included, so each user's counter starts at the wall clock in
+    // microseconds.  Shifted past LOADGEN_ID_BITS that fits until 2112.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t start_counter = (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_nsec / 1000;
+    for (int i = 0; i < lg.nusers; i++) {
+        VUser *u = &lg.users[i];
+        char path[512];
+        user_name(i, u->name);
+        snprintf(path, sizeof(path), "%s/%s.card", card_dir, u->name);
+        FILE *f = fopen(path, "rb");
+        if (f == NULL || fread(u->card_secret, 1, CARD_SECRET_SIZE, f) != CARD_SECRET_SIZE) {
+            fprintf(stderr, "loadgen: can't read %s (create users with loadgen -S)\n", path);
+            return 1;
+        }
+        fclose(f);
+        u->route_tag = routing_tag(u->name, strlen(u->name));
+        u->counter = start_counter;
+    }
+
+    lg.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 4 << 20;
+    setsockopt(lg.sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(ATM_PORT);
+    if (bind(lg.sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("loadgen: bind ATM port");
+        return 1;
+    }
+
+    memset(&lg.rtr_addr, 0, sizeof(lg.rtr_addr));
+    lg.rtr_addr.sin_family = AF_INET;
+    lg.rtr_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    lg.rtr_addr.sin_port = htons(ROUTER_PORT);
+
+    static Worker workers[LOADGEN_MAX_THREADS];
+    pthread_t tids[LOADGEN_MAX_THREADS];
+    for (int i = 0; i < lg.nthreads; i++) {
+        workers[i].index = i;
+        workers[i].rng = start_counter + i;
+        pthread_create(&tids[i], NULL, worker_loop, &workers[i]);
+    }
+
+    static uint64_t interval_hist[HIST_BUCKETS], total_hist[HIST_BUCKETS];
+    uint64_t interval_prev[4] = { 0 }, total_prev[4] = { 0 };
+    uint64_t start = bench_now_ns(), last = start;
+
+    for (int t = interval; t <= duration; t += interval) {
+        uint64_t target = start + (uint64_t)t * 1000000000ULL;
+        uint64_t now = bench_now_ns();
+        if (target > now)
+            usleep((target - now) / 1000);
+        now = bench_now_ns();
+        report("interval", t, (now - last) / 1e9, workers, interval_hist, interval_prev);
+        last = now;
+    }
+
+    lg.stop = 1;
+    for (int i = 0; i < lg.nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    report("total", (last - start) / 1e9, (last - start) / 1e9, workers, total_hist, total_prev);
+
+    close(lg.sockfd);
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <sys/select.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "bank.h"
 #include "ports.h"
 
@@ -15,13 +16,30 @@ int main(int argc, char**argv)
    char sendline[1000];
    char recvline[1000];
 
+   int port = BANK_PORT;
+   int c;
+
+   // Options: -p <port> runs this bank as one shard of a cluster
+   while ((c = getopt(argc, argv, "p:")) != -1) {
+       if (c == 'p') {
+           port = atoi(optarg);
+       } else {
+           printf("Error opening bank initialization file\n");
+           return 64;
+       }
+   }
+
    // Check command line arguments
-   if (argc != 2) {
+   if (argc - optind != 1 || port <= 0 || port > 65535) {
        printf("Error opening bank initialization file\n");
        return 64;
    }
 
-   Bank *bank = bank_create(argv[1]);
+   Bank *bank = bank_create_on_port(argv[optind], (unsigned short)port);
+
+   // Unbuffered, so lines piped in together (e.g. from loadgen -S) are
+   // not stranded in stdio's buffer while select waits on the fd
+   setvbuf(stdin, NULL, _IONBF, 0);
 
    printf("%s", prompt);
    fflush(stdout);
@@ -2,13 +2,90 @@
 #include "ports.h"
 #include "protocol.h"
 #include "crypto.h"
+#include "wire.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void bank_push_invalidation(Bank *bank, int user_idx, uint64_t seq);
+
+// A KEY_SIZE-byte file is the shared key; anything else must be a
+// keystore, mapped whole and used in place
+static int bank_load_keys(Bank *bank, const char *bank_init_file)
+{
+    int fd = open(bank_init_file, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == KEY_SIZE) {
+        ssize_t n = read(fd, bank->key_K, KEY_SIZE);
+        close(fd);
+        if (n != KEY_SIZE) {
+            return -1;
+        }
+        bank->key_loaded = 1;
+        return 0;
+    }
+
+    if (st.st_size < (off_t)sizeof(keystore_header_t)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    keystore_header_t header;
+    memcpy(&header, map, sizeof(header));
+    uint32_t num_keys = ntohl(header.num_keys);
+    if (memcmp(header.magic, KEYSTORE_MAGIC, sizeof(header.magic)) != 0 ||
+        ntohl(header.key_size) != KEY_SIZE ||
+        num_keys < 1 || num_keys > KEYSTORE_MAX_KEYS ||
+        size != sizeof(header) + (size_t)num_keys * KEY_SIZE) {
+        munmap(map, size);
+        return -1;
+    }
+
+    bank->keystore_map = map;
+    bank->keystore_size = size;
+    bank->keys = (const unsigned char*)map + sizeof(header);
+    bank->num_keys = num_keys;
+    return 0;
+}
+
+// The key a packet names, or NULL if this bank doesn't have it
+static const unsigned char* bank_key(const Bank *bank, uint16_t key_id)
+{
+    if (key_id == 0) {
+        return bank->key_loaded ? bank->key_K : NULL;
+    }
+    if (key_id > bank->num_keys) {
+        return NULL;
+    }
+    return bank->keys + (size_t)(key_id - 1) * KEY_SIZE;
+}
 
 Bank* bank_create(const char *bank_init_file)
+{
+    return bank_create_on_port(bank_init_file, BANK_PORT);
+}
+
+Bank* bank_create_on_port(const char *bank_init_file, unsigned short port)
 {
     Bank *bank = (Bank*) malloc(sizeof(Bank));
     if(bank == NULL)
@@ -28,33 +105,30 @@ Bank* bank_create(const char *bank_init_file)
     bzero(&bank->bank_addr, sizeof(bank->bank_addr));
     bank->bank_addr.sin_family = AF_INET;
     bank->bank_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    bank->bank_addr.sin_port = htons(BANK_PORT);
+    bank->bank_addr.sin_port = htons(port);
     bind(bank->sockfd,(struct sockaddr *)&bank->bank_addr,sizeof(bank->bank_addr));
 
     // Initialize account state
     bank->num_users = 0;
+    bank->names = intern_create(MAX_USERS);
+    if (bank->names == NULL) {
+        perror("Could not allocate Bank");
+        exit(1);
+    }
     
     bank->key_loaded = 0;
     memset(bank->key_K, 0, KEY_SIZE);
-    
-    // Load key from init file
-    FILE *key_file = fopen(bank_init_file, "rb");
-    if (key_file == NULL) {
-        printf("Error opening bank initialization file\n");
-        free(bank);
-        exit(64);
-    }
-    
-    size_t bytes_read = fread(bank->key_K, 1, KEY_SIZE, key_file);
-    fclose(key_file);
-    
-    if (bytes_read != KEY_SIZE) {
+    bank->keys = NULL;
+    bank->num_keys = 0;
+    bank->keystore_map = NULL;
+    bank->keystore_size = 0;
+
+    if (bank_load_keys(bank, bank_init_file) != 0) {
         printf("Error opening bank initialization file\n");
+        intern_free(bank->names);
         free(bank);
         exit(64);
     }
-    
-    bank->key_loaded = 1;
 
     return bank;
 }
@@ -64,6 +138,10 @@ void bank_free(Bank *bank)
     if(bank != NULL)
     {
         close(bank->sockfd);
+        intern_free(bank->names);
+        if (bank->keystore_map != NULL) {
+            munmap(bank->keystore_map, bank->keystore_size);
+        }
         free(bank);
     }
 }
@@ -128,14 +206,11 @@ static int parse_amount(const char *s, int *out)
     return 1;
 }
 
-static int find_user(Bank *bank, const char *username)
+// Only create-user interns names, so a name's ID is its account ID and
+// names nobody has don't take up arena space
+static int find_user(Bank *bank, const char *username, size_t len)
 {
-    for (int i = 0; i < bank->num_users; i++) {
-        if (strcmp(bank->users[i].username, username) == 0) {
-            return i;
-        }
-    }
-    return -1;
+    return (int)intern_lookup(bank->names, username, len) - 1;
 }
 
 void bank_process_local_command(Bank *bank, char *command, size_t len)
@@ -177,7 +252,7 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
         }
 
         // Check if user already exists
-        if (find_user(bank, user) != -1) {
+        if (find_user(bank, user, strlen(user)) != -1) {
             printf("Error:  user %s already exists\n", user);
             return;
         }
@@ -210,15 +285,27 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
             return;
         }
 
+        size_t user_len = strlen(user);
+        InternId name = intern(bank->names, user, user_len);
+        if (name == 0) {
+            remove(card_filename);
+            printf("Error creating card file for user %s\n", user);
+            return;
+        }
+
         User *u = &bank->users[bank->num_users++];
-        strncpy(u->username, user, sizeof(u->username));
-        u->username[sizeof(u->username)-1] = '\0';
+        u->name = name;
+        u->route_tag = routing_tag(user, user_len);
         strncpy(u->pin, pin, sizeof(u->pin));
         u->pin[sizeof(u->pin)-1] = '\0';
         u->balance = balance;
         
         memcpy(u->card_secret, card_secret, CARD_SECRET_SIZE);
         u->last_seq = 0;
+        u->seq_window = 1;   // sequence number 0 is never valid
+        memset(u->responses, 0, sizeof(u->responses));
+        u->num_watchers = 0;
+        u->next_evict = 0;
 
         printf("Created user %s\n", user);
         return;
@@ -239,7 +326,7 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
             return;
         }
 
-        int idx = find_user(bank, user);
+        int idx = find_user(bank, user, strlen(user));
         if (idx == -1) {
             printf("No such user\n");
             return;
@@ -251,6 +338,9 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
         }
 
         bank->users[idx].balance += amt;
+        if (amt != 0) {
+            bank_push_invalidation(bank, idx, 0);
+        }
         printf("$%d added to %s's account\n", amt, user);
         return;
     }
@@ -265,7 +355,7 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
             return;
         }
 
-        int idx = find_user(bank, user);
+        int idx = find_user(bank, user, strlen(user));
         if (idx == -1) {
             printf("No such user\n");
             return;
@@ -279,290 +369,340 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
     printf("Invalid command\n");
 }
 
-// Encrypt and send message
-static int bank_send_encrypted(Bank *bank, const unsigned char *plaintext, size_t plaintext_len)
+// Encrypt under key and send message
+static int bank_send_encrypted(Bank *bank, const unsigned char *key,
+                               const unsigned char *plaintext, size_t plaintext_len)
 {
-    unsigned char encrypted[MAX_ENCRYPTED_SIZE];
-    unsigned char iv[16];
-    unsigned char ciphertext[MAX_ENCRYPTED_SIZE];
-    size_t ciphertext_len = 0;
-    unsigned char hmac[32];
-    
-    // Encrypt the plaintext
-    if (aes_encrypt(bank->key_K, plaintext, plaintext_len, 
-                    ciphertext, &ciphertext_len, iv) != 0) {
+    unsigned char packet[MAX_ENCRYPTED_SIZE];
+    size_t packet_len = 0;
+
+    if (plaintext_len > MAX_PLAINTEXT_SIZE) {
         return -1;
     }
-    
-    // Build the packet: IV || ciphertext
-    memcpy(encrypted, iv, 16);
-    memcpy(encrypted + 16, ciphertext, ciphertext_len);
-    size_t data_len = 16 + ciphertext_len;
-    
-    if (hmac_sha256(bank->key_K, encrypted, data_len, hmac) != 0) {
+
+    // Build IV || ciphertext || HMAC directly in the packet buffer
+    if (seal_message(key, plaintext, plaintext_len, packet, &packet_len) != 0) {
         return -1;
     }
-    
-    // Append HMAC
-    memcpy(encrypted + data_len, hmac, 32);
-    size_t total_len = data_len + 32;
-    
+
     // Send to ATM via router
-    ssize_t sent = bank_send(bank, (char*)encrypted, total_len);
-    if (sent < 0 || (size_t)sent != total_len) {
+    ssize_t sent = bank_send(bank, (char*)packet, packet_len);
+    if (sent < 0 || (size_t)sent != packet_len) {
         return -1;
     }
-    
+
     return 0;
 }
 
-// Decrypt received message
+// Decrypt received message, with or without a routing envelope.  The
+// envelope names the key; a plain packet is under the shared key.
 static int bank_decrypt_message(Bank *bank, const unsigned char *encrypted, size_t encrypted_len,
-                                 unsigned char *plaintext, size_t max_plaintext_len)
+                                 unsigned char *plaintext, size_t max_plaintext_len,
+                                 uint16_t *key_id)
 {
-    if (encrypted_len < (16 + 32)) {  // Minimum: IV + HMAC
-        return -1;
+    size_t header_len = 0;
+    *key_id = 0;
+    if (packet_has_envelope(encrypted, encrypted_len)) {
+        header_len = sizeof(envelope_t);
+        *key_id = ntohs(((const envelope_t*)encrypted)->key_id);
     }
-    
-    // Extract components
-    const unsigned char *iv = encrypted;
-    size_t data_len = encrypted_len - 32;  // Everything except HMAC
-    const unsigned char *received_hmac = encrypted + data_len;
-    
-    if (hmac_verify(bank->key_K, encrypted, data_len, received_hmac) != 0) {
+
+    const unsigned char *key = bank_key(bank, *key_id);
+    if (key == NULL) {
         return -1;
     }
-    
-    // Decrypt ciphertext
-    const unsigned char *ciphertext = encrypted + 16;
-    size_t ciphertext_len = data_len - 16;
-    size_t plaintext_len = 0;
-    
-    if (aes_decrypt(bank->key_K, ciphertext, ciphertext_len, iv,
-                    plaintext, &plaintext_len) != 0) {
-        return -1;
+    return open_message_with_header(key, header_len, encrypted, encrypted_len,
+                                    plaintext, max_plaintext_len);
+}
+
+// Sliding-window replay check: a sequence number is fresh if it is
+// newer than anything seen, or within REPLAY_WINDOW of the newest and
+// not seen before.  This lets pipelined requests arrive out of order.
+static int seq_is_fresh(const User *user, uint64_t seq)
+{
+    if (seq > user->last_seq) {
+        return 1;
     }
-    
-    if (plaintext_len > max_plaintext_len) {
-        return -1;
+
+    uint64_t age = user->last_seq - seq;
+    if (age >= REPLAY_WINDOW) {
+        return 0;
     }
-    
-    return (int)plaintext_len;
+
+    return (user->seq_window & (1ULL << age)) == 0;
+}
+
+static void seq_mark_seen(User *user, uint64_t seq)
+{
+    if (seq > user->last_seq) {
+        uint64_t shift = seq - user->last_seq;
+        user->seq_window = (shift >= REPLAY_WINDOW) ? 0 : (user->seq_window << shift);
+        user->seq_window |= 1;
+        user->last_seq = seq;
+    } else {
+        user->seq_window |= 1ULL << (user->last_seq - seq);
+    }
+}
+
+// Every seq inside the replay window has its own slot, so a request
+// the window still knows about always finds its answer here.  Answers
+// are keyed by the request's HMAC as well as its seq: only a byte-for-byte
+// retransmission gets one, never a different request reusing the seq.
+static void cache_response(User *user, uint64_t seq, const unsigned char *tag,
+                           const wire_msg_t *resp, int32_t value)
+{
+    CachedResponse *c = &user->responses[seq % REPLAY_WINDOW];
+    c->seq = seq;
+    c->msg_type = resp->msg_type;
+    c->success = resp->success;
+    c->value = value;
+    memcpy(c->tag, tag, REQUEST_TAG_SIZE);
+}
+
+static const CachedResponse* cached_response(const User *user, uint64_t seq,
+                                             const unsigned char *tag, uint8_t msg_type)
+{
+    const CachedResponse *c = &user->responses[seq % REPLAY_WINDOW];
+    if (c->seq != seq || c->msg_type != msg_type ||
+        memcmp(c->tag, tag, REQUEST_TAG_SIZE) != 0) {
+        return NULL;
+    }
+    return c;
+}
+
+// Find the user a request refers to: by account ID for compact
+// messages, by username otherwise
+static int find_request_user(Bank *bank, const wire_msg_t *req)
+{
+    if (req->version == WIRE_COMPACT && req->msg_type != MSG_LOGIN_REQ) {
+        if (req->account_id == 0 || req->account_id > (uint32_t)bank->num_users) {
+            return -1;
+        }
+        return (int)req->account_id - 1;
+    }
+    return find_user(bank, req->username, req->username_len);
+}
+
+// Push an invalidation of user_idx's balance to the ATMs holding w's key
+static void bank_push_to(Bank *bank, int user_idx, const Watcher *w, uint64_t seq)
+{
+    User *user = &bank->users[user_idx];
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+    wire_msg_t msg;
+
+    const unsigned char *key = bank_key(bank, w->key_id);
+    if (key == NULL) {
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.version = w->version;
+    msg.msg_type = MSG_BALANCE_INVAL;
+    msg.account_id = (uint32_t)user_idx + 1;
+    msg.seq_num = seq;
+    wire_set_username(&msg, intern_str(bank->names, user->name));
+
+    int len = wire_encode(&msg, buf, sizeof(buf));
+    if (len >= 0) {
+        bank_send_encrypted(bank, key, buf, len);
+    }
+}
+
+// Tell ATMs that may be caching user_idx's balance that it changed, one
+// push under each watching key.  seq is the withdraw that changed it, so
+// the ATM that sent it (and has the new balance from the response) can
+// ignore this; 0 for deposits.
+static void bank_push_invalidation(Bank *bank, int user_idx, uint64_t seq)
+{
+    User *user = &bank->users[user_idx];
+
+    for (int i = 0; i < user->num_watchers; i++) {
+        bank_push_to(bank, user_idx, &user->watchers[i], seq);
+    }
+}
+
+// Remember that the ATM behind req, which sent it under key_id, now
+// knows user_idx's balance.  When the set is full the oldest watcher is
+// pushed an invalidation before it is dropped, so no ATM is left caching
+// a balance the bank won't tell it about.
+static void bank_watch(Bank *bank, int user_idx, const wire_msg_t *req, uint16_t key_id)
+{
+    User *user = &bank->users[user_idx];
+    Watcher *w = NULL;
+
+    for (int i = 0; i < user->num_watchers && w == NULL; i++) {
+        if (user->watchers[i].key_id == key_id) {
+            w = &user->watchers[i];
+        }
+    }
+    if (w == NULL && user->num_watchers < MAX_WATCHERS) {
+        w = &user->watchers[user->num_watchers++];
+    } else if (w == NULL) {
+        w = &user->watchers[user->next_evict];
+        user->next_evict = (user->next_evict + 1) % MAX_WATCHERS;
+        bank_push_to(bank, user_idx, w, 0);
+    }
+    w->key_id = key_id;
+    w->version = req->version;
+}
+
+// Answer req with resp in the same wire format, under the request's key
+static void bank_reply(Bank *bank, const unsigned char *key, const wire_msg_t *req,
+                       wire_msg_t *resp)
+{
+    unsigned char buf[MAX_PLAINTEXT_SIZE];
+
+    resp->version = req->version;
+    resp->seq_num = req->seq_num;  // Echo back the sequence number
+    if (req->version == WIRE_LEGACY) {
+        memcpy(resp->username, req->username, req->username_len + 1);
+        resp->username_len = req->username_len;
+    }
+
+    int len = wire_encode(resp, buf, sizeof(buf));
+    if (len < 0) {
+        return;
+    }
+
+    bank_send_encrypted(bank, key, buf, len);
 }
 
 void bank_process_remote_command(Bank *bank, char *command, size_t len)
 {
     unsigned char plaintext[MAX_PLAINTEXT_SIZE];
+    uint16_t key_id;
     
     int plaintext_len = bank_decrypt_message(bank, (unsigned char*)command, len, 
-                                             plaintext, sizeof(plaintext));
+                                             plaintext, sizeof(plaintext), &key_id);
     if (plaintext_len < 0) {
         return;
     }
+    const unsigned char *key = bank_key(bank, key_id);
     
-    // All messages have at least a header
-    if (plaintext_len < (int)sizeof(msg_header_t)) {
+    wire_msg_t req, resp;
+    if (wire_decode(plaintext, plaintext_len, &req) != 0) {
         return;
     }
     
-    msg_header_t *header = (msg_header_t*)plaintext;
+    // Authenticated above, so the trailing HMAC identifies this exact packet
+    const unsigned char *tag = (const unsigned char*)command + len - HMAC_SIZE;
+
+    int user_idx = find_request_user(bank, &req);
+    User *user = (user_idx == -1) ? NULL : &bank->users[user_idx];
+
+    // An enveloped request must have been routed by its own account's
+    // tag; anything else was sent to the wrong shard
+    if (user != NULL && packet_has_envelope((unsigned char*)command, len)) {
+        const envelope_t *env = (const envelope_t*)command;
+        if (ntohl(env->route_tag) != user->route_tag) {
+            return;
+        }
+    }
     
     // Route based on message type
-    switch (header->msg_type) {
+    switch (req.msg_type) {
         case MSG_LOGIN_REQ: {
-            if (plaintext_len < (int)sizeof(msg_login_req_t)) {
-                return;
-            }
-            
-            msg_login_req_t *req = (msg_login_req_t*)plaintext;
+            resp.msg_type = MSG_LOGIN_RESP;
+            resp.success = 0;
+            resp.account_id = 0;
             
-            char username[USERNAME_SIZE + 1];
-            memcpy(username, req->header.username, USERNAME_SIZE);
-            username[USERNAME_SIZE] = '\0';
-            
-            for (int i = 0; i < USERNAME_SIZE; i++) {
-                if (username[i] == '\0') break;
-            }
-            
-            // Find user
-            int user_idx = find_user(bank, username);
-            if (user_idx == -1) {
-                msg_login_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_LOGIN_RESP;
-                prepare_username(resp.header.username, username);
-                resp.success = 0;
-                resp.seq_num = req->seq_num;  // Echo back the sequence number
-                
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            if (user == NULL) {
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
-            
-            User *user = &bank->users[user_idx];
-            uint64_t req_seq = ntohll(req->seq_num);
-            
-            // Replay protection
-            if (req_seq <= user->last_seq) {
-                msg_login_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_LOGIN_RESP;
-                prepare_username(resp.header.username, username);
-                resp.success = 0;
-                resp.seq_num = req->seq_num;
-                
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+
+            // Retransmission of a login we accepted, or a replay
+            if (!seq_is_fresh(user, req.seq_num)) {
+                const CachedResponse *c = cached_response(user, req.seq_num, tag, MSG_LOGIN_RESP);
+                if (c != NULL) {
+                    resp.success = c->success;
+                    resp.account_id = (uint32_t)c->value;
+                }
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
             
             unsigned char expected_token[AUTH_TOKEN_SIZE];
             if (compute_auth_token(user->card_secret, user->pin, expected_token) != 0) {
-                msg_login_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_LOGIN_RESP;
-                prepare_username(resp.header.username, username);
-                resp.success = 0;
-                resp.seq_num = req->seq_num;
-                
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
             
             volatile unsigned char tokens_match = 0;
             for (int i = 0; i < AUTH_TOKEN_SIZE; i++) {
-                tokens_match |= (expected_token[i] ^ req->auth_token[i]);
+                tokens_match |= (expected_token[i] ^ req.auth_token[i]);
             }
             
             if (tokens_match != 0) {
-                msg_login_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_LOGIN_RESP;
-                prepare_username(resp.header.username, username);
-                resp.success = 0;
-                resp.seq_num = req->seq_num;
-                
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
             
-            user->last_seq = req_seq;
+            seq_mark_seen(user, req.seq_num);
             
-            msg_login_resp_t resp;
-            memset(&resp, 0, sizeof(resp));
-            resp.header.msg_type = MSG_LOGIN_RESP;
-            prepare_username(resp.header.username, username);
             resp.success = 1;
-            resp.seq_num = req->seq_num;
-            
-            bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            resp.account_id = (uint32_t)user_idx + 1;
+            cache_response(user, req.seq_num, tag, &resp, (int32_t)resp.account_id);
+            bank_reply(bank, key, &req, &resp);
             break;
         }
         
         case MSG_BALANCE_REQ: {
-            if (plaintext_len < (int)sizeof(msg_balance_req_t)) {
-                return;
-            }
+            resp.msg_type = MSG_BALANCE_RESP;
+            resp.account_id = req.account_id;
 
-            msg_balance_req_t *req = (msg_balance_req_t*)plaintext;
-
-            char username[USERNAME_SIZE + 1];
-            memcpy(username, req->header.username, USERNAME_SIZE);
-            username[USERNAME_SIZE] = '\0';
-
-            int user_idx = find_user(bank, username);
-            if (user_idx == -1) {
-                msg_balance_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_BALANCE_RESP;
-                prepare_username(resp.header.username, username);
-                resp.balance = htonl(0);
-                resp.seq_num = req->seq_num;
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            if (user == NULL) {
+                resp.balance = 0;
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
 
-            User *user = &bank->users[user_idx];
-            uint64_t req_seq = ntohll(req->seq_num);
-
-            if (req_seq <= user->last_seq) {
-                msg_balance_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_BALANCE_RESP;
-                prepare_username(resp.header.username, username);
-                resp.balance = htonl(user->balance);
-                resp.seq_num = req->seq_num;
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
-                return;
+            // Replays are answered but not recorded
+            if (seq_is_fresh(user, req.seq_num)) {
+                seq_mark_seen(user, req.seq_num);
             }
 
-            user->last_seq = req_seq;
-
-            msg_balance_resp_t resp;
-            memset(&resp, 0, sizeof(resp));
-            resp.header.msg_type = MSG_BALANCE_RESP;
-            prepare_username(resp.header.username, username);
-            resp.balance = htonl(user->balance);
-            resp.seq_num = req->seq_num;
-            bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            resp.balance = user->balance;
+            bank_watch(bank, user_idx, &req, key_id);
+            bank_reply(bank, key, &req, &resp);
             break;
         }
 
         case MSG_WITHDRAW_REQ: {
-            if (plaintext_len < (int)sizeof(msg_withdraw_req_t)) {
-                return;
-            }
+            resp.msg_type = MSG_WITHDRAW_RESP;
+            resp.account_id = req.account_id;
+            resp.success = 0;
 
-            msg_withdraw_req_t *req = (msg_withdraw_req_t*)plaintext;
-
-            char username[USERNAME_SIZE + 1];
-            memcpy(username, req->header.username, USERNAME_SIZE);
-            username[USERNAME_SIZE] = '\0';
-
-            int user_idx = find_user(bank, username);
-            if (user_idx == -1) {
-                msg_withdraw_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_WITHDRAW_RESP;
-                prepare_username(resp.header.username, username);
-                resp.success = 0;
-                resp.new_balance = htonl(0);
-                resp.seq_num = req->seq_num;
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            if (user == NULL) {
+                resp.balance = 0;
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
 
-            User *user = &bank->users[user_idx];
-            uint64_t req_seq = ntohll(req->seq_num);
-
-            if (req_seq <= user->last_seq) {
-                msg_withdraw_resp_t resp;
-                memset(&resp, 0, sizeof(resp));
-                resp.header.msg_type = MSG_WITHDRAW_RESP;
-                prepare_username(resp.header.username, username);
-                resp.success = 0;
-                resp.new_balance = htonl(user->balance);
-                resp.seq_num = req->seq_num;
-                bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            // A retransmitted withdraw gets its original answer and is
+            // not executed again
+            if (!seq_is_fresh(user, req.seq_num)) {
+                const CachedResponse *c = cached_response(user, req.seq_num, tag, MSG_WITHDRAW_RESP);
+                resp.success = (c != NULL) ? c->success : 0;
+                resp.balance = (c != NULL) ? c->value : user->balance;
+                bank_reply(bank, key, &req, &resp);
                 return;
             }
 
-            int32_t amount = ntohl(req->amount);
-            uint8_t success = 0;
-
-            if (amount >= 0 && amount <= user->balance) {
-                user->balance -= amount;
-                success = 1;
+            if (req.amount >= 0 && req.amount <= user->balance) {
+                user->balance -= req.amount;
+                resp.success = 1;
             }
 
-            user->last_seq = req_seq;
+            seq_mark_seen(user, req.seq_num);
 
-            msg_withdraw_resp_t resp;
-            memset(&resp, 0, sizeof(resp));
-            resp.header.msg_type = MSG_WITHDRAW_RESP;
-            prepare_username(resp.header.username, username);
-            resp.success = success;
-            resp.new_balance = htonl(user->balance);
-            resp.seq_num = req->seq_num;
-            bank_send_encrypted(bank, (unsigned char*)&resp, sizeof(resp));
+            resp.balance = user->balance;
+            cache_response(user, req.seq_num, tag, &resp, resp.balance);
+            bank_reply(bank, key, &req, &resp);
+            if (resp.success && req.amount != 0) {
+                bank_push_invalidation(bank, user_idx, req.seq_num);
+            }
+            bank_watch(bank, user_idx, &req, key_id);
             break;
         }
             
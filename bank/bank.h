@@ -7,17 +7,45 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdint.h>
+#include "intern.h"
 
-#define MAX_USERS 1000
+#define MAX_USERS 4096
+#define REPLAY_WINDOW 64        // pipelined requests may arrive this far out of order
 #define KEY_SIZE 32             // 256 bits for AES-256
 #define CARD_SECRET_SIZE 32     // 256 bits for card secret
+#define REQUEST_TAG_SIZE 16     // prefix of a request's HMAC kept to recognise retransmissions
+#define MAX_WATCHERS 8          // ATM keys per user told of balance changes
+
+// The answer to an already-executed request, kept so a retransmitted
+// request gets the same answer instead of being executed twice
+typedef struct _CachedResponse {
+    uint64_t seq;                                   // request answered; 0 = empty
+    uint8_t  msg_type;
+    uint8_t  success;
+    int32_t  value;                                 // balance, or account ID for logins
+    unsigned char tag[REQUEST_TAG_SIZE];            // HMAC of the request answered
+} CachedResponse;
+
+// An ATM key that has been told a user's balance and may cache it.  With
+// a shared key every ATM is key 0, so one entry covers them all.
+typedef struct _Watcher {
+    uint16_t key_id;                                // key to push invalidations under
+    uint8_t  version;                               // wire format to push them in
+} Watcher;
 
 typedef struct _User {
-    char username[251];                             // [a-zA-Z]+, up to 250 chars + null
+    InternId name;                                  // in Bank.names; equals the account ID
+    uint32_t route_tag;                             // routing_tag() of the name
     char pin[5];                                    // 4 digits + null
     int  balance;                                   // current balance
     unsigned char card_secret[CARD_SECRET_SIZE];   // per-user card secret for authentication
-    unsigned long long last_seq;                    // last valid sequence number (replay protection)
+    unsigned long long last_seq;                    // highest valid sequence number (replay protection)
+    unsigned long long seq_window;                  // bit i set: last_seq - i has been seen
+    CachedResponse responses[REPLAY_WINDOW];        // indexed by seq % REPLAY_WINDOW
+    Watcher watchers[MAX_WATCHERS];                 // each is pushed every balance change
+    int num_watchers;
+    int next_evict;                                 // watcher replaced when the set is full
 } User;
 
 typedef struct _Bank
@@ -31,14 +59,23 @@ typedef struct _Bank
     // Protocol / account state
     User users[MAX_USERS];
     int  num_users;
+    InternTable *names;             // exactly the users' names, in creation order
 
     // Cryptographic state (Idea 1)
     unsigned char key_K[KEY_SIZE];  // shared symmetric key from *.bank file
     int key_loaded;                  // 1 if key_K has been loaded, 0 otherwise
 
+    // Per-ATM keys, when *.bank is a keystore from `init -n`: the whole
+    // file is mapped and key ID i is keys[(i - 1) * KEY_SIZE]
+    const unsigned char *keys;
+    uint32_t num_keys;
+    void *keystore_map;
+    size_t keystore_size;
+
 } Bank;
 
 Bank* bank_create(const char *bank_init_file);
+Bank* bank_create_on_port(const char *bank_init_file, unsigned short port);
 void bank_free(Bank *bank);
 ssize_t bank_send(Bank *bank, char *data, size_t data_len);
 ssize_t bank_recv(Bank *bank, char *data, size_t max_data_len);
@@ -1,13 +1,25 @@
-// Init program: generates shared key files for ATM and Bank
-// Usage: init <filename>
+// Init program: generates key files for ATM and Bank
+// Usage: init [-n terminals] <filename>
+//
+// Without -n, one shared key goes into <filename>.atm and <filename>.bank.
+// With -n N, every terminal gets its own key: <filename>-<i>.atm for
+// i = 1..N, and a keystore <filename>.bank holding all of them (format in
+// protocol.h).  The keys are generated and the terminal files written by
+// several threads, straight into the mapped keystore.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <openssl/rand.h>
+#include "protocol.h"
 
 #define KEY_SIZE 32
+#define INIT_MAX_THREADS 16
 
 static int file_exists(const char *filename)
 {
@@ -32,30 +44,211 @@ static int write_key_file(const char *filename, const unsigned char *key)
     return 0;
 }
 
+static int terminal_filename(char *out, size_t size, const char *name, unsigned id)
+{
+    int ret = snprintf(out, size, "%s-%u.atm", name, id);
+    return (ret < 0 || ret >= (int)size) ? -1 : 0;
+}
+
+typedef struct {
+    const char *name;
+    unsigned char *keys;            // the keystore's key array, mapped
+    uint8_t *created;               // created[id]: this run wrote <name>-<id>.atm
+    unsigned first, last;           // key IDs first..last
+    int failed;
+} fleet_worker_t;
+
+// Generate keys first..last and write each terminal's file.  The file
+// is created exclusively, so an existing one is never overwritten.
+static void *fleet_worker(void *arg)
+{
+    fleet_worker_t *w = (fleet_worker_t*)arg;
+
+    for (unsigned id = w->first; id <= w->last; id++) {
+        unsigned char *key = w->keys + (size_t)(id - 1) * KEY_SIZE;
+        unsigned char file[KEY_SIZE + sizeof(uint16_t)];
+        uint16_t key_id = htons((uint16_t)id);
+        char filename[512];
+
+        if (RAND_bytes(key, KEY_SIZE) != 1 ||
+            terminal_filename(filename, sizeof(filename), w->name, id) != 0) {
+            w->failed = 1;
+            return NULL;
+        }
+        memcpy(file, key, KEY_SIZE);
+        memcpy(file + KEY_SIZE, &key_id, sizeof(key_id));
+
+        int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            w->failed = 1;
+            return NULL;
+        }
+        w->created[id] = 1;
+        ssize_t written = write(fd, file, sizeof(file));
+        if (close(fd) != 0 || written != (ssize_t)sizeof(file)) {
+            w->failed = 1;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static int init_fleet(const char *name, const char *bank_filename, unsigned n)
+{
+    char filename[512];
+
+    // Check every file up front so a clash is reported as one, not as an
+    // error halfway through
+    if (file_exists(bank_filename)) {
+        printf("Error: one of the files already exists\n");
+        return 63;
+    }
+    for (unsigned id = 1; id <= n; id++) {
+        if (terminal_filename(filename, sizeof(filename), name, id) != 0) {
+            printf("Error creating initialization files\n");
+            return 64;
+        }
+        if (file_exists(filename)) {
+            printf("Error: one of the files already exists\n");
+            return 63;
+        }
+    }
+
+    size_t size = sizeof(keystore_header_t) + (size_t)n * KEY_SIZE;
+    int fd = open(bank_filename, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        printf("Error creating initialization files\n");
+        return 64;
+    }
+    unsigned char *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    uint8_t *created = (uint8_t*) calloc(n + 1, 1);
+    if (map == MAP_FAILED || created == NULL) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        free(created);
+        close(fd);
+        remove(bank_filename);
+        printf("Error creating initialization files\n");
+        return 64;
+    }
+
+    keystore_header_t header;
+    memcpy(header.magic, KEYSTORE_MAGIC, sizeof(header.magic));
+    header.num_keys = htonl(n);
+    header.key_size = htonl(KEY_SIZE);
+    memcpy(map, &header, sizeof(header));
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nthreads = (ncpu < 1) ? 1 : (ncpu > INIT_MAX_THREADS ? INIT_MAX_THREADS : (unsigned)ncpu);
+    if (nthreads > n) {
+        nthreads = n;
+    }
+
+    pthread_t threads[INIT_MAX_THREADS];
+    fleet_worker_t workers[INIT_MAX_THREADS];
+    int failed = 0;
+    unsigned started = 0;
+    for (unsigned t = 0; t < nthreads; t++) {
+        workers[t].name = name;
+        workers[t].keys = map + sizeof(keystore_header_t);
+        workers[t].created = created;
+        workers[t].first = 1 + (unsigned)((uint64_t)n * t / nthreads);
+        workers[t].last = (unsigned)((uint64_t)n * (t + 1) / nthreads);
+        workers[t].failed = 0;
+        if (pthread_create(&threads[t], NULL, fleet_worker, &workers[t]) != 0) {
+            failed = 1;
+            break;
+        }
+        started++;
+    }
+    for (unsigned t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        failed |= workers[t].failed;
+    }
+
+    if (msync(map, size, MS_SYNC) != 0) {
+        failed = 1;
+    }
+    munmap(map, size);
+    if (close(fd) != 0) {
+        failed = 1;
+    }
+
+    if (failed) {
+        // Take back everything this run created
+        for (unsigned id = 1; id <= n; id++) {
+            if (created[id] && terminal_filename(filename, sizeof(filename), name, id) == 0) {
+                remove(filename);
+            }
+        }
+        remove(bank_filename);
+        free(created);
+        printf("Error creating initialization files\n");
+        return 64;
+    }
+
+    free(created);
+    printf("Successfully initialized bank state\n");
+    return 0;
+}
+
+static int usage(void)
+{
+    printf("Usage:  init [-n terminals] <filename>\n");
+    return 62;
+}
+
 int main(int argc, char *argv[])
 {
+    unsigned terminals = 0;
+    int c;
+
     // Check arguments
-    if (argc != 2) {
-        printf("Usage:  init <filename>\n");
-        return 62;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+            case 'n': {
+                char *end = NULL;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1 || n > KEYSTORE_MAX_KEYS) {
+                    return usage();
+                }
+                terminals = (unsigned)n;
+                break;
+            }
+            default:
+                return usage();
+        }
+    }
+    if (argc - optind != 1) {
+        return usage();
     }
+    const char *name = argv[optind];
 
     // Construct filenames
     char atm_filename[512];
     char bank_filename[512];
-    
-    int ret = snprintf(atm_filename, sizeof(atm_filename), "%s.atm", argv[1]);
+
+    int ret = snprintf(atm_filename, sizeof(atm_filename), "%s.atm", name);
     if (ret < 0 || ret >= (int)sizeof(atm_filename)) {
         printf("Error creating initialization files\n");
         return 64;
     }
 
-    ret = snprintf(bank_filename, sizeof(bank_filename), "%s.bank", argv[1]);
+    ret = snprintf(bank_filename, sizeof(bank_filename), "%s.bank", name);
     if (ret < 0 || ret >= (int)sizeof(bank_filename)) {
         printf("Error creating initialization files\n");
         return 64;
     }
 
+    if (terminals > 0) {
+        return init_fleet(name, bank_filename, terminals);
+    }
+
     // Check if either file already exists
     if (file_exists(atm_filename) || file_exists(bank_filename)) {
         printf("Error: one of the files already exists\n");
@@ -0,0 +1,204 @@
+#!/bin/bash
+# End-to-end performance regression check (make perf / make perf-baseline)
+#
+# Starts the router and bank, runs fixed workloads through them and
+# compares throughput and latency with a stored baseline:
+#   loadgen_closed  loadgen, 200 users, closed loop: ops/s, p50, p99
+#   loadgen_open    loadgen, 200 users at a fixed 4000 requests/s: p50, p99
+#   atm_batch_w1    bin/atm batch file of 3000 withdrawals, stop-and-wait: ops/s
+#   atm_batch_w16   the same with 16 requests in flight: ops/s
+# Each workload runs REPS times and the best result counts.
+#
+# Usage: ./perf_regress.sh [-u] [-b baseline] [-t tolerance_pct] [-T tail_tolerance_pct]
+#                          [-r reps] [-d secs]
+#   -u  record the results as the new baseline instead of comparing
+#   -t  allowed change for throughput and p50 (default 20%)
+#   -T  allowed change for p99, which moves far more between runs (50%)
+#
+# The baseline file has one "<workload>.<metric> <value> higher|lower
+# [tolerance_pct]" line per metric; a fourth column overrides -t/-T for
+# that metric.  Baselines are only meaningful on the machine that
+# recorded them.  Each result is printed as a JSON line; the exit status is 1 if
+# any metric is worse than its baseline by more than the tolerance.
+#
+# Needs the router, bank and ATM ports free; leftover router and bank
+# processes are killed first, as the test_*.sh scripts do.
+
+R=$(cd "$(dirname "$0")" && pwd)
+BASELINE="$R/perf_baseline.txt"
+TOLERANCE=20
+TAIL_TOLERANCE=50
+REPS=3
+DURATION=5
+UPDATE=0
+USERS=200
+RATE=4000
+WITHDRAWALS=3000
+
+while getopts "ub:t:T:r:d:" opt; do
+    case $opt in
+        u) UPDATE=1 ;;
+        b) BASELINE=$OPTARG ;;
+        t) TOLERANCE=$OPTARG ;;
+        T) TAIL_TOLERANCE=$OPTARG ;;
+        r) REPS=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        *) echo "Usage: $0 [-u] [-b baseline] [-t tolerance_pct] [-T tail_tolerance_pct]" \
+                "[-r reps] [-d secs]" >&2
+           exit 2 ;;
+    esac
+done
+
+for b in init router bank atm loadgen; do
+    if [ ! -x "$R/bin/$b" ]; then
+        echo "perf: bin/$b missing, run make first" >&2
+        exit 2
+    fi
+done
+
+D=$(mktemp -d)
+RESULTS="$D/results"
+: > "$RESULTS"
+
+cleanup() {
+    exec 3>&- 2>/dev/null
+    kill $ROUTER_PID $BANK_PID 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$D"
+}
+trap cleanup EXIT
+
+pkill -9 -x router 2>/dev/null
+pkill -9 -x bank 2>/dev/null
+sleep 0.3
+
+cd "$D"
+"$R/bin/init" "$D/k" > /dev/null || exit 2
+"$R/bin/router" > router.out 2>&1 &
+ROUTER_PID=$!
+mkfifo bank_fifo
+"$R/bin/bank" "$D/k.bank" < bank_fifo > bank.out 2>&1 &
+BANK_PID=$!
+exec 3> bank_fifo
+sleep 0.3
+
+# batch_name <n>: usernames are letters only, so batchaa, batchab, ...
+LETTERS=abcdefghijklmnopqrstuvwxyz
+batch_name() {
+    echo "batch${LETTERS:$(($1 / 26 % 26)):1}${LETTERS:$(($1 % 26)):1}"
+}
+
+# Virtual users for loadgen, and a fresh user per batch run: bin/atm
+# starts its seqs at 1, so a second run as the same user would be
+# rejected as a replay
+"$R/bin/loadgen" -S -u $USERS >&3
+for i in $(seq 1 $((REPS * 2))); do
+    echo "create-user $(batch_name $i) 1234 1000000" >&3
+done
+sleep 1
+if [ "$(ls lg*.card 2>/dev/null | wc -l)" -lt $USERS ]; then
+    echo "perf: bank did not create the loadgen users" >&2
+    exit 2
+fi
+
+# record <workload> <metric> <value> <higher|lower>: keep the best of the reps
+record() {
+    awk -v k="$1.$2" -v v="$3" -v dir="$4" '
+        $1 == k { found = 1
+                  if ((dir == "higher" && v > $2) || (dir == "lower" && v < $2)) $2 = v }
+        { print }
+        END { if (!found) print k, v, dir }' "$RESULTS" > "$RESULTS.new"
+    mv "$RESULTS.new" "$RESULTS"
+}
+
+# field <json line> <name>
+field() {
+    echo "$1" | sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+run_loadgen() {
+    local name=$1; shift
+    local line
+    line=$("$R/bin/loadgen" -u $USERS -d $DURATION -i $DURATION "$@" k.atm 2>/dev/null |
+           grep '"phase":"total"')
+    if [ -z "$line" ] || [ "$(field "$line" failures)" != "0" ]; then
+        echo "perf: $name run failed: $line" >&2
+        exit 2
+    fi
+    echo "$line"
+}
+
+batch_user=0
+run_batch() {
+    local name=$1 window=$2 user start end ok
+    batch_user=$((batch_user + 1))
+    user=$(batch_name $batch_user)
+    { echo "begin-session $user 1234"
+      for i in $(seq 1 $WITHDRAWALS); do echo "withdraw 1"; done
+      echo "end-session"; } > batch.txt
+    start=$(date +%s%N)
+    "$R/bin/atm" -w $window -f batch.txt k.atm > batch.out 2>&1
+    end=$(date +%s%N)
+    ok=$(grep -c "dispensed" batch.out)
+    if [ "$ok" -ne $WITHDRAWALS ]; then
+        echo "perf: $name dispensed $ok of $WITHDRAWALS" >&2
+        exit 2
+    fi
+    record "$name" ops_per_sec $(awk -v n=$WITHDRAWALS -v ns=$((end - start)) \
+                                     'BEGIN { printf "%.0f", n * 1e9 / ns }') higher
+}
+
+for rep in $(seq 1 $REPS); do
+    line=$(run_loadgen loadgen_closed) || exit 2
+    record loadgen_closed ops_per_sec "$(field "$line" ops_per_sec)" higher
+    record loadgen_closed p50_us "$(field "$line" p50_us)" lower
+    record loadgen_closed p99_us "$(field "$line" p99_us)" lower
+
+    line=$(run_loadgen loadgen_open -r $RATE) || exit 2
+    record loadgen_open p50_us "$(field "$line" p50_us)" lower
+    record loadgen_open p99_us "$(field "$line" p99_us)" lower
+
+    run_batch atm_batch_w1 1
+    run_batch atm_batch_w16 16
+done
+
+if [ $UPDATE -eq 1 ]; then
+    {
+        echo "# perf_regress.sh baseline, $(date -u +%Y-%m-%dT%H:%M:%SZ), $(uname -n)"
+        echo "# <workload>.<metric> <value> higher|lower [tolerance_pct]"
+        cat "$RESULTS"
+    } > "$BASELINE"
+    awk '{ printf "{\"perf\":\"%s\",\"value\":%s,\"better\":\"%s\",\"status\":\"recorded\"}\n", $1, $2, $3 }' "$RESULTS"
+    echo "perf: baseline written to $BASELINE"
+    exit 0
+fi
+
+if [ ! -f "$BASELINE" ]; then
+    echo "perf: no baseline at $BASELINE; record one with make perf-baseline" >&2
+    exit 2
+fi
+
+awk -v tol="$TOLERANCE" -v tail_tol="$TAIL_TOLERANCE" '
+    FNR == NR { if ($1 !~ /^#/ && NF >= 3) {
+                    base[$1] = $2; dir[$1] = $3
+                    t[$1] = (NF >= 4) ? $4 : ($1 ~ /\.p99/ ? tail_tol : tol)
+                }
+                next }
+    {
+        k = $1; v = $2
+        if (!(k in base)) {
+            printf "{\"perf\":\"%s\",\"value\":%s,\"status\":\"new\"}\n", k, v
+            next
+        }
+        b = base[k]
+        change = (b > 0) ? (v - b) * 100 / b : 0
+        worse = (dir[k] == "higher") ? -change : change
+        status = (worse > t[k]) ? "regressed" : (worse < -t[k] ? "improved" : "ok")
+        if (status == "regressed") failed++
+        printf "{\"perf\":\"%s\",\"value\":%s,\"baseline\":%s,\"better\":\"%s\",\"change_pct\":%.1f,\"tolerance_pct\":%s,\"status\":\"%s\"}\n",
+               k, v, b, dir[k], change, t[k], status
+    }
+    END {
+        if (failed) { printf "perf: %d metric(s) regressed\n", failed; exit 1 }
+        print "perf: no regressions"
+    }' "$BASELINE" "$RESULTS"
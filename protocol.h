@@ -1,5 +1,11 @@
 // Protocol message definitions
 // Encrypted format: IV (16) || ciphertext || HMAC (32)
+//
+// Two plaintext formats coexist.  Legacy messages start with msg_type
+// and carry the full null-padded username.  Compact messages start with
+// WIRE_COMPACT (never a valid msg_type), name the user only in the login
+// request, and refer to the account by a 32-bit ID after that.  Roll out
+// banks first: a bank answers each request in the format it came in.
 
 #ifndef __PROTOCOL_H__
 #define __PROTOCOL_H__
@@ -8,8 +14,37 @@
 #include <stddef.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <string.h>
-#include <arpa/inet.h>
+
+// Routing envelope for sharded banks.  ATMs may put it in front of the
+// sealed packet so the router can pick a shard without the key:
+//   envelope (8) || IV (16) || ciphertext || HMAC(envelope || IV || ciphertext)
+// The bank checks route_tag against the account it resolves to.  A plain
+// packet is always a multiple of 16 bytes long and an enveloped one is
+// not, so both can arrive on the same port.  ATMs with their own key
+// (init -n) always send an envelope, naming the key in key_id; the bank
+// answers under the same key.
+#define ENVELOPE_MAGIC      0xE5
+
+typedef struct {
+    uint8_t magic;                  // ENVELOPE_MAGIC
+    uint8_t flags;                  // reserved, 0
+    uint16_t key_id;                // keystore entry, network byte order; 0 = shared key
+    uint32_t route_tag;             // routing_tag(username), network byte order
+} __attribute__((packed)) envelope_t;
+
+// Key files written by init.  Without -n, <name>.atm and <name>.bank both
+// hold the one shared key.  `init -n N` gives each terminal its own:
+// <name>-<i>.atm holds the key followed by key_id i (network byte order),
+// and <name>.bank is a keystore the bank maps in one piece, a header
+// followed by the keys, key i at sizeof(keystore_header_t) + (i - 1) * 32.
+#define KEYSTORE_MAGIC      "ATMKEYS1"
+#define KEYSTORE_MAX_KEYS   65535   // key_id is 16 bits
+
+typedef struct {
+    char magic[8];                  // KEYSTORE_MAGIC, not null-terminated
+    uint32_t num_keys;              // network byte order
+    uint32_t key_size;              // network byte order; 32
+} __attribute__((packed)) keystore_header_t;
 
 #define MSG_LOGIN_REQ       0x01
 #define MSG_LOGIN_RESP      0x02
@@ -17,6 +52,7 @@
 #define MSG_BALANCE_RESP    0x04
 #define MSG_WITHDRAW_REQ    0x05
 #define MSG_WITHDRAW_RESP   0x06
+#define MSG_BALANCE_INVAL   0x07    // bank -> ATM, unprompted: the balance changed
 
 // Sizes
 #define USERNAME_SIZE       251     // Maximum username length + null terminator
@@ -71,6 +107,72 @@ typedef struct {
     uint64_t seq_num;               // Echo back the sequence number
 } __attribute__((packed)) msg_withdraw_resp_t;
 
+// Balance invalidation, pushed after a withdraw or deposit.  It carries
+// no balance, so replaying one can only cost the ATM a round trip.
+typedef struct {
+    msg_header_t header;
+    uint64_t seq_num;               // Withdraw that caused it, 0 for a deposit
+} __attribute__((packed)) msg_balance_inval_t;
+
+// Compact format
+#define WIRE_LEGACY         0x00    // Not sent on the wire; first byte is msg_type
+#define WIRE_COMPACT        0x82    // Version byte of the compact format
+
+typedef struct {
+    uint8_t version;                // WIRE_COMPACT
+    uint8_t msg_type;               // One of MSG_* constants
+} __attribute__((packed)) cmsg_header_t;
+
+// Login request, followed by username_len bytes of username
+typedef struct {
+    cmsg_header_t header;
+    uint8_t auth_token[AUTH_TOKEN_SIZE];
+    char pin[PIN_SIZE];
+    uint64_t seq_num;
+    uint8_t username_len;
+} __attribute__((packed)) cmsg_login_req_t;
+
+typedef struct {
+    cmsg_header_t header;
+    uint8_t success;
+    uint32_t account_id;            // Assigned by the bank; 0 if not authorized
+    uint64_t seq_num;
+} __attribute__((packed)) cmsg_login_resp_t;
+
+typedef struct {
+    cmsg_header_t header;
+    uint32_t account_id;
+    uint64_t seq_num;
+} __attribute__((packed)) cmsg_balance_req_t;
+
+typedef struct {
+    cmsg_header_t header;
+    uint32_t account_id;
+    int32_t balance;
+    uint64_t seq_num;
+} __attribute__((packed)) cmsg_balance_resp_t;
+
+typedef struct {
+    cmsg_header_t header;
+    uint32_t account_id;
+    int32_t amount;
+    uint64_t seq_num;
+} __attribute__((packed)) cmsg_withdraw_req_t;
+
+typedef struct {
+    cmsg_header_t header;
+    uint32_t account_id;
+    uint8_t success;
+    int32_t new_balance;
+    uint64_t seq_num;
+} __attribute__((packed)) cmsg_withdraw_resp_t;
+
+typedef struct {
+    cmsg_header_t header;
+    uint32_t account_id;
+    uint64_t seq_num;
+} __attribute__((packed)) cmsg_balance_inval_t;
+
 #define MAX_PLAINTEXT_SIZE  512
 #define IV_SIZE             16
 #define HMAC_SIZE           32
@@ -92,6 +194,28 @@ static inline uint64_t ntohll(uint64_t netlonglong) {
 }
 #endif
 
+// Is this packet (as received) wrapped in a routing envelope?
+static inline int packet_has_envelope(const unsigned char *packet, size_t len) {
+    return len >= sizeof(envelope_t) && (len % 16) == sizeof(envelope_t) &&
+           packet[0] == ENVELOPE_MAGIC;
+}
+
+// Stable 32-bit hash of a username, used to place accounts on the shard
+// ring.  FNV-1a with a murmur3 finalizer for better spread.
+static inline uint32_t routing_tag(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
 // Pad username with nulls
 static inline void prepare_username(char *dest, const char *src) {
     size_t len = strlen(src);
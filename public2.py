@@ -74,7 +74,7 @@ def check_exit(expected, actual):
 
 def test_init(init_path):
     def expect_usage(c):
-        c.expect(r'Usage:\s+init <filename>')
+        c.expect(r'Usage:\s+init \[-n terminals\] <filename>')
         c.wait()
         c.close()
         check_exit(62, c.exitstatus)
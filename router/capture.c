@@ -0,0 +1,134 @@
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static Capture* capture_map(int fd, size_t len, int writable)
+{
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void *map = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    Capture *cap = (Capture*) malloc(sizeof(Capture));
+    if (cap == NULL) {
+        munmap(map, len);
+        return NULL;
+    }
+
+    cap->header = (CaptureHeader*) map;
+    cap->records = (CaptureRecord*) ((char*) map + sizeof(CaptureHeader));
+    cap->map_len = len;
+    return cap;
+}
+
+Capture* capture_create(const char *path, uint32_t num_slots)
+{
+    if (num_slots == 0) {
+        return NULL;
+    }
+
+    size_t len = sizeof(CaptureHeader) + (size_t) num_slots * sizeof(CaptureRecord);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, len) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    Capture *cap = capture_map(fd, len, 1);
+    if (cap == NULL) {
+        return NULL;
+    }
+
+    cap->header->magic = CAPTURE_MAGIC;
+    cap->header->slot_size = sizeof(CaptureRecord);
+    cap->header->num_slots = num_slots;
+    cap->header->head = 0;
+    return cap;
+}
+
+Capture* capture_open(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CaptureHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    Capture *cap = capture_map(fd, st.st_size, 0);
+    if (cap == NULL) {
+        return NULL;
+    }
+
+    const CaptureHeader *h = cap->header;
+    if (h->magic != CAPTURE_MAGIC || h->slot_size != sizeof(CaptureRecord) ||
+        sizeof(CaptureHeader) + (size_t) h->num_slots * sizeof(CaptureRecord) > cap->map_len) {
+        capture_close(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+void capture_close(Capture *cap)
+{
+    if (cap != NULL) {
+        munmap(cap->header, cap->map_len);
+        free(cap);
+    }
+}
+
+void capture_record(Capture *cap, const char *data, size_t len, int dir)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    // Router threads claim slots with an atomic increment
+    uint64_t index = __atomic_fetch_add(&cap->header->head, 1, __ATOMIC_RELAXED);
+    CaptureRecord *rec = &cap->records[index % cap->header->num_slots];
+
+    if (len > ROUTER_MAX_PACKET) {
+        len = ROUTER_MAX_PACKET;
+    }
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    rec->ts_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->len = (uint16_t) len;
+    rec->dir = (uint8_t) dir;
+    memcpy(rec->data, data, len);
+    __atomic_store_n(&rec->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t capture_first(const Capture *cap)
+{
+    uint64_t head = __atomic_load_n(&cap->header->head, __ATOMIC_ACQUIRE);
+    return (head > cap->header->num_slots) ? head - cap->header->num_slots : 0;
+}
+
+uint64_t capture_end(const Capture *cap)
+{
+    return __atomic_load_n(&cap->header->head, __ATOMIC_ACQUIRE);
+}
+
+// NULL if the record was overwritten or is still being written
+const CaptureRecord* capture_get(const Capture *cap, uint64_t index)
+{
+    const CaptureRecord *rec = &cap->records[index % cap->header->num_slots];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != index + 1) {
+        return NULL;
+    }
+    return rec;
+}
@@ -0,0 +1,59 @@
+/*
+ * Traffic capture: every forwarded datagram is appended, with a
+ * timestamp and direction, to a ring of fixed-size records in a
+ * memory-mapped file.  Recording is a memcpy into the mapping; the
+ * forwarding path makes no extra syscalls.  Once the ring is full the
+ * oldest records are overwritten.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "router.h"
+
+#define CAPTURE_MAGIC       0x31504143  // "CAP1"
+#define CAPTURE_DEFAULT_SLOTS 16384
+
+#define CAPTURE_ATM_TO_BANK 1
+#define CAPTURE_BANK_TO_ATM 2
+
+typedef struct _CaptureHeader
+{
+    uint32_t magic;
+    uint32_t slot_size;             // bytes per record
+    uint32_t num_slots;
+    uint32_t reserved;
+    uint64_t head;                  // records ever written; next index is head % num_slots
+    uint8_t pad[40];                // keep records cache-line aligned
+} CaptureHeader;
+
+typedef struct _CaptureRecord
+{
+    uint64_t seq;                   // index + 1 once the record is complete, 0 while written
+    uint64_t ts_ns;                 // CLOCK_REALTIME when forwarded
+    uint16_t len;
+    uint8_t dir;                    // CAPTURE_ATM_TO_BANK or CAPTURE_BANK_TO_ATM
+    uint8_t reserved[5];
+    char data[ROUTER_MAX_PACKET];
+} CaptureRecord;
+
+typedef struct _Capture
+{
+    CaptureHeader *header;
+    CaptureRecord *records;
+    size_t map_len;
+} Capture;
+
+Capture* capture_create(const char *path, uint32_t num_slots);
+Capture* capture_open(const char *path);
+void capture_close(Capture *cap);
+void capture_record(Capture *cap, const char *data, size_t len, int dir);
+
+// Oldest record still in the ring, and one past the newest
+uint64_t capture_first(const Capture *cap);
+uint64_t capture_end(const Capture *cap);
+const CaptureRecord* capture_get(const Capture *cap, uint64_t index);
+
+#endif
@@ -0,0 +1,335 @@
+#include "netem.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+typedef struct
+{
+    unsigned long long due_ns;
+    unsigned long long order;   // ties on due_ns keep arrival order
+    int to_bank;
+    size_t len;
+    char data[ROUTER_MAX_PACKET];
+} NetemPacket;
+
+struct _Netem
+{
+    NetemConfig cfg;
+    Router *router;
+    Capture *capture;           // optional; records packets as they are sent
+    unsigned long long rng;
+
+    NetemPacket *pool;
+    int *free_slots;
+    int num_free;
+
+    int *heap;                  // pool indices, min-heap on (due_ns, order)
+    int heap_size;
+    unsigned long long next_order;
+
+    int *window;                // due packets waiting to be sent in random order
+    int window_size;
+    unsigned long long window_since_ns;
+
+    NetemStats stats;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// splitmix64: small, fast and good enough for fault injection
+static unsigned long long rng_next(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double rng_uniform(unsigned long long *state)
+{
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void netem_config_init(NetemConfig *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->dist = DELAY_NONE;
+    cfg->seed = 1;
+}
+
+// Delay specs: const:MS, uniform:MIN:MAX, normal:MEAN:STDDEV, exp:MEAN
+int netem_parse_delay(NetemConfig *cfg, const char *spec)
+{
+    double a = 0, b = 0;
+
+    if (sscanf(spec, "const:%lf", &a) == 1) {
+        cfg->dist = DELAY_CONSTANT;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a) {
+        cfg->dist = DELAY_UNIFORM;
+    } else if (sscanf(spec, "normal:%lf:%lf", &a, &b) == 2 && b >= 0) {
+        cfg->dist = DELAY_NORMAL;
+    } else if (sscanf(spec, "exp:%lf", &a) == 1) {
+        cfg->dist = DELAY_EXPONENTIAL;
+    } else {
+        return -1;
+    }
+
+    if (a < 0) {
+        return -1;
+    }
+
+    cfg->a = a;
+    cfg->b = b;
+    return 0;
+}
+
+int netem_enabled(const NetemConfig *cfg)
+{
+    return cfg->dist != DELAY_NONE || cfg->loss > 0 || cfg->dup > 0 || cfg->reorder > 1;
+}
+
+static double sample_delay_ms(Netem *netem)
+{
+    double a = netem->cfg.a, b = netem->cfg.b;
+    double d = 0;
+
+    switch (netem->cfg.dist) {
+        case DELAY_NONE:
+            break;
+        case DELAY_CONSTANT:
+            d = a;
+            break;
+        case DELAY_UNIFORM:
+            d = a + (b - a) * rng_uniform(&netem->rng);
+            break;
+        case DELAY_NORMAL: {
+            // Box-Muller
+            double u1 = 1.0 - rng_uniform(&netem->rng);
+            double u2 = rng_uniform(&netem->rng);
+            d = a + b * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+            break;
+        }
+        case DELAY_EXPONENTIAL:
+            d = -a * log(1.0 - rng_uniform(&netem->rng));
+            break;
+    }
+
+    return d < 0 ? 0 : d;
+}
+
+Netem* netem_create(const NetemConfig *cfg, Router *router, unsigned long long seed,
+                    Capture *capture)
+{
+    Netem *netem = (Netem*) calloc(1, sizeof(Netem));
+    if (netem == NULL) {
+        return NULL;
+    }
+
+    netem->cfg = *cfg;
+    netem->router = router;
+    netem->capture = capture;
+    netem->rng = seed;
+    netem->pool = (NetemPacket*) malloc(sizeof(NetemPacket) * NETEM_QUEUE_SIZE);
+    netem->free_slots = (int*) malloc(sizeof(int) * NETEM_QUEUE_SIZE);
+    netem->heap = (int*) malloc(sizeof(int) * NETEM_QUEUE_SIZE);
+    netem->window = (int*) malloc(sizeof(int) * (cfg->reorder > 1 ? cfg->reorder : 1));
+
+    if (netem->pool == NULL || netem->free_slots == NULL ||
+        netem->heap == NULL || netem->window == NULL) {
+        netem_free(netem);
+        return NULL;
+    }
+
+    for (int i = 0; i < NETEM_QUEUE_SIZE; i++) {
+        netem->free_slots[i] = NETEM_QUEUE_SIZE - 1 - i;
+    }
+    netem->num_free = NETEM_QUEUE_SIZE;
+
+    return netem;
+}
+
+void netem_free(Netem *netem)
+{
+    if (netem != NULL) {
+        free(netem->pool);
+        free(netem->free_slots);
+        free(netem->heap);
+        free(netem->window);
+        free(netem);
+    }
+}
+
+static int heap_less(const Netem *netem, int i, int j)
+{
+    const NetemPacket *a = &netem->pool[netem->heap[i]];
+    const NetemPacket *b = &netem->pool[netem->heap[j]];
+    if (a->due_ns != b->due_ns)
+        return a->due_ns < b->due_ns;
+    return a->order < b->order;
+}
+
+static void heap_swap(Netem *netem, int i, int j)
+{
+    int tmp = netem->heap[i];
+    netem->heap[i] = netem->heap[j];
+    netem->heap[j] = tmp;
+}
+
+static void heap_push(Netem *netem, int slot)
+{
+    int i = netem->heap_size++;
+    netem->heap[i] = slot;
+    while (i > 0 && heap_less(netem, i, (i - 1) / 2)) {
+        heap_swap(netem, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static int heap_pop(Netem *netem)
+{
+    int top = netem->heap[0];
+    netem->heap[0] = netem->heap[--netem->heap_size];
+
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < netem->heap_size && heap_less(netem, l, m)) m = l;
+        if (r < netem->heap_size && heap_less(netem, r, m)) m = r;
+        if (m == i) break;
+        heap_swap(netem, i, m);
+        i = m;
+    }
+    return top;
+}
+
+static void schedule(Netem *netem, const char *data, size_t len, int to_bank,
+                     unsigned long long now)
+{
+    if (netem->num_free == 0) {
+        netem->stats.overflow++;
+        return;
+    }
+
+    int slot = netem->free_slots[--netem->num_free];
+    NetemPacket *p = &netem->pool[slot];
+    p->due_ns = now + (unsigned long long)(sample_delay_ms(netem) * 1e6);
+    p->order = netem->next_order++;
+    p->to_bank = to_bank;
+    p->len = len;
+    memcpy(p->data, data, len);
+    heap_push(netem, slot);
+}
+
+void netem_enqueue(Netem *netem, const char *data, size_t len, int to_bank)
+{
+    unsigned long long now = now_ns();
+
+    if (len > ROUTER_MAX_PACKET) {
+        len = ROUTER_MAX_PACKET;
+    }
+
+    if (netem->cfg.loss > 0 && rng_uniform(&netem->rng) < netem->cfg.loss) {
+        netem->stats.lost++;
+        return;
+    }
+
+    schedule(netem, data, len, to_bank, now);
+
+    if (netem->cfg.dup > 0 && rng_uniform(&netem->rng) < netem->cfg.dup) {
+        netem->stats.duplicated++;
+        schedule(netem, data, len, to_bank, now);
+    }
+}
+
+static void send_slot(Netem *netem, int slot)
+{
+    NetemPacket *p = &netem->pool[slot];
+
+    if (p->to_bank)
+        router_sendto_bank(netem->router, p->data, p->len);
+    else
+        router_sendto_atm(netem->router, p->data, p->len);
+
+    if (netem->capture != NULL)
+        capture_record(netem->capture, p->data, p->len,
+                       p->to_bank ? CAPTURE_ATM_TO_BANK : CAPTURE_BANK_TO_ATM);
+
+    netem->stats.forwarded++;
+    netem->free_slots[netem->num_free++] = slot;
+}
+
+// Send one packet chosen at random from the reorder window
+static void window_send_one(Netem *netem)
+{
+    int i = (int)(rng_next(&netem->rng) % (unsigned long long)netem->window_size);
+    int slot = netem->window[i];
+    netem->window[i] = netem->window[--netem->window_size];
+    send_slot(netem, slot);
+}
+
+// Milliseconds until the next packet is due; -1 if nothing is queued
+int netem_timeout_ms(const Netem *netem)
+{
+    unsigned long long now = now_ns();
+    unsigned long long due = ~0ULL;
+
+    if (netem->heap_size > 0) {
+        due = netem->pool[netem->heap[0]].due_ns;
+    }
+    if (netem->window_size > 0) {
+        unsigned long long flush = netem->window_since_ns + NETEM_REORDER_HOLD_MS * 1000000ULL;
+        if (flush < due) due = flush;
+    }
+
+    if (due == ~0ULL) {
+        return -1;
+    }
+    if (due <= now) {
+        return 0;
+    }
+    // Round up so we never wake before the packet is due
+    return (int)((due - now + 999999ULL) / 1000000ULL);
+}
+
+void netem_release_due(Netem *netem)
+{
+    unsigned long long now = now_ns();
+    int reorder = netem->cfg.reorder;
+
+    while (netem->heap_size > 0 && netem->pool[netem->heap[0]].due_ns <= now) {
+        int slot = heap_pop(netem);
+
+        if (reorder <= 1) {
+            send_slot(netem, slot);
+            continue;
+        }
+
+        if (netem->window_size == 0) {
+            netem->window_since_ns = now;
+        }
+        netem->window[netem->window_size++] = slot;
+        if (netem->window_size == reorder) {
+            window_send_one(netem);
+        }
+    }
+
+    // Don't strand packets in a partly full window when traffic stops
+    if (netem->window_size > 0 &&
+        now >= netem->window_since_ns + NETEM_REORDER_HOLD_MS * 1000000ULL) {
+        while (netem->window_size > 0) {
+            window_send_one(netem);
+        }
+    }
+}
+
+const NetemStats* netem_stats(const Netem *netem)
+{
+    return &netem->stats;
+}
@@ -0,0 +1,59 @@
+/*
+ * Network emulation for the router: delay, jitter, loss, duplication
+ * and reordering, driven by a seeded PRNG so runs are reproducible.
+ *
+ * Packets wait in a timer-ordered queue (a binary heap on due time), so
+ * a delayed packet never holds up reception of the ones behind it.
+ */
+
+#ifndef __NETEM_H__
+#define __NETEM_H__
+
+#include "router.h"
+#include "capture.h"
+
+#define NETEM_QUEUE_SIZE 4096       // packets held at once; more are dropped
+#define NETEM_REORDER_HOLD_MS 10    // flush a partly full reorder window after this
+
+typedef enum
+{
+    DELAY_NONE,
+    DELAY_CONSTANT,     // a ms
+    DELAY_UNIFORM,      // between a and b ms
+    DELAY_NORMAL,       // mean a ms, standard deviation b ms
+    DELAY_EXPONENTIAL,  // mean a ms
+} DelayDist;
+
+typedef struct _NetemConfig
+{
+    DelayDist dist;
+    double a, b;            // distribution parameters, in ms
+    double loss;            // probability a packet is dropped
+    double dup;             // probability a packet is sent twice
+    int reorder;            // reorder window in packets (0 or 1 = in order)
+    unsigned long long seed;
+} NetemConfig;
+
+typedef struct _NetemStats
+{
+    unsigned long long forwarded;
+    unsigned long long lost;
+    unsigned long long duplicated;
+    unsigned long long overflow;    // dropped because the queue was full
+} NetemStats;
+
+typedef struct _Netem Netem;
+
+void netem_config_init(NetemConfig *cfg);
+int netem_parse_delay(NetemConfig *cfg, const char *spec);
+int netem_enabled(const NetemConfig *cfg);
+
+Netem* netem_create(const NetemConfig *cfg, Router *router, unsigned long long seed,
+                    Capture *capture);
+void netem_free(Netem *netem);
+void netem_enqueue(Netem *netem, const char *data, size_t len, int to_bank);
+int netem_timeout_ms(const Netem *netem);
+void netem_release_due(Netem *netem);
+const NetemStats* netem_stats(const Netem *netem);
+
+#endif
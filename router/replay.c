@@ -0,0 +1,373 @@
+/*
+ * Replays ATM-to-bank traffic from a router capture against a bank.
+ *
+ * Usage: replay [-f] [-w window] [-k bank-key-file] <capture-file>
+ *
+ * Takes the router's place, so stop the router first: binds ROUTER_PORT,
+ * sends every captured ATM-to-bank datagram to BANK_PORT and counts the
+ * bank's replies.  By default datagrams go out with their original
+ * spacing; -f sends as fast as possible, keeping at most `window`
+ * without a reply.  Prints one JSON line.
+ *
+ * Sent byte for byte, the datagrams only exercise the bank's replay
+ * defences: the bank that recorded them has already seen every seq.
+ * With -k and the bank's key file (a shared key or an `init -n`
+ * keystore), each request is opened and resealed under its own key with
+ * its seq moved past anything the bank has seen, so logins, balances and
+ * withdraws really run again.  Point it at the bank that recorded the
+ * capture, still running: a fresh bank has none of the accounts, and card
+ * secrets from `create-user` can't be recreated.  Requests the keys
+ * can't open are sent as captured and counted as "unopened".  Resealing
+ * happens before the clock starts.  "replies" counts every datagram the
+ * bank sends back, so withdraws that really run add the balance
+ * invalidations the bank pushes to watching ATMs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include "router.h"
+#include "ports.h"
+#include "capture.h"
+#include "protocol.h"
+#include "crypto.h"
+#include "wire.h"
+#include "hash_table.h"
+#include "atm_engine.h"
+
+#define REPLY_TIMEOUT_US 200000
+
+// Keys from the bank's init file: one shared key, or a keystore
+typedef struct
+{
+    unsigned char *keys;        // key i at (i - 1) * KEY_SIZE; the shared key at 0
+    uint32_t num_keys;          // 0 for a shared key
+} ReplayKeys;
+
+static int load_keys(const char *path, ReplayKeys *rk)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+
+    struct stat st;
+    keystore_header_t header;
+    size_t num_keys = 0;
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return -1;
+    }
+    if (st.st_size != KEY_SIZE) {
+        if (fread(&header, sizeof(header), 1, f) != 1 ||
+            memcmp(header.magic, KEYSTORE_MAGIC, sizeof(header.magic)) != 0 ||
+            ntohl(header.key_size) != KEY_SIZE ||
+            (num_keys = ntohl(header.num_keys)) < 1 || num_keys > KEYSTORE_MAX_KEYS ||
+            (size_t) st.st_size != sizeof(header) + num_keys * KEY_SIZE) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    size_t nread = num_keys ? num_keys : 1;
+    unsigned char *keys = (unsigned char*) malloc(nread * KEY_SIZE);
+    if (keys != NULL && fread(keys, KEY_SIZE, nread, f) != nread) {
+        free(keys);
+        keys = NULL;
+    }
+    fclose(f);
+
+    rk->keys = keys;
+    rk->num_keys = (uint32_t) num_keys;
+    return keys != NULL ? 0 : -1;
+}
+
+static const unsigned char* replay_key(const ReplayKeys *rk, uint16_t key_id)
+{
+    if (rk->num_keys == 0)
+        return key_id == 0 ? rk->keys : NULL;
+    if (key_id == 0 || key_id > rk->num_keys)
+        return NULL;
+    return rk->keys + (size_t)(key_id - 1) * KEY_SIZE;
+}
+
+// A captured request, resealed; len 0 = send the captured bytes
+typedef struct
+{
+    uint16_t len;
+    unsigned char data[ROUTER_MAX_PACKET];
+} Resealed;
+
+static int open_request(const ReplayKeys *rk, const CaptureRecord *rec, wire_msg_t *msg)
+{
+    unsigned char plaintext[MAX_PLAINTEXT_SIZE];
+    const unsigned char *packet = (const unsigned char*) rec->data;
+    size_t header_len = 0;
+    uint16_t key_id = 0;
+
+    if (packet_has_envelope(packet, rec->len)) {
+        header_len = sizeof(envelope_t);
+        key_id = ntohs(((const envelope_t*) packet)->key_id);
+    }
+    const unsigned char *key = replay_key(rk, key_id);
+    if (key == NULL)
+        return -1;
+
+    int n = open_message_with_header(key, header_len, packet, rec->len,
+                                     plaintext, sizeof(plaintext));
+    if (n < 0 || wire_decode(plaintext, n, msg) != 0)
+        return -1;
+    return 0;
+}
+
+static int seal_request(const ReplayKeys *rk, const CaptureRecord *rec,
+                        const wire_msg_t *msg, Resealed *out)
+{
+    unsigned char plaintext[MAX_PLAINTEXT_SIZE];
+    const unsigned char *packet = (const unsigned char*) rec->data;
+    size_t header_len = 0;
+    uint16_t key_id = 0;
+    size_t len = 0;
+
+    if (packet_has_envelope(packet, rec->len)) {
+        header_len = sizeof(envelope_t);
+        key_id = ntohs(((const envelope_t*) packet)->key_id);
+    }
+    const unsigned char *key = replay_key(rk, key_id);
+
+    int n = wire_encode(msg, plaintext, sizeof(plaintext));
+    if (n < 0 || n + IV_SIZE + 16 + HMAC_SIZE + header_len > sizeof(out->data) ||
+        seal_message_with_header(key, packet, header_len, plaintext, n, out->data, &len) != 0)
+        return -1;
+    out->len = (uint16_t) len;
+    return 0;
+}
+
+// Reseal every request in the capture with a fresh seq, before the clock
+// starts.  New seqs are handed out in capture order from above both the
+// newest captured seq and the engine's counter floor, so the bank
+// takes them as new requests; a retransmission in the capture gets the
+// same new seq as its original, so the bank still answers it from its
+// response cache instead of running it twice.
+static Resealed* reseal_capture(const Capture *cap, const ReplayKeys *rk, long *unopened)
+{
+    uint64_t first = capture_first(cap), end = capture_end(cap);
+    size_t n = (size_t) (end - first);
+    wire_msg_t *msgs = (wire_msg_t*) calloc(n ? n : 1, sizeof(wire_msg_t));
+    Resealed *out = (Resealed*) calloc(n ? n : 1, sizeof(Resealed));
+    HashTable *seqs = hash_table_create((uint32_t) n);
+    if (msgs == NULL || out == NULL || seqs == NULL) {
+        free(msgs);
+        free(out);
+        hash_table_free(seqs);
+        return NULL;
+    }
+
+    // msg_type 0 marks anything not resealed
+    uint64_t max_seq = 0;
+    for (size_t i = 0; i < n; i++) {
+        const CaptureRecord *rec = capture_get(cap, first + i);
+        if (rec == NULL || rec->dir != CAPTURE_ATM_TO_BANK)
+            continue;
+        if (open_request(rk, rec, &msgs[i]) != 0) {
+            msgs[i].msg_type = 0;
+            (*unopened)++;
+        } else if (msgs[i].seq_num > max_seq) {
+            max_seq = msgs[i].seq_num;
+        }
+    }
+
+    uint64_t next_seq = atm_engine_counter_floor() << ATM_ENGINE_ID_BITS;
+    if (next_seq <= max_seq)
+        next_seq = max_seq + 1;
+    // Wrapped seqs would all be dropped by the bank as replays
+    if (max_seq == UINT64_MAX || next_seq > UINT64_MAX - n) {
+        fprintf(stderr, "replay: captured seqs leave no room for new ones\n");
+        hash_table_free(seqs);
+        free(msgs);
+        free(out);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        wire_msg_t *msg = &msgs[i];
+        if (msg->msg_type == 0)
+            continue;
+
+        char key[USERNAME_SIZE + 40];
+        snprintf(key, sizeof(key), "%s/%u/%llu", msg->username, msg->account_id,
+                 (unsigned long long) msg->seq_num);
+        void *seq = hash_table_find(seqs, key);
+        char *copy;
+        if (seq == NULL && (copy = strdup(key)) != NULL) {
+            seq = (void*) (uintptr_t) next_seq++;
+            hash_table_add(seqs, copy, seq);
+        }
+        msg->seq_num = (uint64_t) (uintptr_t) seq;
+        if (seq == NULL || seal_request(rk, capture_get(cap, first + i), msg, &out[i]) != 0) {
+            out[i].len = 0;
+            (*unopened)++;
+        }
+    }
+
+    uint32_t pos = 0;
+    char *k;
+    void *v;
+    while (hash_table_next(seqs, &pos, &k, &v))
+        free(k);
+    hash_table_free(seqs);
+    memset(msgs, 0, n * sizeof(wire_msg_t));
+    free(msgs);
+    return out;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Take replies that are ready; wait up to timeout_us for the first one
+static long collect_replies(int fd, long timeout_us)
+{
+    char buf[ROUTER_MAX_PACKET];
+    long got = 0;
+    fd_set fds;
+    struct timeval tv;
+
+    tv.tv_sec = timeout_us / 1000000;
+    tv.tv_usec = timeout_us % 1000000;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+        return 0;
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        got++;
+    return got;
+}
+
+int main(int argc, char **argv)
+{
+    int fast = 0;
+    long window = 64;
+    const char *key_path = NULL;
+    ReplayKeys keys = { NULL, 0 };
+    int c;
+
+    while ((c = getopt(argc, argv, "fw:k:")) != -1) {
+        switch (c) {
+            case 'f': fast = 1; break;
+            case 'w': window = atol(optarg); break;
+            case 'k': key_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: replay [-f] [-w window] [-k bank-key-file] <capture-file>\n");
+                return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: replay [-f] [-w window] [-k bank-key-file] <capture-file>\n");
+        return 1;
+    }
+    if (window < 1)
+        window = 1;
+
+    if (key_path != NULL && load_keys(key_path, &keys) != 0) {
+        fprintf(stderr, "replay: cannot read bank key file %s\n", key_path);
+        return 1;
+    }
+
+    Capture *cap = capture_open(argv[optind]);
+    if (cap == NULL) {
+        fprintf(stderr, "replay: cannot read capture %s\n", argv[optind]);
+        return 1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(ROUTER_PORT);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        perror("replay: bind (is the router still running?)");
+        return 1;
+    }
+
+    struct sockaddr_in bank_addr = addr;
+    bank_addr.sin_port = htons(BANK_PORT);
+
+    uint64_t first = capture_first(cap), end = capture_end(cap);
+    uint64_t capture_start = 0;
+    long sent = 0, replies = 0, skipped = 0, unopened = 0;
+    Resealed *resealed = NULL;
+    if (keys.keys != NULL &&
+        (resealed = reseal_capture(cap, &keys, &unopened)) == NULL) {
+        fprintf(stderr, "replay: could not reseal the capture\n");
+        return 1;
+    }
+    uint64_t start = now_ns();
+
+    for (uint64_t i = first; i < end; i++) {
+        const CaptureRecord *rec = capture_get(cap, i);
+        if (rec == NULL) {
+            skipped++;
+            continue;
+        }
+        if (rec->dir != CAPTURE_ATM_TO_BANK)
+            continue;
+
+        if (capture_start == 0)
+            capture_start = rec->ts_ns;
+
+        if (fast) {
+            while (sent - replies >= window) {
+                long got = collect_replies(fd, REPLY_TIMEOUT_US);
+                if (got == 0)
+                    replies = sent - window + 1;  // give up on lost replies
+                replies += got;
+            }
+        } else {
+            // Keep the captured spacing, collecting replies while we wait
+            uint64_t due = start + (rec->ts_ns - capture_start);
+            uint64_t now;
+            while ((now = now_ns()) < due) {
+                replies += collect_replies(fd, (long) ((due - now) / 1000));
+            }
+        }
+
+        const void *data = rec->data;
+        size_t len = rec->len;
+        if (resealed != NULL && resealed[i - first].len > 0) {
+            data = resealed[i - first].data;
+            len = resealed[i - first].len;
+        }
+
+        sendto(fd, data, len, 0, (struct sockaddr*) &bank_addr, sizeof(bank_addr));
+        sent++;
+        replies += collect_replies(fd, 0);
+    }
+
+    long got;
+    while (replies < sent && (got = collect_replies(fd, REPLY_TIMEOUT_US)) > 0)
+        replies += got;
+
+    uint64_t elapsed = now_ns() - start;
+    printf("{\"replay\":\"%s\",\"mode\":\"%s\",\"resealed\":%s,\"sent\":%ld,\"replies\":%ld,"
+           "\"skipped\":%ld,\"unopened\":%ld,\"elapsed_ms\":%.1f,\"pps\":%.0f}\n",
+           argv[optind], fast ? "fast" : "timed", resealed != NULL ? "true" : "false",
+           sent, replies, skipped, unopened, elapsed / 1e6, sent * 1e9 / (elapsed ? elapsed : 1));
+
+    free(resealed);
+    if (keys.keys != NULL) {
+        memset(keys.keys, 0, keys.num_keys ? (size_t) keys.num_keys * KEY_SIZE : KEY_SIZE);
+        free(keys.keys);
+    }
+    capture_close(cap);
+    close(fd);
+    return 0;
+}
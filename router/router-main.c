@@ -4,25 +4,191 @@
  * For the first part of the project, you may not change this.
  *
  * For the second part of the project, feel free to change as necessary.
+ *
+ * Usage: router [-b | -u [-q]] [-t threads] [-s stats_interval_secs]
+ *               [-D delay] [-L loss%] [-U dup%] [-R reorder_window] [-S seed]
+ *               [-c capture_file] [-C capture_slots] [-m shard_map]
+ *
+ * With -b, datagrams are received with recvmmsg, grouped by destination
+ * and forwarded with one sendmmsg per group.  Network emulation (-D, -L,
+ * -U, -R) has its own loop, so it can't be combined with -b.
+ *
+ * With -u, datagrams are forwarded by an io_uring engine (see uring.h);
+ * -q adds a kernel submission-polling thread (only worth it with a spare
+ * core).  If the kernel can't run it, the router says so and uses the
+ * classic loop.
+ *
+ * With -t, each thread owns a socket bound to ROUTER_PORT with
+ * SO_REUSEPORT and runs its own forwarding loop.  With -s, packet
+ * rates for every thread are printed to stderr at that interval.
  */
 
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
 #include "router.h"
+#include "netem.h"
+#include "capture.h"
+#include "uring.h"
 #include "ports.h"
 
-int main(int argc, char**argv)
+#define MAX_THREADS 64
+
+// Per-thread state, padded so counters don't share cache lines
+typedef struct
+{
+    Router *router;
+    int index;
+    int batched;
+    int uring;                  // 0, 1 = io_uring, 2 = io_uring with SQPOLL
+    const NetemConfig *netem;
+    Capture *capture;
+    volatile unsigned long long packets;
+    volatile unsigned long long dropped;
+    volatile unsigned long long syscalls;   // io_uring engine only
+} __attribute__((aligned(64))) Forwarder;
+
+static void *forward_loop_batched(Forwarder *fwd)
 {
+   RouterBatch *batch = (RouterBatch*) malloc(sizeof(RouterBatch));
+   if(batch == NULL)
+   {
+       perror("Could not malloc RouterBatch");
+       exit(1);
+   }
+   router_batch_init(batch);
+
+   while(1)
+   {
+       int n = router_recv_batch(fwd->router, batch);
+       if(n <= 0)
+           continue;
+
+       if(fwd->capture != NULL)
+       {
+           for(int i = 0; i < n; i++)
+           {
+               unsigned short port = ntohs(batch->from[i].sin_port);
+               if(port == ATM_PORT || router_is_bank_port(fwd->router, port))
+                   capture_record(fwd->capture, batch->bufs[i], batch->in[i].msg_len,
+                                  port == ATM_PORT ? CAPTURE_ATM_TO_BANK : CAPTURE_BANK_TO_ATM);
+           }
+       }
+
+       unsigned long long dropped = fwd->dropped;
+       fwd->packets += router_forward_batch(fwd->router, batch, n, &dropped);
+       fwd->dropped = dropped;
+   }
+
+   return NULL;
+}
+
+// Returns only if io_uring can't be used: at once if it is unavailable,
+// or when uring_poll fails, saying why
+static void forward_loop_uring(Forwarder *fwd)
+{
+   Uring *uring = uring_create(fwd->router, fwd->capture, fwd->uring == 2);
+   if(uring == NULL)
+   {
+       fprintf(stderr, "router: io_uring unavailable, using the classic loop\n");
+       return;
+   }
+
+   const UringStats *stats = uring_stats(uring);
+   int err;
+   while((err = uring_poll(uring)) == 0)
+   {
+       fwd->packets = stats->forwarded;
+       fwd->dropped = stats->dropped;
+       fwd->syscalls = stats->syscalls;
+   }
+
+   if(err == -EOPNOTSUPP)
+       fprintf(stderr, "router: kernel lacks multishot recvmsg, using the classic loop\n");
+   else
+       fprintf(stderr, "router: io_uring loop failed (%s), falling back to the classic loop\n",
+               strerror(-err));
+   uring_free(uring);
+}
+
+static void *forward_loop_netem(Forwarder *fwd)
+{
+   Router *router = fwd->router;
+   char mesg[ROUTER_MAX_PACKET];
+   struct sockaddr_in incoming_addr;
+
+   // Each thread gets its own reproducible stream of decisions
+   Netem *netem = netem_create(fwd->netem, router, fwd->netem->seed + fwd->index,
+                                fwd->capture);
+   if(netem == NULL)
+   {
+       perror("Could not create network emulator");
+       exit(1);
+   }
+
+   fcntl(router->sockfd, F_SETFL, fcntl(router->sockfd, F_GETFL) | O_NONBLOCK);
+
+   struct pollfd pfd;
+   pfd.fd = router->sockfd;
+   pfd.events = POLLIN;
+
+   while(1)
+   {
+       if(poll(&pfd, 1, netem_timeout_ms(netem)) > 0)
+       {
+           // Take everything queued; delayed packets never block this
+           ssize_t n;
+           while((n = router_recv(router, mesg, sizeof(mesg), &incoming_addr)) >= 0)
+           {
+               unsigned short incoming_port = ntohs(incoming_addr.sin_port);
+
+               if(incoming_port == ATM_PORT)
+                   netem_enqueue(netem, mesg, n, 1);
+               else if(router_is_bank_port(router, incoming_port))
+                   netem_enqueue(netem, mesg, n, 0);
+               else
+                   fwd->dropped++;
+           }
+       }
+
+       netem_release_due(netem);
+
+       const NetemStats *stats = netem_stats(netem);
+       fwd->packets = stats->forwarded;
+   }
+
+   return NULL;
+}
+
+static void *forward_loop(void *arg)
+{
+   Forwarder *fwd = (Forwarder*) arg;
+   Router *router = fwd->router;
+
+   if(fwd->netem != NULL)
+       return forward_loop_netem(fwd);
+
+   if(fwd->batched)
+       return forward_loop_batched(fwd);
+
+   if(fwd->uring)
+       forward_loop_uring(fwd);
+
    int n;
    char mesg[1000];
    struct sockaddr_in incoming_addr;
 
-   Router *router = router_create();
-
    while(1)
    {
        n = router_recv(router, mesg, 1000, &incoming_addr);
+       if(n < 0)
+           continue;
 
        unsigned short incoming_port = ntohs(incoming_addr.sin_port);
 
@@ -30,18 +196,175 @@ int main(int argc, char**argv)
        if(incoming_port == ATM_PORT)
        {
            router_sendto_bank(router, mesg, n);
+           if(fwd->capture != NULL)
+               capture_record(fwd->capture, mesg, n, CAPTURE_ATM_TO_BANK);
+           fwd->packets++;
        }
 
        // Packet from the bank: forward it to the ATM
-       else if(incoming_port == BANK_PORT)
+       else if(router_is_bank_port(router, incoming_port))
        {
            router_sendto_atm(router, mesg, n);
+           if(fwd->capture != NULL)
+               capture_record(fwd->capture, mesg, n, CAPTURE_BANK_TO_ATM);
+           fwd->packets++;
        }
 
        else
        {
            fprintf(stderr, "> I don't know who this came from: dropping it\n");
+           fwd->dropped++;
+       }
+   }
+
+   return NULL;
+}
+
+static void report_stats(Forwarder *fwds, int nthreads, int interval)
+{
+   unsigned long long last[MAX_THREADS] = { 0 };
+
+   while(1)
+   {
+       sleep(interval);
+
+       unsigned long long total = 0;
+       for(int i = 0; i < nthreads; i++)
+       {
+           unsigned long long packets = fwds[i].packets;
+           unsigned long long rate = (packets - last[i]) / interval;
+           last[i] = packets;
+           total += rate;
+           fprintf(stderr, "router: thread %d: %llu pkt/s (%llu total, %llu dropped",
+                   i, rate, packets, fwds[i].dropped);
+           if(fwds[i].uring)
+               fprintf(stderr, ", %.3f syscalls/pkt",
+                       packets ? (double) fwds[i].syscalls / packets : 0.0);
+           fprintf(stderr, ")\n");
        }
+       fprintf(stderr, "router: all threads: %llu pkt/s\n", total);
+   }
+}
+
+int main(int argc, char**argv)
+{
+   int nthreads = 1;
+   int stats_interval = 0;
+   int batched = 0;
+   int uring = 0;
+   int sqpoll = 0;
+   NetemConfig netem;
+   const char *capture_path = NULL;
+   unsigned int capture_slots = CAPTURE_DEFAULT_SLOTS;
+   Capture *capture = NULL;
+   ShardRing *shards = NULL;
+   int c;
+
+   netem_config_init(&netem);
+
+   while((c = getopt(argc, argv, "buqt:s:D:L:U:R:S:c:C:m:")) != -1)
+   {
+       switch(c)
+       {
+           case 'b': batched = 1; break;
+           case 'u': uring = 1; break;
+           case 'q': sqpoll = 1; break;
+           case 't': nthreads = atoi(optarg); break;
+           case 's': stats_interval = atoi(optarg); break;
+           case 'D':
+               if(netem_parse_delay(&netem, optarg) != 0)
+               {
+                   fprintf(stderr, "router: bad delay '%s'\n", optarg);
+                   return EXIT_FAILURE;
+               }
+               break;
+           case 'L': netem.loss = atof(optarg) / 100.0; break;
+           case 'U': netem.dup = atof(optarg) / 100.0; break;
+           case 'R': netem.reorder = atoi(optarg); break;
+           case 'S': netem.seed = strtoull(optarg, NULL, 10); break;
+           case 'c': capture_path = optarg; break;
+           case 'C': capture_slots = (unsigned int) strtoul(optarg, NULL, 10); break;
+           case 'm':
+               shards = shard_ring_load(optarg);
+               if(shards == NULL)
+               {
+                   fprintf(stderr, "router: could not load shard map %s\n", optarg);
+                   return EXIT_FAILURE;
+               }
+               break;
+           default:
+               fprintf(stderr, "Usage: router [-b | -u [-q]] [-t threads] [-s stats_interval_secs]\n"
+                               "              [-D delay] [-L loss%%] [-U dup%%] [-R reorder_window] [-S seed]\n"
+                               "              [-c capture_file] [-C capture_slots] [-m shard_map]\n");
+               return EXIT_FAILURE;
+       }
+   }
+
+   if(nthreads < 1 || nthreads > MAX_THREADS)
+   {
+       fprintf(stderr, "router: thread count must be between 1 and %d\n", MAX_THREADS);
+       return EXIT_FAILURE;
+   }
+
+   if(batched && netem_enabled(&netem))
+   {
+       fprintf(stderr, "router: -b can't be combined with network emulation\n");
+       return EXIT_FAILURE;
+   }
+
+   if(uring && (batched || netem_enabled(&netem)))
+   {
+       fprintf(stderr, "router: -u can't be combined with -b or network emulation\n");
+       return EXIT_FAILURE;
+   }
+
+   if(capture_path != NULL)
+   {
+       capture = capture_create(capture_path, capture_slots);
+       if(capture == NULL)
+       {
+           fprintf(stderr, "router: could not create capture file %s\n", capture_path);
+           return EXIT_FAILURE;
+       }
+   }
+
+   static Forwarder fwds[MAX_THREADS];
+   pthread_t tids[MAX_THREADS];
+
+   for(int i = 0; i < nthreads; i++)
+   {
+       fwds[i].router = (nthreads == 1) ? router_create() : router_create_shared();
+       router_set_shards(fwds[i].router, shards);
+       fwds[i].index = i;
+       fwds[i].batched = batched;
+       fwds[i].uring = uring ? 1 + sqpoll : 0;
+       fwds[i].netem = netem_enabled(&netem) ? &netem : NULL;
+       fwds[i].capture = capture;
+       fwds[i].packets = 0;
+       fwds[i].dropped = 0;
+       fwds[i].syscalls = 0;
+   }
+
+   // Single-threaded without stats: forward on the main thread
+   if(nthreads == 1 && stats_interval <= 0)
+   {
+       forward_loop(&fwds[0]);
+       return EXIT_SUCCESS;
+   }
+
+   for(int i = 0; i < nthreads; i++)
+   {
+       pthread_create(&tids[i], NULL, forward_loop, &fwds[i]);
+   }
+
+   if(stats_interval > 0)
+   {
+       report_stats(fwds, nthreads, stats_interval);
+   }
+
+   for(int i = 0; i < nthreads; i++)
+   {
+       pthread_join(tids[i], NULL);
    }
 
    return EXIT_SUCCESS;
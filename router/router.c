@@ -1,10 +1,11 @@
 #include "router.h"
 #include "ports.h"
+#include "protocol.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-Router* router_create()
+static Router* router_create_with(int reuseport)
 {
     Router *router = (Router*) malloc(sizeof(Router));
     if(router == NULL)
@@ -15,6 +16,18 @@ Router* router_create()
 
     router->sockfd = socket(AF_INET,SOCK_DGRAM,0);
 
+    // Several routers can share ROUTER_PORT; the kernel spreads
+    // incoming flows across their sockets
+    if(reuseport)
+    {
+        int one = 1;
+        if(setsockopt(router->sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+        {
+            perror("Could not set SO_REUSEPORT");
+            exit(1);
+        }
+    }
+
     // Initialize router's address
     bzero(&router->rtr_addr,sizeof(router->rtr_addr));
     router->rtr_addr.sin_family = AF_INET;
@@ -34,9 +47,21 @@ Router* router_create()
     router->atm_addr.sin_addr.s_addr=htonl(INADDR_ANY);
     router->atm_addr.sin_port=htons(ATM_PORT);
 
+    router->shards = NULL;
+
     return router;
 }
 
+Router* router_create()
+{
+    return router_create_with(0);
+}
+
+Router* router_create_shared()
+{
+    return router_create_with(1);
+}
+
 void router_free(Router *router)
 {
     if(router != NULL)
@@ -60,8 +85,127 @@ ssize_t router_sendto_atm(Router *router, char *data, size_t len)
            (struct sockaddr *)&router->atm_addr, sizeof(router->atm_addr));
 }
 
+void router_set_shards(Router *router, const ShardRing *shards)
+{
+    router->shards = shards;
+}
+
+// Enveloped packets go to the shard that owns their route tag; anything
+// else goes to the default bank
+const struct sockaddr_in* router_bank_addr_for(Router *router, const char *data, size_t len)
+{
+    if(router->shards != NULL && packet_has_envelope((const unsigned char*)data, len))
+    {
+        const envelope_t *env = (const envelope_t*)data;
+        return &shard_ring_lookup(router->shards, ntohl(env->route_tag))->addr;
+    }
+    return &router->bank_addr;
+}
+
+int router_is_bank_port(Router *router, unsigned short port)
+{
+    return port == BANK_PORT ||
+           (router->shards != NULL && shard_ring_has_port(router->shards, port));
+}
+
 ssize_t router_sendto_bank(Router *router, char *data, size_t len)
 {
+    const struct sockaddr_in *addr = router_bank_addr_for(router, data, len);
     return sendto(router->sockfd, data, len, 0,
-           (struct sockaddr *)&router->bank_addr, sizeof(router->bank_addr));
+           (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+void router_batch_init(RouterBatch *batch)
+{
+    memset(batch, 0, sizeof(*batch));
+    for(int i = 0; i < ROUTER_BATCH; i++)
+    {
+        batch->iov[i].iov_base = batch->bufs[i];
+        batch->iov[i].iov_len = ROUTER_MAX_PACKET;
+        batch->in[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->in[i].msg_hdr.msg_iovlen = 1;
+        batch->in[i].msg_hdr.msg_name = &batch->from[i];
+    }
+}
+
+// Block for at least one datagram, then take whatever else is queued
+int router_recv_batch(Router *router, RouterBatch *batch)
+{
+    for(int i = 0; i < ROUTER_BATCH; i++)
+    {
+        batch->iov[i].iov_len = ROUTER_MAX_PACKET;
+        batch->in[i].msg_hdr.msg_namelen = sizeof(batch->from[i]);
+    }
+
+#ifdef __linux__
+    return recvmmsg(router->sockfd, batch->in, ROUTER_BATCH, MSG_WAITFORONE, NULL);
+#else
+    ssize_t n = router_recv(router, batch->bufs[0], ROUTER_MAX_PACKET, &batch->from[0]);
+    if(n < 0)
+        return -1;
+    batch->in[0].msg_len = n;
+    return 1;
+#endif
+}
+
+static void send_group(Router *router, struct mmsghdr *msgs, int count)
+{
+#ifdef __linux__
+    int sent = 0;
+    while(sent < count)
+    {
+        int n = sendmmsg(router->sockfd, msgs + sent, count - sent, 0);
+        if(n <= 0)
+            n = 1;  // skip the datagram that failed
+        sent += n;
+    }
+#else
+    for(int i = 0; i < count; i++)
+        sendmsg(router->sockfd, &msgs[i].msg_hdr, 0);
+#endif
+}
+
+// Sort n received datagrams by destination and send each group with one
+// sendmmsg.  Outgoing messages point at the receive buffers.
+int router_forward_batch(Router *router, RouterBatch *batch, int n, unsigned long long *dropped)
+{
+    int nbank = 0, natm = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        unsigned short incoming_port = ntohs(batch->from[i].sin_port);
+        struct mmsghdr *out;
+
+        if(incoming_port == ATM_PORT)
+        {
+            // sendmmsg takes a destination per message, so one call still
+            // covers every shard
+            out = &batch->to_bank[nbank++];
+            out->msg_hdr.msg_name = (void*)router_bank_addr_for(router, batch->bufs[i],
+                                                                batch->in[i].msg_len);
+            out->msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        else if(router_is_bank_port(router, incoming_port))
+        {
+            out = &batch->to_atm[natm++];
+            out->msg_hdr.msg_name = &router->atm_addr;
+            out->msg_hdr.msg_namelen = sizeof(router->atm_addr);
+        }
+        else
+        {
+            (*dropped)++;
+            continue;
+        }
+
+        batch->iov[i].iov_len = batch->in[i].msg_len;
+        out->msg_hdr.msg_iov = &batch->iov[i];
+        out->msg_hdr.msg_iovlen = 1;
+    }
+
+    if(nbank > 0)
+        send_group(router, batch->to_bank, nbank);
+    if(natm > 0)
+        send_group(router, batch->to_atm, natm);
+
+    return nbank + natm;
 }
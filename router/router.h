@@ -15,6 +15,21 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include "shard.h"
+
+#ifndef __linux__
+// recvmmsg/sendmmsg are Linux-only; elsewhere batches fall back to
+// one datagram per syscall
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+#define ROUTER_MAX_PACKET 1000   // largest datagram the router forwards
+#define ROUTER_BATCH 64          // datagrams moved per recvmmsg/sendmmsg
 
 typedef struct _Router
 {
@@ -22,13 +37,34 @@ typedef struct _Router
     struct sockaddr_in rtr_addr;
     struct sockaddr_in atm_addr;
     struct sockaddr_in bank_addr;
+    const ShardRing *shards;         // NULL unless banks are sharded
 } Router;
 
+// Preallocated buffers for batched forwarding.  Received datagrams are
+// forwarded straight out of bufs; nothing is copied or allocated per
+// packet.
+typedef struct _RouterBatch
+{
+    char bufs[ROUTER_BATCH][ROUTER_MAX_PACKET];
+    struct iovec iov[ROUTER_BATCH];
+    struct sockaddr_in from[ROUTER_BATCH];
+    struct mmsghdr in[ROUTER_BATCH];
+    struct mmsghdr to_bank[ROUTER_BATCH];
+    struct mmsghdr to_atm[ROUTER_BATCH];
+} RouterBatch;
+
 Router* router_create();
+Router* router_create_shared();
 void router_free(Router *rtr);
 ssize_t router_recv(Router *rtr, char *data, size_t max_len, struct sockaddr_in *sender);
 ssize_t router_sendto_atm(Router *rtr, char *data, size_t len);
 ssize_t router_sendto_bank(Router *rtr, char *data, size_t len);
+void router_set_shards(Router *rtr, const ShardRing *shards);
+const struct sockaddr_in* router_bank_addr_for(Router *rtr, const char *data, size_t len);
+int router_is_bank_port(Router *rtr, unsigned short port);
+void router_batch_init(RouterBatch *batch);
+int router_recv_batch(Router *rtr, RouterBatch *batch);
+int router_forward_batch(Router *rtr, RouterBatch *batch, int n, unsigned long long *dropped);
 
 
 #endif
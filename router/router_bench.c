@@ -0,0 +1,121 @@
+/*
+ * Packets-per-second benchmark for a running router.
+ *
+ * Usage: router-bench [-l label] [-n packets] [-s size] [-w window]
+ *
+ * Binds ATM_PORT and BANK_PORT itself, sends datagrams "from the ATM"
+ * to the router in bursts of `window`, and counts how many arrive at the
+ * bank port.  Prints one JSON line.  Stop any real ATM/bank first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include "router.h"
+#include "ports.h"
+#include "bench.h"
+
+static int bind_port(unsigned short port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    int size = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("router-bench: bind");
+        exit(1);
+    }
+    return fd;
+}
+
+// Receive until `want` datagrams arrived or nothing shows up for 100ms
+static long drain(int fd, long want)
+{
+    char buf[ROUTER_MAX_PACKET];
+    long got = 0;
+
+    while (got < want) {
+        fd_set fds;
+        struct timeval tv = { 0, 100000 };
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+            break;
+        while (got < want && recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            got++;
+    }
+    return got;
+}
+
+int main(int argc, char **argv)
+{
+    const char *label = "router";
+    long packets = 200000;
+    size_t size = 100;
+    int window = 128;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:n:s:w:")) != -1) {
+        switch (c) {
+            case 'l': label = optarg; break;
+            case 'n': packets = atol(optarg); break;
+            case 's': size = (size_t)atol(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: router-bench [-l label] [-n packets] [-s size] [-w window]\n");
+                return 1;
+        }
+    }
+    if (size > ROUTER_MAX_PACKET)
+        size = ROUTER_MAX_PACKET;
+    if (window < 1)
+        window = 1;
+
+    int atm_fd = bind_port(ATM_PORT);
+    int bank_fd = bind_port(BANK_PORT);
+
+    struct sockaddr_in rtr_addr;
+    memset(&rtr_addr, 0, sizeof(rtr_addr));
+    rtr_addr.sin_family = AF_INET;
+    rtr_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    rtr_addr.sin_port = htons(ROUTER_PORT);
+
+    char payload[ROUTER_MAX_PACKET];
+    memset(payload, 'p', sizeof(payload));
+
+    // Make sure the router is up before timing anything
+    sendto(atm_fd, payload, size, 0, (struct sockaddr*)&rtr_addr, sizeof(rtr_addr));
+    if (drain(bank_fd, 1) != 1) {
+        fprintf(stderr, "router-bench: no router on port %d\n", ROUTER_PORT);
+        return 1;
+    }
+
+    long sent = 0, received = 0;
+    uint64_t start = bench_now_ns();
+
+    while (sent < packets) {
+        int burst = (packets - sent < window) ? (int)(packets - sent) : window;
+        for (int i = 0; i < burst; i++)
+            sendto(atm_fd, payload, size, 0, (struct sockaddr*)&rtr_addr, sizeof(rtr_addr));
+        sent += burst;
+        received += drain(bank_fd, burst);
+    }
+
+    uint64_t elapsed = bench_now_ns() - start;
+
+    printf("{\"bench\":\"router\",\"mode\":\"%s\",\"size\":%zu,\"window\":%d,"
+           "\"sent\":%ld,\"received\":%ld,\"pps\":%.0f}\n",
+           label, size, window, sent, received, received * 1e9 / elapsed);
+
+    close(atm_fd);
+    close(bank_fd);
+    return 0;
+}
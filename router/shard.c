@@ -0,0 +1,135 @@
+#include "shard.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+ShardRing* shard_ring_create(void)
+{
+    return (ShardRing*) calloc(1, sizeof(ShardRing));
+}
+
+void shard_ring_free(ShardRing *ring)
+{
+    if (ring != NULL) {
+        free(ring->points);
+        free(ring);
+    }
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    const RingPoint *pa = (const RingPoint*) a;
+    const RingPoint *pb = (const RingPoint*) b;
+    if (pa->point != pb->point)
+        return pa->point < pb->point ? -1 : 1;
+    return pa->shard - pb->shard;
+}
+
+int shard_ring_add(ShardRing *ring, const char *name, unsigned short port, int weight)
+{
+    if (ring->num_shards >= MAX_SHARDS || weight < 1 || strlen(name) >= sizeof(ring->shards[0].name)) {
+        return -1;
+    }
+
+    int vnodes = SHARD_VNODES * weight;
+    RingPoint *points = (RingPoint*) realloc(ring->points,
+                                             sizeof(RingPoint) * (ring->num_points + vnodes));
+    if (points == NULL) {
+        return -1;
+    }
+    ring->points = points;
+
+    int idx = ring->num_shards++;
+    Shard *shard = &ring->shards[idx];
+    strcpy(shard->name, name);
+    shard->port = port;
+    shard->weight = weight;
+    memset(&shard->addr, 0, sizeof(shard->addr));
+    shard->addr.sin_family = AF_INET;
+    shard->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    shard->addr.sin_port = htons(port);
+
+    // Points depend only on the shard's name, not its position in the file
+    for (int i = 0; i < vnodes; i++) {
+        char label[64];
+        int n = snprintf(label, sizeof(label), "%s#%d", name, i);
+        ring->points[ring->num_points].point = routing_tag(label, n);
+        ring->points[ring->num_points].shard = idx;
+        ring->num_points++;
+    }
+
+    qsort(ring->points, ring->num_points, sizeof(RingPoint), compare_points);
+    return 0;
+}
+
+ShardRing* shard_ring_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    ShardRing *ring = shard_ring_create();
+    if (ring == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        char keyword[16], name[32];
+        int port = 0, weight = 1;
+        int num = sscanf(line, "%15s %31s %d %d", keyword, name, &port, &weight);
+        if (num <= 0) {
+            continue;  // blank or comment
+        }
+
+        if (num < 3 || strcmp(keyword, "shard") != 0 || port <= 0 || port > 65535 ||
+            shard_ring_add(ring, name, (unsigned short) port, weight) != 0) {
+            fprintf(stderr, "%s:%d: bad shard line\n", path, lineno);
+            fclose(f);
+            shard_ring_free(ring);
+            return NULL;
+        }
+    }
+
+    fclose(f);
+
+    if (ring->num_shards == 0) {
+        shard_ring_free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+const Shard* shard_ring_lookup(const ShardRing *ring, uint32_t tag)
+{
+    // First point at or after tag, wrapping around
+    int lo = 0, hi = ring->num_points;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point < tag)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == ring->num_points)
+        lo = 0;
+    return &ring->shards[ring->points[lo].shard];
+}
+
+int shard_ring_has_port(const ShardRing *ring, unsigned short port)
+{
+    for (int i = 0; i < ring->num_shards; i++) {
+        if (ring->shards[i].port == port)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Consistent-hash ring that maps accounts to bank shards.
+ *
+ * Each shard owns SHARD_VNODES * weight points on a 32-bit ring.  An
+ * account belongs to the first point at or after its routing_tag(), so
+ * adding a shard only moves the accounts that land on its new points
+ * (about 1/N of them).
+ *
+ * Config file, one shard per line ('#' starts a comment):
+ *     shard <name> <port> [weight]
+ */
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define MAX_SHARDS 64
+#define SHARD_VNODES 160
+
+typedef struct _Shard
+{
+    char name[32];
+    unsigned short port;
+    int weight;
+    struct sockaddr_in addr;
+} Shard;
+
+typedef struct _RingPoint
+{
+    uint32_t point;
+    int shard;
+} RingPoint;
+
+typedef struct _ShardRing
+{
+    Shard shards[MAX_SHARDS];
+    int num_shards;
+    RingPoint *points;      // sorted by point
+    int num_points;
+} ShardRing;
+
+ShardRing* shard_ring_load(const char *path);
+ShardRing* shard_ring_create(void);
+int shard_ring_add(ShardRing *ring, const char *name, unsigned short port, int weight);
+void shard_ring_free(ShardRing *ring);
+const Shard* shard_ring_lookup(const ShardRing *ring, uint32_t tag);
+int shard_ring_has_port(const ShardRing *ring, unsigned short port);
+
+#endif
@@ -0,0 +1,435 @@
+#include "uring.h"
+#include "ports.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define RECV_TAG (~0ULL)        // user_data of the multishot recv; sends use the buffer id
+#define BUF_GROUP 0
+
+struct _Uring
+{
+    int fd;
+    Router *router;
+    Capture *capture;
+    int sqpoll;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // SQEs filled in; published at flush
+    unsigned sq_submitted;      // SQEs handed to the kernel
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    unsigned short buf_tail;
+    char *bufs;
+
+    struct msghdr recv_msg;
+    int recv_armed;
+    int out_of_buffers;         // recv stopped with -ENOBUFS; re-arm after a recycle
+    int received;               // multishot recv has delivered at least once
+
+    // Per-buffer send state; lives until the send completes
+    struct msghdr send_msg[URING_BUFS];
+    struct iovec send_iov[URING_BUFS];
+    struct sockaddr_in send_to[URING_BUFS];
+    struct io_uring_sqe *last_send;
+
+    UringStats stats;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void recycle_buffer(Uring *u, unsigned short bid)
+{
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFS - 1)];
+    buf->addr = (unsigned long) (u->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    u->buf_tail++;
+    u->out_of_buffers = 0;
+}
+
+// Make filled SQEs and recycled buffers visible to the kernel
+static void publish(Uring *u)
+{
+    // The last send of a pass ends its chain
+    if (u->last_send != NULL) {
+        u->last_send->flags &= ~IOSQE_IO_HARDLINK;
+        u->last_send = NULL;
+    }
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static int enter(Uring *u, unsigned min_complete)
+{
+    unsigned to_submit = u->sq_local_tail - u->sq_submitted;
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    if (u->sqpoll) {
+        // The poller thread consumes the SQ; only wake it if it went idle
+        if (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        u->sq_submitted = u->sq_local_tail;
+        if (flags == 0)
+            return 0;
+    } else if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+
+    u->stats.syscalls++;
+    int ret = sys_io_uring_enter(u->fd, u->sqpoll ? 0 : to_submit, min_complete, flags);
+    if (ret < 0)
+        return (errno == EINTR || errno == EAGAIN || errno == EBUSY) ? 0 : -errno;
+    if (!u->sqpoll)
+        u->sq_submitted += ret;
+    return 0;
+}
+
+static struct io_uring_sqe* get_sqe(Uring *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries) {
+        // Full: push what we have and try again
+        publish(u);
+        if (enter(u, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local_tail - head >= u->sq_entries)
+            return NULL;
+    }
+
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+static int arm_recv(Uring *u)
+{
+    struct io_uring_sqe *sqe = get_sqe(u);
+    if (sqe == NULL)
+        return -EBUSY;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = u->router->sockfd;
+    sqe->addr = (unsigned long) &u->recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = RECV_TAG;
+    u->recv_armed = 1;
+    return 0;
+}
+
+static void handle_packet(Uring *u, unsigned short bid)
+{
+    char *buf = u->bufs + (size_t) bid * URING_BUF_SIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) buf;
+    struct sockaddr_in *from = (struct sockaddr_in*) (buf + sizeof(*out));
+    char *payload = buf + sizeof(*out) + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+    size_t len = out->payloadlen;
+    const struct sockaddr_in *to;
+    int dir;
+
+    if ((out->flags & MSG_TRUNC) || len > ROUTER_MAX_PACKET ||
+        out->namelen < sizeof(struct sockaddr_in)) {
+        u->stats.dropped++;
+        recycle_buffer(u, bid);
+        return;
+    }
+
+    unsigned short port = ntohs(from->sin_port);
+    if (port == ATM_PORT) {
+        to = router_bank_addr_for(u->router, payload, len);
+        dir = CAPTURE_ATM_TO_BANK;
+    } else if (router_is_bank_port(u->router, port)) {
+        to = &u->router->atm_addr;
+        dir = CAPTURE_BANK_TO_ATM;
+    } else {
+        u->stats.dropped++;
+        recycle_buffer(u, bid);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(u);
+    if (sqe == NULL) {
+        u->stats.dropped++;
+        recycle_buffer(u, bid);
+        return;
+    }
+
+    if (u->capture != NULL)
+        capture_record(u->capture, payload, len, dir);
+
+    u->send_to[bid] = *to;
+    u->send_iov[bid].iov_base = payload;
+    u->send_iov[bid].iov_len = len;
+    struct msghdr *msg = &u->send_msg[bid];
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &u->send_to[bid];
+    msg->msg_namelen = sizeof(struct sockaddr_in);
+    msg->msg_iov = &u->send_iov[bid];
+    msg->msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = u->router->sockfd;
+    sqe->addr = (unsigned long) msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_IO_HARDLINK;     // a failed send doesn't cancel the rest
+    sqe->user_data = bid;
+    u->last_send = sqe;
+}
+
+// Returns -1 if the kernel can't do multishot recvmsg on this socket
+static int reap(Uring *u)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+        if (cqe->user_data == RECV_TAG) {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                u->recv_armed = 0;
+
+            if (cqe->res < 0) {
+                if (cqe->res == -EINVAL && !u->received) {
+                    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+                    return -EOPNOTSUPP;
+                }
+                // Every buffer is in flight; re-armed once a send completes
+                if (cqe->res == -ENOBUFS)
+                    u->out_of_buffers = 1;
+                continue;
+            }
+
+            u->received = 1;
+            handle_packet(u, (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+        } else {
+            if (cqe->res < 0)
+                u->stats.dropped++;
+            else
+                u->stats.forwarded++;
+            recycle_buffer(u, (unsigned short) cqe->user_data);
+        }
+    }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+Uring* uring_create(Router *router, Capture *capture, int sqpoll)
+{
+    Uring *u = (Uring*) calloc(1, sizeof(Uring));
+    if (u == NULL)
+        return NULL;
+
+    u->router = router;
+    u->capture = capture;
+    u->sqpoll = sqpoll;
+    u->fd = -1;
+    u->sq_ring = u->cq_ring = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->buf_ring = MAP_FAILED;
+    u->bufs = MAP_FAILED;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0)
+        goto fail;
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_len > u->sq_ring_len)
+            u->sq_ring_len = u->cq_ring_len;
+        u->cq_ring_len = 0;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (u->cq_ring_len == 0) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = (char*) u->sq_ring;
+    char *cq = (char*) u->cq_ring;
+    u->sq_head = (unsigned*) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_flags = (unsigned*) (sq + p.sq_off.flags);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = u->sq_submitted = *u->sq_tail;
+    u->cq_head = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // Provided buffer ring (kernel 5.19+)
+    u->buf_ring_len = URING_BUFS * sizeof(struct io_uring_buf);
+    u->buf_ring = (struct io_uring_buf_ring*) mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = (char*) mmap(NULL, (size_t) URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED || u->bufs == MAP_FAILED)
+        goto fail;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) u->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = BUF_GROUP;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+
+    for (unsigned i = 0; i < URING_BUFS; i++)
+        recycle_buffer(u, (unsigned short) i);
+
+    // Each buffer starts with io_uring_recvmsg_out, then the source address
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    u->recv_msg.msg_controllen = 0;
+
+    if (arm_recv(u) < 0)
+        goto fail;
+    publish(u);
+
+    return u;
+
+fail:
+    uring_free(u);
+    return NULL;
+}
+
+void uring_free(Uring *u)
+{
+    if (u == NULL)
+        return;
+
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->bufs != MAP_FAILED)
+        munmap(u->bufs, (size_t) URING_BUFS * URING_BUF_SIZE);
+    if (u->buf_ring != MAP_FAILED)
+        munmap(u->buf_ring, u->buf_ring_len);
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_len);
+    if (u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_len);
+    free(u);
+}
+
+// One pass: submit queued sends, wait for completions if there are none,
+// then forward everything that completed.  Returns 0, or a negative
+// errno once the engine can't go on.
+int uring_poll(Uring *u)
+{
+    unsigned pending = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head;
+    int err;
+
+    if ((err = enter(u, pending == 0 ? 1 : 0)) < 0)
+        return err;
+
+    if ((err = reap(u)) < 0)
+        return err;
+
+    if (!u->recv_armed && !u->out_of_buffers && (err = arm_recv(u)) < 0)
+        return err;
+
+    publish(u);
+    return 0;
+}
+
+#else  // no io_uring: callers fall back to the classic loop
+
+struct _Uring
+{
+    UringStats stats;
+};
+
+Uring* uring_create(Router *router, Capture *capture, int sqpoll)
+{
+    (void) router;
+    (void) capture;
+    (void) sqpoll;
+    return NULL;
+}
+
+void uring_free(Uring *uring)
+{
+    free(uring);
+}
+
+int uring_poll(Uring *uring)
+{
+    (void) uring;
+    return -ENOSYS;
+}
+
+#endif
+
+const UringStats* uring_stats(const Uring *uring)
+{
+    return &uring->stats;
+}
@@ -0,0 +1,45 @@
+/*
+ * io_uring forwarding engine for the router.
+ *
+ * One multishot recvmsg stays armed on the router socket and receives
+ * into a ring of provided buffers registered with the kernel.  Each
+ * datagram is sent straight out of the buffer it arrived in; the sends
+ * produced by one pass over the completion queue are hard-linked so they
+ * leave in arrival order, and a buffer goes back to the ring when its
+ * send completes.  Submitting new sends and reaping completions share a
+ * single io_uring_enter per pass.  With SQPOLL a kernel thread picks up
+ * submissions, and the router only enters the kernel to sleep when idle.
+ *
+ * Talks to the kernel with raw syscalls; there is no liburing dependency.
+ * uring_create returns NULL when io_uring or provided buffer rings are
+ * unavailable.  uring_poll returns a negative errno when the engine has
+ * to stop, -EOPNOTSUPP if the kernel rejects multishot recvmsg, so
+ * callers can fall back to the classic loop.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "router.h"
+#include "capture.h"
+
+#define URING_ENTRIES 256       // submission queue size
+#define URING_CQ_ENTRIES 1024
+#define URING_BUFS 256          // provided buffers; a power of two
+#define URING_BUF_SIZE 2048     // recvmsg header + address + payload
+
+typedef struct _UringStats
+{
+    unsigned long long forwarded;
+    unsigned long long dropped;
+    unsigned long long syscalls;    // io_uring_enter calls
+} UringStats;
+
+typedef struct _Uring Uring;
+
+Uring* uring_create(Router *router, Capture *capture, int sqpoll);
+void uring_free(Uring *uring);
+int uring_poll(Uring *uring);
+const UringStats* uring_stats(const Uring *uring);
+
+#endif
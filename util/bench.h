@@ -0,0 +1,68 @@
+/*
+ * Small helpers shared by the benchmark programs (bin/...-bench).
+ * Results are printed one JSON object per line so they can be
+ * collected and compared by scripts.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Keep the compiler from optimizing away a result
+static inline void bench_consume(const void *p)
+{
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+// Summary of repeated timings of the same work.  Passes run before the
+// timed ones (warmup) are simply not recorded.
+typedef struct
+{
+    int reps;
+    uint64_t min_ns;
+    uint64_t median_ns;
+    uint64_t max_ns;
+} BenchStats;
+
+// Sorts samples[0..reps) in place
+static inline BenchStats bench_stats(uint64_t *samples, int reps)
+{
+    BenchStats st = { reps, 0, 0, 0 };
+    for (int i = 1; i < reps; i++) {
+        uint64_t v = samples[i];
+        int j = i;
+        for (; j > 0 && samples[j - 1] > v; j--)
+            samples[j] = samples[j - 1];
+        samples[j] = v;
+    }
+    if (reps > 0) {
+        st.min_ns = samples[0];
+        st.median_ns = samples[reps / 2];
+        st.max_ns = samples[reps - 1];
+    }
+    return st;
+}
+
+// The "reps" and per-operation timing fields of a JSON result, for work
+// of `ops` operations
+static inline void bench_print_stats(const BenchStats *st, uint64_t ops)
+{
+    if (ops == 0)
+        ops = 1;
+    printf("\"reps\":%d,\"ns_per_op_min\":%.2f,\"ns_per_op_median\":%.2f,"
+           "\"ns_per_op_max\":%.2f,\"ops_per_sec\":%.0f",
+           st->reps, (double)st->min_ns / ops, (double)st->median_ns / ops,
+           (double)st->max_ns / ops, st->median_ns ? ops * 1e9 / st->median_ns : 0.0);
+}
+
+#endif
@@ -0,0 +1,449 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chash_table.h"
+#include "hash_table.h"
+
+// Writers publish with release stores and readers follow pointers with
+// acquire loads, so a reader that reaches a node sees it fully built.
+#define LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static inline uint64_t key_hash(const CHashTable *ht, const char *key)
+{
+    return hash64(key, strlen(key), ht->seed);
+}
+
+// Both arrays index buckets by the low bits of the hash and have at least
+// CHT_STRIPES buckets, so a key's old and new bucket share a stripe
+static inline pthread_mutex_t* stripe_for(CHashTable *ht, uint64_t h)
+{
+    return &ht->stripes[h & (CHT_STRIPES - 1)];
+}
+
+static CHashBuckets* alloc_buckets(uint32_t num_buckets)
+{
+    CHashBuckets *b = (CHashBuckets*) calloc(1, sizeof(CHashBuckets));
+    if (b == NULL)
+        return NULL;
+    b->heads = (CHashNode**) calloc(num_buckets, sizeof(CHashNode*));
+    b->moved = (uint8_t*) calloc(num_buckets, sizeof(uint8_t));
+    if (b->heads == NULL || b->moved == NULL) {
+        free(b->heads);
+        free(b->moved);
+        free(b);
+        return NULL;
+    }
+    b->num_buckets = num_buckets;
+    return b;
+}
+
+static void free_buckets(CHashBuckets *b)
+{
+    free(b->heads);
+    free(b->moved);
+    free(b);
+}
+
+static CHashNode* alloc_node(uint64_t h, char *key, void *val)
+{
+    CHashNode *node = (CHashNode*) malloc(sizeof(CHashNode));
+    if (node == NULL)
+        return NULL;
+    node->hash = h;
+    node->key = key;
+    node->val = val;
+    node->next = NULL;
+    return node;
+}
+
+// Epoch-based reclamation.  Each thread takes one of CHT_MAX_THREADS
+// slots the first time it touches any table and gives it back when it
+// exits; slot i is readers[i] in every table.
+
+static uint8_t slot_taken[CHT_MAX_THREADS];
+static uint32_t slots_used;             // slots ever handed out
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static __thread int my_slot = -2;       // -2 = not assigned yet, -1 = none free
+
+static void release_slot(void *arg)
+{
+    STORE(&slot_taken[(intptr_t)arg - 1], 0);
+}
+
+static void slot_key_init(void)
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+// Bounded: one pass over the slots, once per thread
+static int thread_slot(void)
+{
+    if (my_slot != -2)
+        return my_slot;
+
+    pthread_once(&slot_once, slot_key_init);
+    my_slot = -1;
+    for (int i = 0; i < CHT_MAX_THREADS; i++) {
+        uint8_t expected = 0;
+        if (__atomic_compare_exchange_n(&slot_taken[i], &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            uint32_t used = LOAD(&slots_used);
+            while (used < (uint32_t)i + 1 &&
+                   !__atomic_compare_exchange_n(&slots_used, &used, (uint32_t)i + 1, 1,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                ;
+            pthread_setspecific(slot_key, (void*)(intptr_t)(i + 1));
+            my_slot = i;
+            break;
+        }
+    }
+    return my_slot;
+}
+
+// Announce the current epoch before touching any node or bucket array.
+// The fence pairs with the one in try_reclaim: either the reclaimer sees
+// the announcement, or this operation sees nothing it retired.  The
+// release stores order the operation's reads before the reclaimer's free.
+static int enter(CHashTable *ht)
+{
+    int slot = thread_slot();
+    if (slot >= 0)
+        STORE(&ht->readers[slot].epoch, LOAD(&ht->epoch));
+    else
+        __atomic_add_fetch(&ht->shared_readers, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return slot;
+}
+
+static void leave(CHashTable *ht, int slot)
+{
+    if (slot >= 0)
+        STORE(&ht->readers[slot].epoch, 0);
+    else
+        __atomic_sub_fetch(&ht->shared_readers, 1, __ATOMIC_RELEASE);
+}
+
+static void retire_node(CHashTable *ht, CHashNode *n)
+{
+    pthread_mutex_lock(&ht->reclaim_lock);
+    CHashNode **list = &ht->retired_nodes[ht->epoch % 3];
+    n->retired_next = *list;
+    *list = n;
+    __atomic_add_fetch(&ht->retired_since, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ht->unreclaimed, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ht->reclaim_lock);
+}
+
+static void retire_buckets(CHashTable *ht, CHashBuckets *b)
+{
+    pthread_mutex_lock(&ht->reclaim_lock);
+    CHashBuckets **list = &ht->retired_buckets[ht->epoch % 3];
+    b->retired_next = *list;
+    *list = b;
+    __atomic_add_fetch(&ht->retired_since, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ht->unreclaimed, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ht->reclaim_lock);
+}
+
+static void free_retired(CHashTable *ht, int idx)
+{
+    CHashNode *n = ht->retired_nodes[idx];
+    while (n != NULL) {
+        CHashNode *next = n->retired_next;
+        free(n);
+        __atomic_sub_fetch(&ht->unreclaimed, 1, __ATOMIC_RELAXED);
+        n = next;
+    }
+    CHashBuckets *b = ht->retired_buckets[idx];
+    while (b != NULL) {
+        CHashBuckets *next = b->retired_next;
+        free_buckets(b);
+        __atomic_sub_fetch(&ht->unreclaimed, 1, __ATOMIC_RELAXED);
+        b = next;
+    }
+    ht->retired_nodes[idx] = NULL;
+    ht->retired_buckets[idx] = NULL;
+}
+
+// Move the epoch on if every operation in progress has seen the current
+// one, then free what was retired two epochs back: anything that could
+// still reach it started before the last advance and has finished.
+// Called outside any operation; never waits for the lock.
+static void try_reclaim(CHashTable *ht)
+{
+    if (__atomic_load_n(&ht->retired_since, __ATOMIC_RELAXED) < CHT_RECLAIM_BATCH ||
+        pthread_mutex_trylock(&ht->reclaim_lock) != 0)
+        return;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t epoch = ht->epoch;
+    int quiet = LOAD(&ht->shared_readers) == 0;
+    uint32_t used = LOAD(&slots_used);
+    for (uint32_t i = 0; quiet && i < used; i++) {
+        uint64_t seen = LOAD(&ht->readers[i].epoch);
+        quiet = seen == 0 || seen == epoch;
+    }
+
+    if (quiet) {
+        STORE(&ht->epoch, epoch + 1);
+        free_retired(ht, (int)((epoch + 2) % 3));
+        __atomic_store_n(&ht->retired_since, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ht->reclaim_lock);
+}
+
+// Copy old bucket ob into cur.  The caller holds ob's stripe lock.  The
+// old chain is left as it is for readers still walking it, and retired;
+// the copies are built first so that running out of memory leaves ob
+// unmoved.
+static int migrate_bucket(CHashTable *ht, CHashBuckets *cur, CHashBuckets *old, uint32_t ob)
+{
+    if (old->moved[ob])
+        return 0;
+
+    CHashNode *copies = NULL;
+    for (CHashNode *n = old->heads[ob]; n != NULL; n = n->next) {
+        CHashNode *copy = alloc_node(n->hash, n->key, n->val);
+        if (copy == NULL) {
+            while (copies != NULL) {
+                CHashNode *next = copies->next;
+                free(copies);
+                copies = next;
+            }
+            return -1;
+        }
+        copy->next = copies;
+        copies = copy;
+    }
+
+    while (copies != NULL) {
+        CHashNode *copy = copies;
+        copies = copy->next;
+        uint32_t nb = (uint32_t)(copy->hash & (cur->num_buckets - 1));
+        copy->next = cur->heads[nb];
+        STORE(&cur->heads[nb], copy);
+    }
+    STORE(&old->moved[ob], 1);
+    for (CHashNode *n = old->heads[ob]; n != NULL; n = n->next)
+        retire_node(ht, n);
+
+    // The last bucket ends the resize; a new one may start after this
+    if (__atomic_add_fetch(&cur->migrated, 1, __ATOMIC_ACQ_REL) == old->num_buckets) {
+        STORE(&cur->prev, NULL);
+        retire_buckets(ht, old);
+    }
+    return 0;
+}
+
+// Copy a few old buckets ahead of this writer's own.  No lock may be held.
+static void help_migrate(CHashTable *ht)
+{
+    CHashBuckets *cur = LOAD(&ht->buckets);
+    CHashBuckets *old = LOAD(&cur->prev);
+    if (old == NULL)
+        return;
+
+    // cur stays current until every old bucket is moved, so the claimed
+    // buckets are still cur's to fill once their stripe is locked
+    for (int i = 0; i < CHT_MIGRATE_STEP; i++) {
+        uint32_t ob = __atomic_fetch_add(&cur->migrate_cursor, 1, __ATOMIC_RELAXED);
+        if (ob >= old->num_buckets)
+            break;
+        pthread_mutex_t *lock = &ht->stripes[ob & (CHT_STRIPES - 1)];
+        pthread_mutex_lock(lock);
+        migrate_bucket(ht, cur, old, ob);
+        pthread_mutex_unlock(lock);
+    }
+}
+
+// With h's stripe held: the array that owns h's bucket, moving the bucket
+// out of the old array first if a resize is under way
+static CHashBuckets* lock_owner(CHashTable *ht, uint64_t h)
+{
+    CHashBuckets *cur = LOAD(&ht->buckets);
+    CHashBuckets *old = LOAD(&cur->prev);
+    if (old != NULL && migrate_bucket(ht, cur, old, (uint32_t)(h & (old->num_buckets - 1))) != 0)
+        return NULL;
+    return cur;
+}
+
+static void maybe_grow(CHashTable *ht)
+{
+    CHashBuckets *cur = LOAD(&ht->buckets);
+    if (LOAD(&ht->size) <= cur->num_buckets || LOAD(&cur->prev) != NULL)
+        return;
+    if (pthread_mutex_trylock(&ht->resize_lock) != 0)
+        return;                         // someone else is growing it
+
+    cur = LOAD(&ht->buckets);
+    if (LOAD(&ht->size) > cur->num_buckets && LOAD(&cur->prev) == NULL &&
+        cur->num_buckets <= UINT32_MAX / 2) {
+        CHashBuckets *next = alloc_buckets(cur->num_buckets * 2);
+        if (next != NULL) {
+            next->prev = cur;
+            STORE(&ht->buckets, next);
+        }
+    }
+    pthread_mutex_unlock(&ht->resize_lock);
+}
+
+CHashTable* chash_table_create(uint32_t size_hint)
+{
+    CHashTable *ht = (CHashTable*) calloc(1, sizeof(CHashTable));
+    if (ht == NULL)
+        return NULL;
+
+    uint32_t n = CHT_STRIPES;
+    while (n < size_hint && n <= UINT32_MAX / 2)
+        n *= 2;
+
+    ht->seed = hash_seed();
+    ht->epoch = 1;
+    ht->buckets = alloc_buckets(n);
+    if (ht->buckets == NULL) {
+        free(ht);
+        return NULL;
+    }
+    for (int i = 0; i < CHT_STRIPES; i++)
+        pthread_mutex_init(&ht->stripes[i], NULL);
+    pthread_mutex_init(&ht->resize_lock, NULL);
+    pthread_mutex_init(&ht->reclaim_lock, NULL);
+    return ht;
+}
+
+static void free_chain(CHashNode *n)
+{
+    while (n != NULL) {
+        CHashNode *next = n->next;
+        free(n);
+        n = next;
+    }
+}
+
+void chash_table_free(CHashTable *ht)
+{
+    if (ht == NULL)
+        return;
+
+    // Live nodes are in the current array, or in old buckets not yet
+    // moved; everything else has been retired
+    CHashBuckets *cur = ht->buckets;
+    CHashBuckets *old = cur->prev;
+    for (uint32_t i = 0; i < cur->num_buckets; i++)
+        free_chain(cur->heads[i]);
+    if (old != NULL) {
+        for (uint32_t i = 0; i < old->num_buckets; i++) {
+            if (!old->moved[i])
+                free_chain(old->heads[i]);
+        }
+        free_buckets(old);
+    }
+    free_buckets(cur);
+    for (int i = 0; i < 3; i++)
+        free_retired(ht, i);
+
+    for (int i = 0; i < CHT_STRIPES; i++)
+        pthread_mutex_destroy(&ht->stripes[i]);
+    pthread_mutex_destroy(&ht->resize_lock);
+    pthread_mutex_destroy(&ht->reclaim_lock);
+    free(ht);
+}
+
+int chash_table_add(CHashTable *ht, char *key, void *val)
+{
+    uint64_t h = key_hash(ht, key);
+    pthread_mutex_t *lock = stripe_for(ht, h);
+    int ret = -1;
+
+    int slot = enter(ht);
+    help_migrate(ht);
+    pthread_mutex_lock(lock);
+    CHashBuckets *b = lock_owner(ht, h);
+    if (b != NULL) {
+        uint32_t i = (uint32_t)(h & (b->num_buckets - 1));
+        CHashNode *n = b->heads[i];
+        // Do not permit duplicates
+        while (n != NULL && !(n->hash == h && strcmp(n->key, key) == 0))
+            n = n->next;
+        if (n == NULL && (n = alloc_node(h, key, val)) != NULL) {
+            n->next = b->heads[i];
+            STORE(&b->heads[i], n);
+            __atomic_add_fetch(&ht->size, 1, __ATOMIC_RELEASE);
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    if (ret == 0)
+        maybe_grow(ht);
+    leave(ht, slot);
+    try_reclaim(ht);
+    return ret;
+}
+
+void* chash_table_find(const CHashTable *ht, const char *key)
+{
+    uint64_t h = key_hash(ht, key);
+    void *val = NULL;
+
+    // Only the thread's epoch slot is written
+    CHashTable *mut = (CHashTable*)ht;
+    int slot = enter(mut);
+    CHashBuckets *b = LOAD(&ht->buckets);
+    CHashBuckets *old = LOAD(&b->prev);
+
+    // An old bucket not yet moved is still the authoritative one
+    if (old != NULL && !LOAD(&old->moved[h & (old->num_buckets - 1)]))
+        b = old;
+
+    for (CHashNode *n = LOAD(&b->heads[h & (b->num_buckets - 1)]); n != NULL; n = LOAD(&n->next)) {
+        if (n->hash == h && strcmp(n->key, key) == 0) {
+            val = n->val;
+            break;
+        }
+    }
+    leave(mut, slot);
+    return val;
+}
+
+int chash_table_del(CHashTable *ht, const char *key)
+{
+    uint64_t h = key_hash(ht, key);
+    pthread_mutex_t *lock = stripe_for(ht, h);
+    int ret = -1;
+
+    int slot = enter(ht);
+    help_migrate(ht);
+    pthread_mutex_lock(lock);
+    CHashBuckets *b = lock_owner(ht, h);
+    if (b != NULL) {
+        CHashNode **link = &b->heads[h & (b->num_buckets - 1)];
+        for (CHashNode *n = *link; n != NULL; link = &n->next, n = n->next) {
+            if (n->hash == h && strcmp(n->key, key) == 0) {
+                // n keeps its next pointer, so a reader standing on it
+                // walks on; it is freed once no reader can be
+                STORE(link, n->next);
+                __atomic_sub_fetch(&ht->size, 1, __ATOMIC_RELEASE);
+                retire_node(ht, n);
+                ret = 0;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(lock);
+    leave(ht, slot);
+    try_reclaim(ht);
+    return ret;
+}
+
+uint32_t chash_table_size(const CHashTable *ht)
+{
+    return LOAD(&ht->size);
+}
+
+uint64_t chash_table_unreclaimed(const CHashTable *ht)
+{
+    return __atomic_load_n(&ht->unreclaimed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,101 @@
+/*
+ * Concurrent hash table: char* key -> void* data, shared by threads.
+ * Like hash_table.h it does not permit duplicate keys and does not copy
+ * keys.  See chash_table_example.c for a stress test.
+ *
+ * Buckets are chains.  Writers lock one of CHT_STRIPES mutexes, picked
+ * by the low bits of the key's hash, so writers to different stripes
+ * run in parallel.  Readers take no locks and never retry: a lookup is
+ * a bounded walk of one chain (two during a resize), so it is wait-free.
+ *
+ * The table doubles online.  The new bucket array is published at once
+ * and old buckets are copied over a few at a time by whichever writers
+ * come along; until a bucket has been copied, readers and writers still
+ * use the old one.  Old chains are never changed after they are copied,
+ * so a reader holding an old array sees a consistent snapshot.
+ *
+ * Nodes unlinked by deletes or left behind by a resize, and old bucket
+ * arrays, are retired rather than freed, and freed once no operation can
+ * still see them (epoch-based reclamation).  Every operation announces
+ * the table's epoch in its thread's slot on entry, a store and a fence,
+ * so lookups stay wait-free, and clears it on exit.  Every
+ * CHT_RECLAIM_BATCH retirements a writer tries to advance the epoch,
+ * which succeeds once no operation still runs in an older one; whatever
+ * was retired two epochs back is then freed.  Memory under insert/delete
+ * churn stays bounded as long as operations keep finishing.  Threads
+ * beyond CHT_MAX_THREADS share one counter instead of a slot, and hold
+ * off reclamation while any of them is inside an operation.
+ */
+
+#ifndef __CHASH_TABLE_H__
+#define __CHASH_TABLE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define CHT_STRIPES 64          // writer locks; the bucket count is a multiple
+#define CHT_MIGRATE_STEP 8      // old buckets each writer copies during a resize
+#define CHT_MAX_THREADS 128     // threads with their own epoch slot
+#define CHT_RECLAIM_BATCH 64    // retirements between attempts to free them
+
+typedef struct _CHashNode
+{
+    uint64_t hash;
+    char *key;
+    void *val;
+    struct _CHashNode *next;            // chain; kept as is once retired
+    struct _CHashNode *retired_next;    // retired list, waiting to be freed
+} CHashNode;
+
+typedef struct _CHashBuckets
+{
+    uint32_t num_buckets;               // power of two, >= CHT_STRIPES
+    CHashNode **heads;
+    uint8_t *moved;                     // 1 once copied into the next array
+    struct _CHashBuckets *prev;         // array being copied from, NULL when done
+    struct _CHashBuckets *retired_next; // retired list, waiting to be freed
+    uint32_t migrate_cursor;            // next bucket of prev to hand out
+    uint32_t migrated;                  // buckets of prev copied so far
+} CHashBuckets;
+
+// A thread's announced epoch, 0 outside operations; one per cache line
+typedef struct _CHashReader
+{
+    uint64_t epoch;
+} __attribute__((aligned(64))) CHashReader;
+
+typedef struct _CHashTable
+{
+    CHashBuckets *buckets;              // current array
+    pthread_mutex_t stripes[CHT_STRIPES];
+    pthread_mutex_t resize_lock;
+    uint32_t size;
+    uint64_t seed;
+
+    // Reclamation; the retired lists are indexed by epoch % 3 and guarded
+    // by reclaim_lock, which is also the only place the epoch moves
+    uint64_t epoch;
+    CHashReader readers[CHT_MAX_THREADS];
+    uint32_t shared_readers;            // slotless threads inside an operation
+    pthread_mutex_t reclaim_lock;
+    CHashNode *retired_nodes[3];
+    CHashBuckets *retired_buckets[3];
+    uint32_t retired_since;             // retirements since the epoch last moved
+    uint64_t unreclaimed;               // retired, not yet freed
+} CHashTable;
+
+// size_hint: expected number of entries
+CHashTable* chash_table_create(uint32_t size_hint);
+// No other thread may be using the table
+void chash_table_free(CHashTable *ht);
+// Returns 0, or -1 if key is already present (or out of memory)
+int chash_table_add(CHashTable *ht, char *key, void *val);
+// Wait-free
+void* chash_table_find(const CHashTable *ht, const char *key);
+// Returns 0, or -1 if key is not present
+int chash_table_del(CHashTable *ht, const char *key);
+uint32_t chash_table_size(const CHashTable *ht);
+// Nodes and bucket arrays retired but not freed yet
+uint64_t chash_table_unreclaimed(const CHashTable *ht);
+
+#endif
@@ -0,0 +1,133 @@
+// Scalability of chash_table lookups from 1 to N threads
+// Usage: chash-table-bench [-t max_threads] [-n keys] [-w write_pct] [-d duration_ms]
+//
+// Every thread looks up random keys from a shared table for the duration;
+// with -w, that percentage of operations delete a key and add it back.
+// The baseline is the single-threaded hash_table behind one mutex, which
+// is what sharing it across threads would take otherwise.  One JSON line
+// per implementation and thread count.  Scaling needs as many free cores
+// as threads.
+
+#include "chash_table.h"
+#include "hash_table.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef enum { IMPL_MUTEX, IMPL_CHASH } impl_t;
+static const char *impl_names[] = { "mutex", "chash" };
+
+static impl_t impl;
+static HashTable *locked_ht;
+static pthread_mutex_t locked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CHashTable *cht;
+static char (*keys)[16];
+static uint32_t nkeys = 100000;
+static int write_pct = 0;
+static int stop;
+
+static void* worker(void *arg)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL * ((uintptr_t)arg + 1), ops = 0;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        for (int k = 0; k < 256; k++) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            char *key = keys[x % nkeys];
+            int write = (int)((x >> 40) % 100) < write_pct;
+            if (impl == IMPL_MUTEX) {
+                pthread_mutex_lock(&locked_mutex);
+                if (write) {
+                    hash_table_del(locked_ht, key);
+                    hash_table_add(locked_ht, key, key);
+                } else {
+                    bench_consume(hash_table_find(locked_ht, key));
+                }
+                pthread_mutex_unlock(&locked_mutex);
+            } else if (write) {
+                chash_table_del(cht, key);
+                chash_table_add(cht, key, key);
+            } else {
+                bench_consume(chash_table_find(cht, key));
+            }
+        }
+        ops += 256;
+    }
+    return (void*)(uintptr_t)ops;
+}
+
+static void run(impl_t which, int nthreads, uint64_t duration_ns)
+{
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    uint64_t ops = 0;
+
+    impl = which;
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    uint64_t start = bench_now_ns();
+    for (uintptr_t t = 0; t < (uintptr_t)nthreads; t++)
+        pthread_create(&threads[t], NULL, worker, (void*)t);
+    while (bench_now_ns() - start < duration_ns)
+        usleep(1000);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < nthreads; t++) {
+        void *ret;
+        pthread_join(threads[t], &ret);
+        ops += (uintptr_t)ret;
+    }
+    double secs = (bench_now_ns() - start) / 1e9;
+    free(threads);
+
+    printf("{\"bench\":\"chash_table\",\"impl\":\"%s\",\"threads\":%d,\"keys\":%u,"
+           "\"write_pct\":%d,\"mops_per_sec\":%.2f,\"mops_per_thread\":%.2f}\n",
+           impl_names[which], nthreads, nkeys, write_pct,
+           ops / secs / 1e6, ops / secs / 1e6 / nthreads);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = ncpu > 1 ? (int)ncpu : 4;
+    uint64_t duration_ms = 300;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:w:d:")) != -1) {
+        switch (c) {
+            case 't': max_threads = atoi(optarg); break;
+            case 'n': nkeys = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'w': write_pct = atoi(optarg); break;
+            case 'd': duration_ms = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: chash-table-bench [-t max_threads] [-n keys] "
+                        "[-w write_pct] [-d duration_ms]\n");
+                return 1;
+        }
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+    if (nkeys < 1)
+        nkeys = 1;
+
+    keys = malloc(sizeof(*keys) * nkeys);
+    locked_ht = hash_table_create(nkeys);
+    cht = chash_table_create(nkeys);
+    for (uint32_t i = 0; i < nkeys; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "user%u", i);
+        hash_table_add(locked_ht, keys[i], keys[i]);
+        chash_table_add(cht, keys[i], keys[i]);
+    }
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        run(IMPL_MUTEX, t, duration_ms * 1000000ULL);
+        run(IMPL_CHASH, t, duration_ms * 1000000ULL);
+        if (t < max_threads && t * 2 > max_threads)
+            t = max_threads / 2;        // always finish on max_threads
+    }
+
+    hash_table_free(locked_ht);
+    chash_table_free(cht);
+    free(keys);
+    return 0;
+}
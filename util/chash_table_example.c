@@ -0,0 +1,211 @@
+// Multi-threaded stress test for chash_table.  Writers insert, delete and
+// re-insert their own keys while readers look up keys that must always
+// be there; the table starts tiny so it resizes many times under load.
+// A churn phase then deletes and re-adds keys for a while and checks that
+// retired nodes are freed as it goes rather than piling up.
+// Each check prints OK or FAIL; the exit status is 1 if any failed.
+// Usage: chash-table-test [-t threads] [-n keys_per_writer]
+
+#include "chash_table.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define STABLE_KEYS 1000
+#define CHURN_ROUNDS 10
+
+static CHashTable *ht;
+static int nthreads = 4;
+static int nkeys = 50000;
+static char (*stable)[16];
+static char (*owned)[16];               // nthreads * nkeys, a block per writer
+static int writers_done;
+static int failures;
+
+static void check(const char *what, int ok)
+{
+    printf("%-44s %s\n", what, ok ? "OK" : "FAIL");
+    failures += !ok;
+}
+
+static void* writer(void *arg)
+{
+    char (*mine)[16] = owned + (size_t)(intptr_t)arg * nkeys;
+    long bad = 0;
+
+    for (int i = 0; i < nkeys; i++)
+        bad += chash_table_add(ht, mine[i], mine[i]) != 0;
+    for (int i = 0; i < nkeys; i += 2)
+        bad += chash_table_del(ht, mine[i]) != 0;
+    for (int i = 0; i < nkeys; i += 4)
+        bad += chash_table_add(ht, mine[i], mine[i]) != 0;
+    // Already present: must be refused
+    for (int i = 1; i < nkeys; i += 2)
+        bad += chash_table_add(ht, mine[i], "dup") == 0;
+    return (void*)bad;
+}
+
+static void* reader(void *arg)
+{
+    long bad = 0;
+    unsigned x = (unsigned)(intptr_t)arg * 2654435761u + 1;
+
+    while (!__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE)) {
+        for (int k = 0; k < 256; k++) {
+            x = x * 1103515245 + 12345;
+            int i = (x >> 8) % STABLE_KEYS;
+            bad += chash_table_find(ht, stable[i]) != stable[i];
+
+            // A writer's key is either absent or maps to itself
+            size_t j = (x >> 4) % ((size_t)nthreads * nkeys);
+            void *v = chash_table_find(ht, owned[j]);
+            bad += v != NULL && v != owned[j];
+        }
+    }
+    return (void*)bad;
+}
+
+// Delete and re-add a writer's odd keys, which are present, over and over
+static void* churner(void *arg)
+{
+    char (*mine)[16] = owned + (size_t)(intptr_t)arg * nkeys;
+    long bad = 0;
+
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 1; i < nkeys; i += 2) {
+            bad += chash_table_del(ht, mine[i]) != 0;
+            bad += chash_table_add(ht, mine[i], mine[i]) != 0;
+        }
+    }
+    return (void*)bad;
+}
+
+// Every thread adds the same keys at once; each must be added exactly once
+static char race_keys[10000][16];
+
+static void* racer(void *arg)
+{
+    long wins = 0;
+    for (int i = 0; i < 10000; i++)
+        wins += chash_table_add(ht, race_keys[i], arg) == 0;
+    return (void*)wins;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:")) != -1) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'n': nkeys = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: chash-table-test [-t threads] [-n keys_per_writer]\n");
+                return 1;
+        }
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nkeys < 4)
+        nkeys = 4;
+
+    stable = malloc(sizeof(*stable) * STABLE_KEYS);
+    owned = malloc(sizeof(*owned) * (size_t)nthreads * nkeys);
+    for (int i = 0; i < STABLE_KEYS; i++)
+        snprintf(stable[i], sizeof(stable[i]), "stable%d", i);
+    for (size_t i = 0; i < (size_t)nthreads * nkeys; i++)
+        snprintf(owned[i], sizeof(owned[i]), "w%u", (unsigned)i);
+
+    ht = chash_table_create(1);
+    for (int i = 0; i < STABLE_KEYS; i++)
+        chash_table_add(ht, stable[i], stable[i]);
+    uint32_t buckets_before = ht->buckets->num_buckets;
+
+    pthread_t *w = malloc(sizeof(pthread_t) * nthreads);
+    pthread_t *r = malloc(sizeof(pthread_t) * nthreads);
+    for (intptr_t t = 0; t < nthreads; t++) {
+        pthread_create(&w[t], NULL, writer, (void*)t);
+        pthread_create(&r[t], NULL, reader, (void*)t);
+    }
+    long wbad = 0, rbad = 0;
+    for (int t = 0; t < nthreads; t++) {
+        void *ret;
+        pthread_join(w[t], &ret);
+        wbad += (long)ret;
+    }
+    __atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < nthreads; t++) {
+        void *ret;
+        pthread_join(r[t], &ret);
+        rbad += (long)ret;
+    }
+
+    char what[64];
+    snprintf(what, sizeof(what), "writers (%d x %d keys)", nthreads, nkeys);
+    check(what, wbad == 0);
+    check("readers saw only correct values", rbad == 0);
+    check("table grew online", ht->buckets->num_buckets > buckets_before);
+
+    int found = 0;
+    for (int i = 0; i < STABLE_KEYS; i++)
+        found += chash_table_find(ht, stable[i]) == stable[i];
+    for (size_t i = 0; i < (size_t)nthreads * nkeys; i++) {
+        int want = (i % nkeys) % 2 == 1 || (i % nkeys) % 4 == 0;
+        found += chash_table_find(ht, owned[i]) == (want ? owned[i] : NULL);
+    }
+    uint32_t expect = STABLE_KEYS + nthreads * (nkeys / 2 + (nkeys + 3) / 4);
+    check("final contents", found == STABLE_KEYS + nthreads * nkeys);
+    check("final size", chash_table_size(ht) == expect);
+
+    for (int i = 0; i < 10000; i++)
+        snprintf(race_keys[i], sizeof(race_keys[i]), "race%d", i);
+    long wins = 0;
+    for (intptr_t t = 0; t < nthreads; t++)
+        pthread_create(&w[t], NULL, racer, (void*)t);
+    for (int t = 0; t < nthreads; t++) {
+        void *ret;
+        pthread_join(w[t], &ret);
+        wins += (long)ret;
+    }
+    check("concurrent adds of one key set", wins == 10000 &&
+          chash_table_size(ht) == expect + 10000);
+
+    __atomic_store_n(&writers_done, 0, __ATOMIC_RELEASE);
+    for (intptr_t t = 0; t < nthreads; t++) {
+        pthread_create(&w[t], NULL, churner, (void*)t);
+        pthread_create(&r[t], NULL, reader, (void*)t);
+    }
+    wbad = rbad = 0;
+    for (int t = 0; t < nthreads; t++) {
+        void *ret;
+        pthread_join(w[t], &ret);
+        wbad += (long)ret;
+    }
+    __atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < nthreads; t++) {
+        void *ret;
+        pthread_join(r[t], &ret);
+        rbad += (long)ret;
+    }
+    uint64_t churned = (uint64_t)nthreads * CHURN_ROUNDS * (nkeys / 2);
+    uint64_t left = chash_table_unreclaimed(ht);
+    snprintf(what, sizeof(what), "churn (%llu deletes, %llu unfreed)",
+             (unsigned long long)churned, (unsigned long long)left);
+    check(what, wbad == 0 && rbad == 0 && chash_table_size(ht) == expect + 10000 &&
+          left < churned / 2);
+
+    // With no one else inside the table every batch is freed promptly
+    for (int i = 0; i < 4 * CHT_RECLAIM_BATCH; i++) {
+        chash_table_del(ht, stable[0]);
+        chash_table_add(ht, stable[0], stable[0]);
+    }
+    check("retired nodes freed when quiet", chash_table_unreclaimed(ht) <= 2 * CHT_RECLAIM_BATCH);
+
+    chash_table_free(ht);
+    free(w);
+    free(r);
+    free(stable);
+    free(owned);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -6,6 +6,51 @@
 #include <openssl/rand.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+// Per-thread pool of random bytes for IVs.  Refilling it in bulk means
+// one RAND_bytes call (and one trip through its lock) per
+// RAND_POOL_SIZE / IV_SIZE messages instead of one per message.
+#define RAND_POOL_SIZE 4096
+
+static __thread unsigned char rand_pool[RAND_POOL_SIZE];
+static __thread size_t rand_pool_pos = RAND_POOL_SIZE;
+static pthread_once_t rand_pool_once = PTHREAD_ONCE_INIT;
+
+// A forked child inherits the pool of the thread that forked (the only
+// thread it has); drop it so the child never hands out the parent's bytes
+static void rand_pool_atfork_child(void)
+{
+    OPENSSL_cleanse(rand_pool, sizeof(rand_pool));
+    rand_pool_pos = RAND_POOL_SIZE;
+}
+
+static void rand_pool_register(void)
+{
+    pthread_atfork(NULL, NULL, rand_pool_atfork_child);
+}
+
+static int rand_pool_take(unsigned char *out, size_t len)
+{
+    if (len > RAND_POOL_SIZE) {
+        return generate_random_bytes(out, len);
+    }
+
+    if (RAND_POOL_SIZE - rand_pool_pos < len) {
+        pthread_once(&rand_pool_once, rand_pool_register);
+        if (RAND_bytes(rand_pool, RAND_POOL_SIZE) != 1) {
+            return -1;
+        }
+        rand_pool_pos = 0;
+    }
+
+    memcpy(out, rand_pool + rand_pool_pos, len);
+    OPENSSL_cleanse(rand_pool + rand_pool_pos, len);
+    rand_pool_pos += len;
+    return 0;
+}
 
 int aes_encrypt(const unsigned char *key,
                 const unsigned char *plaintext, size_t plaintext_len,
@@ -16,7 +61,7 @@ int aes_encrypt(const unsigned char *key,
     int len = 0;
     int ciphertext_len_int = 0;
 
-    if (RAND_bytes(iv, IV_SIZE) != 1) {
+    if (rand_pool_take(iv, IV_SIZE) != 0) {
         return -1;
     }
 
@@ -139,3 +184,183 @@ int compute_auth_token(const unsigned char *card_secret,
 
     return 0;
 }
+
+int seal_message_with_header(const unsigned char *key,
+                             const unsigned char *header, size_t header_len,
+                             const unsigned char *plaintext, size_t plaintext_len,
+                             unsigned char *packet, size_t *packet_len)
+{
+    size_t ciphertext_len = 0;
+
+    if (header_len > 0) {
+        memcpy(packet, header, header_len);
+    }
+
+    // IV and ciphertext go straight to their final offsets
+    unsigned char *iv = packet + header_len;
+    if (aes_encrypt(key, plaintext, plaintext_len,
+                    iv + IV_SIZE, &ciphertext_len, iv) != 0) {
+        return -1;
+    }
+
+    // The MAC covers the header too
+    size_t data_len = header_len + IV_SIZE + ciphertext_len;
+    if (hmac_sha256(key, packet, data_len, packet + data_len) != 0) {
+        return -1;
+    }
+
+    *packet_len = data_len + HMAC_SIZE;
+    return 0;
+}
+
+int seal_message(const unsigned char *key,
+                 const unsigned char *plaintext, size_t plaintext_len,
+                 unsigned char *packet, size_t *packet_len)
+{
+    return seal_message_with_header(key, NULL, 0, plaintext, plaintext_len,
+                                    packet, packet_len);
+}
+
+int open_message_with_header(const unsigned char *key, size_t header_len,
+                             const unsigned char *packet, size_t packet_len,
+                             unsigned char *plaintext, size_t max_plaintext_len)
+{
+    if (packet_len < header_len + IV_SIZE + HMAC_SIZE) {
+        return -1;
+    }
+
+    size_t data_len = packet_len - HMAC_SIZE;
+    if (hmac_verify(key, packet, data_len, packet + data_len) != 0) {
+        return -1;
+    }
+
+    // CBC never produces more plaintext than ciphertext
+    const unsigned char *iv = packet + header_len;
+    size_t ciphertext_len = data_len - header_len - IV_SIZE;
+    if (ciphertext_len > max_plaintext_len) {
+        return -1;
+    }
+
+    size_t plaintext_len = 0;
+    if (aes_decrypt(key, iv + IV_SIZE, ciphertext_len, iv,
+                    plaintext, &plaintext_len) != 0) {
+        return -1;
+    }
+
+    return (int)plaintext_len;
+}
+
+int open_message(const unsigned char *key,
+                 const unsigned char *packet, size_t packet_len,
+                 unsigned char *plaintext, size_t max_plaintext_len)
+{
+    return open_message_with_header(key, 0, packet, packet_len,
+                                    plaintext, max_plaintext_len);
+}
+
+int nonce_ctx_init(nonce_ctx_t *ctx, uint32_t sender_id)
+{
+    ctx->sender_id = sender_id;
+    ctx->used = 0;
+    return RAND_bytes((unsigned char*)&ctx->base, sizeof(ctx->base)) == 1 ? 0 : -1;
+}
+
+int nonce_next(nonce_ctx_t *ctx, unsigned char *nonce)
+{
+    // The counter may wrap past 2^64; it only repeats once every value
+    // has been used
+    if (ctx->used == UINT64_MAX) {
+        return -1;  // counter exhausted; rekey
+    }
+    uint64_t next = ctx->base + ctx->used++;
+
+    uint32_t id = htonl(ctx->sender_id);
+    uint32_t hi = htonl((uint32_t)(next >> 32));
+    uint32_t lo = htonl((uint32_t)(next & 0xFFFFFFFF));
+    memcpy(nonce, &id, 4);
+    memcpy(nonce + 4, &hi, 4);
+    memcpy(nonce + 8, &lo, 4);
+    return 0;
+}
+
+int aead_encrypt(const unsigned char *key, const unsigned char *nonce,
+                 const unsigned char *aad, size_t aad_len,
+                 const unsigned char *plaintext, size_t plaintext_len,
+                 unsigned char *ciphertext, unsigned char *tag)
+{
+    EVP_CIPHER_CTX *ctx = NULL;
+    int len = 0;
+
+    if (!(ctx = EVP_CIPHER_CTX_new())) {
+        return -1;
+    }
+
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NONCE_SIZE, NULL) != 1 ||
+        EVP_EncryptInit_ex(ctx, NULL, NULL, key, nonce) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    if (aad_len > 0 &&
+        EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_len) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_SIZE, tag) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return 0;
+}
+
+int aead_decrypt(const unsigned char *key, const unsigned char *nonce,
+                 const unsigned char *aad, size_t aad_len,
+                 const unsigned char *ciphertext, size_t ciphertext_len,
+                 const unsigned char *tag, unsigned char *plaintext)
+{
+    EVP_CIPHER_CTX *ctx = NULL;
+    int len = 0;
+
+    if (!(ctx = EVP_CIPHER_CTX_new())) {
+        return -1;
+    }
+
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NONCE_SIZE, NULL) != 1 ||
+        EVP_DecryptInit_ex(ctx, NULL, NULL, key, nonce) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    if (aad_len > 0 &&
+        EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    // The tag must be set before the final call checks it
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_SIZE,
+                            (void *)tag) != 1 ||
+        EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return 0;
+}
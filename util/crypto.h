@@ -4,13 +4,29 @@
 #define __CRYPTO_H__
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define KEY_SIZE 32        // 256 bits for AES-256
 #define IV_SIZE 16         // 128 bits for AES block size
 #define HMAC_SIZE 32       // 256 bits for SHA-256
 #define CARD_SECRET_SIZE 32 // 256 bits for card secret
+#define NONCE_SIZE 12      // 96-bit AES-GCM nonce: sender ID || counter
+#define AEAD_TAG_SIZE 16   // 128-bit AES-GCM tag
 
-// Encrypt with AES-256-CBC (generates random IV)
+// Nonce state for one sender under one key.  Each nonce is
+// sender_id (32 bits) || counter (64 bits).  Within a context the counter
+// never repeats; each context (so each process run) starts it at a fresh
+// random 64-bit value rather than anything clock- or disk-derived, so two
+// runs of the same sender collide only if their counter ranges overlap:
+// about (n1 + n2) / 2^64 for runs that send n1 and n2 messages.  Give
+// every sender sharing a key its own sender_id.
+typedef struct {
+    uint32_t sender_id;
+    uint64_t base;          // random starting counter
+    uint64_t used;          // nonces handed out so far
+} nonce_ctx_t;
+
+// Encrypt with AES-256-CBC (IV drawn from a per-thread random pool)
 int aes_encrypt(const unsigned char *key,
                 const unsigned char *plaintext, size_t plaintext_len,
                 unsigned char *ciphertext, size_t *ciphertext_len,
@@ -40,4 +56,44 @@ int compute_auth_token(const unsigned char *card_secret,
                        const char *pin,
                        unsigned char *auth_token);
 
+// Seal a message in place: packet = IV || ciphertext || HMAC(IV || ciphertext).
+// packet needs room for IV_SIZE + plaintext_len + 16 + HMAC_SIZE bytes.
+int seal_message(const unsigned char *key,
+                 const unsigned char *plaintext, size_t plaintext_len,
+                 unsigned char *packet, size_t *packet_len);
+
+// Verify and decrypt a sealed packet; returns plaintext length or -1
+int open_message(const unsigned char *key,
+                 const unsigned char *packet, size_t packet_len,
+                 unsigned char *plaintext, size_t max_plaintext_len);
+
+// Same, with a cleartext header in front that the HMAC also covers:
+// packet = header || IV || ciphertext || HMAC(header || IV || ciphertext)
+int seal_message_with_header(const unsigned char *key,
+                             const unsigned char *header, size_t header_len,
+                             const unsigned char *plaintext, size_t plaintext_len,
+                             unsigned char *packet, size_t *packet_len);
+
+int open_message_with_header(const unsigned char *key, size_t header_len,
+                             const unsigned char *packet, size_t packet_len,
+                             unsigned char *plaintext, size_t max_plaintext_len);
+
+// Initialize nonce state for sender_id; -1 if no randomness is available
+int nonce_ctx_init(nonce_ctx_t *ctx, uint32_t sender_id);
+
+// Write the next unique nonce (NONCE_SIZE bytes)
+int nonce_next(nonce_ctx_t *ctx, unsigned char *nonce);
+
+// Encrypt with AES-256-GCM; ciphertext is plaintext_len bytes
+int aead_encrypt(const unsigned char *key, const unsigned char *nonce,
+                 const unsigned char *aad, size_t aad_len,
+                 const unsigned char *plaintext, size_t plaintext_len,
+                 unsigned char *ciphertext, unsigned char *tag);
+
+// Decrypt and authenticate AES-256-GCM; fails if the tag does not match
+int aead_decrypt(const unsigned char *key, const unsigned char *nonce,
+                 const unsigned char *aad, size_t aad_len,
+                 const unsigned char *ciphertext, size_t ciphertext_len,
+                 const unsigned char *tag, unsigned char *plaintext);
+
 #endif
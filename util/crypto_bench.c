@@ -0,0 +1,217 @@
+// Microbenchmark for util/crypto.c
+// Usage: crypto-bench [-t threads] [-d duration_ms]
+//
+// Every operation runs once single-threaded and once with the given
+// number of threads (default: online CPUs).  Each result is one JSON
+// line; ops_per_sec is aggregate throughput and ns_per_op is the mean
+// time per operation as seen by one thread.
+
+#include "crypto.h"
+#include "protocol.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef enum {
+    OP_AES_ENCRYPT,
+    OP_AES_DECRYPT,
+    OP_HMAC_SHA256,
+    OP_HMAC_VERIFY,
+    OP_AUTH_TOKEN,
+    OP_AEAD_ENCRYPT,
+    OP_AEAD_DECRYPT,
+} bench_op_t;
+
+static const char *op_names[] = {
+    "aes_encrypt", "aes_decrypt", "hmac_sha256", "hmac_verify",
+    "compute_auth_token", "aead_encrypt", "aead_decrypt",
+};
+
+typedef struct {
+    bench_op_t op;
+    size_t size;
+    uint64_t duration_ns;
+    pthread_barrier_t *start;
+    uint64_t ops;
+    uint64_t elapsed_ns;
+    int failed;
+} bench_thread_t;
+
+static const unsigned char bench_key[KEY_SIZE] = {
+    0x42, 0x13, 0x37, 0x99, 0x01, 0x02, 0x03, 0x04,
+};
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t*)arg;
+    unsigned char plaintext[MAX_PLAINTEXT_SIZE];
+    unsigned char ciphertext[MAX_PLAINTEXT_SIZE + 16];
+    unsigned char out[MAX_PLAINTEXT_SIZE + 16];
+    unsigned char iv[IV_SIZE];
+    unsigned char mac[HMAC_SIZE];
+    unsigned char nonce[NONCE_SIZE];
+    unsigned char tag[AEAD_TAG_SIZE];
+    size_t ciphertext_len = 0, out_len = 0;
+    nonce_ctx_t nonces;
+
+    memset(plaintext, 'x', sizeof(plaintext));
+    // Inputs for the verify/decrypt side
+    if (nonce_ctx_init(&nonces, (uint32_t)(uintptr_t)t) != 0 ||
+        aes_encrypt(bench_key, plaintext, t->size, ciphertext, &ciphertext_len, iv) != 0 ||
+        hmac_sha256(bench_key, plaintext, t->size, mac) != 0 ||
+        nonce_next(&nonces, nonce) != 0 ||
+        aead_encrypt(bench_key, nonce, NULL, 0, plaintext, t->size, out, tag) != 0) {
+        t->failed = 1;
+    }
+
+    pthread_barrier_wait(t->start);
+
+    uint64_t start = bench_now_ns();
+    uint64_t now = start;
+    uint64_t ops = 0;
+    int rc = 0;
+
+    while (rc == 0 && now - start < t->duration_ns) {
+        for (int i = 0; i < 64 && rc == 0; i++) {
+            switch (t->op) {
+                case OP_AES_ENCRYPT:
+                    rc = aes_encrypt(bench_key, plaintext, t->size,
+                                     ciphertext, &ciphertext_len, iv);
+                    break;
+                case OP_AES_DECRYPT:
+                    rc = aes_decrypt(bench_key, ciphertext, ciphertext_len, iv,
+                                     out, &out_len);
+                    break;
+                case OP_HMAC_SHA256:
+                    rc = hmac_sha256(bench_key, plaintext, t->size, mac);
+                    break;
+                case OP_HMAC_VERIFY:
+                    rc = hmac_verify(bench_key, plaintext, t->size, mac);
+                    break;
+                case OP_AUTH_TOKEN:
+                    rc = compute_auth_token(bench_key, "1234", mac);
+                    break;
+                case OP_AEAD_ENCRYPT:
+                    rc = nonce_next(&nonces, nonce);
+                    if (rc == 0)
+                        rc = aead_encrypt(bench_key, nonce, NULL, 0, plaintext,
+                                          t->size, ciphertext, tag);
+                    break;
+                case OP_AEAD_DECRYPT:
+                    rc = aead_decrypt(bench_key, nonce, NULL, 0, out, t->size,
+                                      tag, ciphertext);
+                    break;
+            }
+            ops++;
+        }
+        now = bench_now_ns();
+    }
+
+    bench_consume(ciphertext);
+    bench_consume(mac);
+    if (rc != 0)
+        t->failed = 1;
+    t->ops = ops;
+    t->elapsed_ns = now - start;
+    return NULL;
+}
+
+static int run_bench(bench_op_t op, size_t size, int nthreads, uint64_t duration_ns)
+{
+    pthread_t tids[nthreads];
+    bench_thread_t threads[nthreads];
+    pthread_barrier_t start;
+
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        memset(&threads[i], 0, sizeof(threads[i]));
+        threads[i].op = op;
+        threads[i].size = size;
+        threads[i].duration_ns = duration_ns;
+        threads[i].start = &start;
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+
+    uint64_t ops = 0, thread_ns = 0, wall_ns = 0;
+    int failed = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += threads[i].ops;
+        thread_ns += threads[i].elapsed_ns;
+        if (threads[i].elapsed_ns > wall_ns)
+            wall_ns = threads[i].elapsed_ns;
+        failed |= threads[i].failed;
+    }
+    pthread_barrier_destroy(&start);
+
+    if (failed) {
+        fprintf(stderr, "crypto-bench: %s failed at size %zu\n", op_names[op], size);
+        return -1;
+    }
+
+    printf("{\"bench\":\"crypto\",\"op\":\"%s\",\"size\":%zu,\"threads\":%d,"
+           "\"ops\":%llu,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+           op_names[op], size, nthreads, (unsigned long long)ops,
+           ops * 1e9 / wall_ns, (double)thread_ns / ops);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t duration_ms = 200;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:d:")) != -1) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'd': duration_ms = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: crypto-bench [-t threads] [-d duration_ms]\n");
+                return 1;
+        }
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+
+    // Every plaintext size the protocol produces, plus the limit
+    const size_t sizes[] = {
+        sizeof(cmsg_balance_req_t),
+        sizeof(cmsg_login_resp_t),
+        sizeof(cmsg_balance_resp_t),
+        sizeof(cmsg_withdraw_req_t),
+        sizeof(cmsg_withdraw_resp_t),
+        sizeof(cmsg_login_req_t) + 8,     // compact login, 8-letter name
+        sizeof(msg_balance_req_t),
+        sizeof(msg_login_resp_t),
+        sizeof(msg_balance_resp_t),
+        sizeof(msg_withdraw_req_t),
+        sizeof(msg_withdraw_resp_t),
+        sizeof(msg_login_req_t),
+        MAX_PLAINTEXT_SIZE,
+    };
+    const int thread_counts[] = { 1, nthreads };
+    int rc = 0;
+
+    for (int t = 0; t < 2; t++) {
+        if (t == 1 && nthreads == 1)
+            break;
+        for (int op = OP_AES_ENCRYPT; op <= OP_AEAD_DECRYPT; op++) {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                if (s > 0 && sizes[s] <= sizes[s - 1])
+                    continue;  // sizes are ascending; skip repeats
+                size_t size = (op == OP_AUTH_TOKEN) ? CARD_SECRET_SIZE + PIN_SIZE : sizes[s];
+                if (run_bench(op, size, thread_counts[t], duration_ms * 1000000ULL) != 0)
+                    rc = 1;
+                if (op == OP_AUTH_TOKEN)
+                    break;
+            }
+        }
+    }
+
+    return rc;
+}
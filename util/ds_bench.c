@@ -0,0 +1,272 @@
+// Benchmark suite for the util/ data structures, run by `make bench`
+// Usage: ds-bench [-s list|hash_table] [-n size] [-w warmup] [-r reps]
+//
+// Times insert, find (hit and miss), iteration and delete on List and
+// HashTable for several sizes and key shapes:
+//   seq    "user<N>", as loadgen and the test scripts create
+//   random 4-12 random lowercase letters, like typed usernames
+//   long   a 120-byte shared prefix and a counter, the worst case for
+//          key comparisons
+// Finds and deletes visit the keys in shuffled order.  Every pass builds
+// a fresh structure; the first `warmup` passes are not recorded.  One
+// JSON line per structure, key shape, size and operation, with the min,
+// median and max over `reps` passes.
+
+#include "hash_table.h"
+#include "list.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_REPS 100
+#define LONG_PREFIX 120
+
+typedef enum { OP_INSERT, OP_FIND_HIT, OP_FIND_MISS, OP_ITERATE, OP_DELETE, NUM_OPS } op_t;
+typedef enum { KEYS_SEQ, KEYS_RANDOM, KEYS_LONG, NUM_SHAPES } shape_t;
+
+static const char *op_names[] = { "insert", "find_hit", "find_miss", "iterate", "delete" };
+static const char *shape_names[] = { "seq", "random", "long" };
+
+typedef struct
+{
+    uint32_t n;
+    char **keys;                // insertion order
+    char **order;               // the same keys, shuffled
+    char **missing;             // keys never inserted
+} KeySet;
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_rand(void)
+{
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+
+static char* make_key(shape_t shape, uint32_t i, int miss)
+{
+    char *key;
+    if (shape == KEYS_SEQ) {
+        key = (char*) malloc(24);
+        snprintf(key, 24, "%s%u", miss ? "nobody" : "user", i);
+    } else if (shape == KEYS_RANDOM) {
+        int len = 4 + (int)(next_rand() % 9);
+        key = (char*) malloc(len + 2);
+        for (int k = 0; k < len; k++)
+            key[k] = 'a' + next_rand() % 26;
+        // Misses end in a digit, so they can't equal a hit
+        key[len] = miss ? '0' : '\0';
+        key[len + 1] = '\0';
+    } else {
+        key = (char*) malloc(LONG_PREFIX + 16);
+        memset(key, 'x', LONG_PREFIX);
+        snprintf(key + LONG_PREFIX, 16, "%s%u", miss ? "-" : "", i);
+    }
+    return key;
+}
+
+static void make_keys(KeySet *ks, shape_t shape, uint32_t n)
+{
+    // Random keys are drawn until n distinct ones are found
+    HashTable *seen = hash_table_create(n);
+
+    ks->n = n;
+    ks->keys = (char**) malloc(sizeof(char*) * n);
+    ks->order = (char**) malloc(sizeof(char*) * n);
+    ks->missing = (char**) malloc(sizeof(char*) * n);
+    for (uint32_t i = 0; i < n; i++) {
+        char *key = make_key(shape, i, 0);
+        while (hash_table_find(seen, key) != NULL) {
+            free(key);
+            key = make_key(shape, i, 0);
+        }
+        hash_table_add(seen, key, key);
+        ks->keys[i] = ks->order[i] = key;
+        ks->missing[i] = make_key(shape, i, 1);
+    }
+    hash_table_free(seen);
+
+    for (uint32_t i = n - 1; i > 0; i--) {
+        uint32_t j = (uint32_t)(next_rand() % (i + 1));
+        char *t = ks->order[i]; ks->order[i] = ks->order[j]; ks->order[j] = t;
+    }
+}
+
+static void free_keys(KeySet *ks)
+{
+    for (uint32_t i = 0; i < ks->n; i++) {
+        free(ks->keys[i]);
+        free(ks->missing[i]);
+    }
+    free(ks->keys);
+    free(ks->order);
+    free(ks->missing);
+}
+
+// One pass over a fresh HashTable; returns the number of wrong results
+static int pass_hash_table(const KeySet *ks, uint64_t *ns)
+{
+    uint32_t n = ks->n;
+    int errors = 0;
+    uint64_t t0;
+
+    // A small hint, as the card cache uses, so inserts include growth
+    HashTable *ht = hash_table_create(16);
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        hash_table_add(ht, ks->keys[i], ks->keys[i]);
+    ns[OP_INSERT] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        errors += hash_table_find(ht, ks->order[i]) != ks->order[i];
+    ns[OP_FIND_HIT] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        errors += hash_table_find(ht, ks->missing[i]) != NULL;
+    ns[OP_FIND_MISS] = bench_now_ns() - t0;
+
+    uint32_t pos = 0, seen = 0;
+    char *key;
+    void *val;
+    t0 = bench_now_ns();
+    while (hash_table_next(ht, &pos, &key, &val)) {
+        bench_consume(val);
+        seen++;
+    }
+    ns[OP_ITERATE] = bench_now_ns() - t0;
+    errors += seen != n;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        hash_table_del(ht, ks->order[i]);
+    ns[OP_DELETE] = bench_now_ns() - t0;
+    errors += hash_table_size(ht) != 0;
+
+    hash_table_free(ht);
+    return errors;
+}
+
+static int pass_list(const KeySet *ks, uint64_t *ns)
+{
+    uint32_t n = ks->n;
+    int errors = 0;
+    uint64_t t0;
+
+    List *list = list_create();
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        list_add(list, ks->keys[i], ks->keys[i]);
+    ns[OP_INSERT] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        errors += list_find(list, ks->order[i]) != ks->order[i];
+    ns[OP_FIND_HIT] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        errors += list_find(list, ks->missing[i]) != NULL;
+    ns[OP_FIND_MISS] = bench_now_ns() - t0;
+
+    uint32_t seen = 0;
+    t0 = bench_now_ns();
+    for (ListElem *e = list->head; e != NULL; e = e->next) {
+        bench_consume(e->val);
+        seen++;
+    }
+    ns[OP_ITERATE] = bench_now_ns() - t0;
+    errors += seen != n;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        list_del(list, ks->order[i]);
+    ns[OP_DELETE] = bench_now_ns() - t0;
+    errors += list_size(list) != 0;
+
+    list_free(list);
+    return errors;
+}
+
+static int run(const char *name, int (*pass)(const KeySet*, uint64_t*),
+               shape_t shape, uint32_t n, int warmup, int reps)
+{
+    static uint64_t samples[NUM_OPS][MAX_REPS];
+    uint64_t ns[NUM_OPS];
+    KeySet ks;
+    int errors = 0;
+
+    make_keys(&ks, shape, n);
+    for (int rep = -warmup; rep < reps; rep++) {
+        errors += pass(&ks, ns);
+        if (rep >= 0)
+            for (int op = 0; op < NUM_OPS; op++)
+                samples[op][rep] = ns[op];
+    }
+    free_keys(&ks);
+
+    for (int op = 0; op < NUM_OPS; op++) {
+        BenchStats st = bench_stats(samples[op], reps);
+        printf("{\"bench\":\"ds\",\"struct\":\"%s\",\"op\":\"%s\",\"keys\":\"%s\",\"n\":%u,",
+               name, op_names[op], shape_names[shape], n);
+        bench_print_stats(&st, n);
+        printf("}\n");
+    }
+    fflush(stdout);
+
+    if (errors != 0) {
+        fprintf(stderr, "ds-bench: %d wrong results for %s, %s keys, n=%u\n",
+                errors, name, shape_names[shape], n);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    // Lists are searched linearly, so they get hash-bin-sized inputs
+    uint32_t list_sizes[] = { 16, 128, 1024 };
+    uint32_t table_sizes[] = { 1000, 32000, 256000 };
+    int nsizes = 3;
+    const char *only = NULL;
+    int warmup = 1, reps = 5;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:n:w:r:")) != -1) {
+        switch (c) {
+            case 's': only = optarg; break;
+            case 'n':
+                list_sizes[0] = table_sizes[0] = (uint32_t)strtoul(optarg, NULL, 10);
+                nsizes = 1;
+                break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'r': reps = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: ds-bench [-s list|hash_table] [-n size] "
+                        "[-w warmup] [-r reps]\n");
+                return 1;
+        }
+    }
+    if (warmup < 0)
+        warmup = 0;
+    if (reps < 1)
+        reps = 1;
+    if (reps > MAX_REPS)
+        reps = MAX_REPS;
+    if (list_sizes[0] < 1)
+        list_sizes[0] = table_sizes[0] = 1;
+
+    int failed = 0;
+    for (int shape = 0; shape < NUM_SHAPES; shape++) {
+        for (int i = 0; i < nsizes; i++) {
+            if (only == NULL || strcmp(only, "list") == 0)
+                failed |= run("list", pass_list, shape, list_sizes[i], warmup, reps);
+            if (only == NULL || strcmp(only, "hash_table") == 0)
+                failed |= run("hash_table", pass_hash_table, shape, table_sizes[i], warmup, reps);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Seeded 64-bit string hash, after wyhash.
+ *
+ * Input is read 8 bytes at a time (three independent 48-byte lanes for
+ * long keys) and mixed with 64x64->128-bit multiplies, so a 250-byte
+ * username costs a handful of multiplies rather than a loop per 16 bits.
+ * Keys of up to 16 bytes take a single branchy load path and one final
+ * mix.  Without the seed an attacker who can pick usernames can pick
+ * colliding ones; hash_seed() (hash_table.c) gives every process its own.
+ */
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+// a * b as 128 bits, low half to *a and high half to *b
+static inline void hash_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t hash64(const void *key, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t*)key;
+    uint64_t a, b;
+
+    seed ^= hash_mix(seed ^ HASH_P0, HASH_P1);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping 4-byte loads from each end cover 4..16 bytes
+            size_t mid = (len >> 3) << 2;
+            a = (hash_read32(p) << 32) | hash_read32(p + mid);
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+                s1 = hash_mix(hash_read64(p + 16) ^ HASH_P2, hash_read64(p + 24) ^ s1);
+                s2 = hash_mix(hash_read64(p + 32) ^ HASH_P3, hash_read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // The last 16 bytes, overlapping what was already mixed
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+
+    a ^= HASH_P1;
+    b ^= seed;
+    hash_mum(&a, &b);
+    return hash_mix(a ^ HASH_P0 ^ len, b ^ HASH_P1);
+}
+
+#endif
@@ -0,0 +1,109 @@
+// Throughput of hash64 against the SuperFastHash it replaced
+// Usage: hash-bench [-d duration_ms]
+//
+// Hashes keys of each length back to back.  Each key's first byte comes
+// from the previous hash, so this is latency, as in a table lookup, not
+// pipelined throughput.  Each result is one JSON line.
+
+#include "hash.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The previous hash(), from http://www.azillionmonkeys.com/qed/hash.html
+static uint32_t superfasthash(const char * data, int len)
+{
+#define get16bits(d) (*((const uint16_t *) (d)))
+
+    uint32_t hash = len, tmp;
+    int rem;
+
+    if (len <= 0 || data == NULL) return 0;
+
+    rem = len & 3;
+    len >>= 2;
+
+    for (;len > 0; len--) {
+        hash  += get16bits (data);
+        tmp    = (get16bits (data+2) << 11) ^ hash;
+        hash   = (hash << 16) ^ tmp;
+        data  += 2*sizeof (uint16_t);
+        hash  += hash >> 11;
+    }
+
+    switch (rem) {
+        case 3: hash += get16bits (data);
+                hash ^= hash << 16;
+                hash ^= ((signed char)data[sizeof (uint16_t)]) << 18;
+                hash += hash >> 11;
+                break;
+        case 2: hash += get16bits (data);
+                hash ^= hash << 11;
+                hash += hash >> 17;
+                break;
+        case 1: hash += (signed char)*data;
+                hash ^= hash << 10;
+                hash += hash >> 1;
+    }
+
+    hash ^= hash << 3;
+    hash += hash >> 5;
+    hash ^= hash << 4;
+    hash += hash >> 17;
+    hash ^= hash << 25;
+    hash += hash >> 6;
+
+    return hash;
+}
+
+static void run(int impl, size_t len, uint64_t duration_ns)
+{
+    char key[256];
+    uint64_t acc = 0, ops = 0;
+
+    memset(key, 'q', sizeof(key));
+    uint64_t start = bench_now_ns(), now = start;
+    while (now - start < duration_ns) {
+        for (int i = 0; i < 1024; i++) {
+            key[0] = (char)('a' + (acc & 15));
+            if (impl == 0)
+                acc += hash64(key, len, 0x1234);
+            else
+                acc += superfasthash(key, (int)len);
+        }
+        ops += 1024;
+        now = bench_now_ns();
+    }
+    bench_consume(&acc);
+
+    double ns = (double)(now - start) / ops;
+    printf("{\"bench\":\"hash\",\"impl\":\"%s\",\"len\":%zu,\"ns_per_hash\":%.2f,"
+           "\"gb_per_sec\":%.2f}\n", impl == 0 ? "hash64" : "superfasthash", len,
+           ns, len / ns);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t duration_ms = 200;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:")) != -1) {
+        switch (c) {
+            case 'd': duration_ms = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: hash-bench [-d duration_ms]\n");
+                return 1;
+        }
+    }
+
+    // Typical usernames up to the 250-character limit
+    const size_t lens[] = { 3, 5, 8, 12, 16, 24, 32, 64, 128, 250 };
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        run(0, lens[i], duration_ms * 1000000ULL);
+        run(1, lens[i], duration_ms * 1000000ULL);
+    }
+    return 0;
+}
@@ -0,0 +1,195 @@
+// Collision-quality checks for hash64 on username-like key sets.
+// Each check prints OK or FAIL; the exit status is 1 if any failed.
+
+#include "hash.h"
+#include "hash_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NKEYS 1000000
+#define KEY_LEN 251
+
+static char (*keys)[KEY_LEN];
+static uint64_t *hashes;
+static int failures;
+
+static void check(const char *what, int ok, const char *detail)
+{
+    printf("%-44s %s  %s\n", what, ok ? "OK  " : "FAIL", detail);
+    failures += !ok;
+}
+
+// Short lowercase name for i: a bijection, so every key is distinct
+static void base26(uint32_t i, char *out, int min_len)
+{
+    char tmp[16];
+    int n = 0;
+    do {
+        tmp[n++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0 || n < min_len);
+    for (int k = 0; k < n; k++)
+        out[k] = tmp[n - 1 - k];
+    out[n] = '\0';
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Chi-square of the top `bits` bits (shift = 64 - bits) or the low bits
+static double chi_square(const uint64_t *h, int n, int bits, int top)
+{
+    uint32_t buckets = 1u << bits;
+    uint32_t *count = (uint32_t*) calloc(buckets, sizeof(uint32_t));
+    for (int i = 0; i < n; i++)
+        count[top ? h[i] >> (64 - bits) : h[i] & (buckets - 1)]++;
+
+    double expected = (double)n / buckets, chi = 0;
+    for (uint32_t b = 0; b < buckets; b++)
+        chi += (count[b] - expected) * (count[b] - expected) / expected;
+    free(count);
+    return chi;
+}
+
+static void check_set(const char *name, int n, uint64_t seed)
+{
+    char what[64], detail[128];
+
+    for (int i = 0; i < n; i++)
+        hashes[i] = hash64(keys[i], strlen(keys[i]), seed);
+
+    // Home group (low bits) and control byte (top 7 bits) spread
+    double chi_lo = chi_square(hashes, n, 16, 0);
+    double chi_hi = chi_square(hashes, n, 7, 1);
+    double slack_lo = 6 * sqrt(2.0 * 65535), slack_hi = 6 * sqrt(2.0 * 127);
+
+    // 64-bit collisions: none expected.  Low-32-bit collisions: about
+    // n^2 / 2^33 for a random function
+    qsort(hashes, n, sizeof(uint64_t), compare_u64);
+    int full = 0;
+    for (int i = 1; i < n; i++)
+        full += hashes[i] == hashes[i - 1];
+    for (int i = 0; i < n; i++)
+        hashes[i] &= 0xFFFFFFFFULL;
+    qsort(hashes, n, sizeof(uint64_t), compare_u64);
+    int low = 0;
+    for (int i = 1; i < n; i++)
+        low += hashes[i] == hashes[i - 1];
+    double expected = (double)n * (n - 1) / 2 / 4294967296.0;
+
+    snprintf(what, sizeof(what), "%s (%d keys)", name, n);
+    snprintf(detail, sizeof(detail), "64-bit %d, 32-bit %d (expect %.0f), chi2 low16 %.0f, top7 %.0f",
+             full, low, expected, chi_lo, chi_hi);
+    check(what, full == 0 && low <= 2 * expected + 10 &&
+                fabs(chi_lo - 65535) < slack_lo && fabs(chi_hi - 127) < slack_hi, detail);
+}
+
+// Flipping any input bit should flip each output bit half the time
+static void check_avalanche(int len, uint64_t seed)
+{
+    enum { TRIALS = 2000 };
+    unsigned char key[64];
+    uint64_t x = 0x243F6A8885A308D3ULL;
+    static uint32_t flips[64 * 8][64];
+    char what[64], detail[128];
+
+    memset(flips, 0, sizeof(flips));
+    for (int t = 0; t < TRIALS; t++) {
+        for (int i = 0; i < len; i++) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            key[i] = 'a' + x % 26;
+        }
+        uint64_t h = hash64(key, len, seed);
+        for (int bit = 0; bit < len * 8; bit++) {
+            key[bit / 8] ^= 1 << (bit % 8);
+            uint64_t d = h ^ hash64(key, len, seed);
+            key[bit / 8] ^= 1 << (bit % 8);
+            for (int o = 0; o < 64; o++)
+                flips[bit][o] += (d >> o) & 1;
+        }
+    }
+
+    double worst = 0;
+    for (int bit = 0; bit < len * 8; bit++)
+        for (int o = 0; o < 64; o++) {
+            double bias = fabs((double)flips[bit][o] / TRIALS - 0.5);
+            if (bias > worst)
+                worst = bias;
+        }
+
+    // Six standard deviations of a fair coin over TRIALS flips
+    double limit = 6 * sqrt(0.25 / TRIALS);
+    snprintf(what, sizeof(what), "avalanche, %d-byte keys", len);
+    snprintf(detail, sizeof(detail), "worst bit bias %.3f (limit %.3f)", worst, limit);
+    check(what, worst < limit, detail);
+}
+
+int main()
+{
+    static const char *first[] = {
+        "james", "mary", "john", "patricia", "robert", "jennifer", "michael", "linda",
+        "william", "elizabeth", "david", "barbara", "richard", "susan", "joseph", "jessica",
+        "thomas", "sarah", "charles", "karen", "alice", "bob", "carol", "dave",
+    };
+    static const char *last[] = {
+        "smith", "johnson", "williams", "brown", "jones", "garcia", "miller", "davis",
+        "rodriguez", "martinez", "hernandez", "lopez", "gonzalez", "wilson", "anderson",
+        "thomas", "taylor", "moore", "jackson", "martin", "lee", "perez", "thompson", "white",
+    };
+    const int nfirst = sizeof(first) / sizeof(first[0]), nlast = sizeof(last) / sizeof(last[0]);
+    const uint64_t seeds[] = { 0, hash_seed() };
+
+    keys = malloc((size_t)NKEYS * KEY_LEN);
+    hashes = malloc(sizeof(uint64_t) * NKEYS);
+
+    for (int s = 0; s < 2; s++) {
+        printf("seed %016llx\n", (unsigned long long)seeds[s]);
+
+        for (int i = 0; i < NKEYS; i++)
+            snprintf(keys[i], KEY_LEN, "user%d", i);
+        check_set("user<N>", NKEYS, seeds[s]);
+
+        for (int i = 0; i < NKEYS; i++)
+            base26(i, keys[i], 3);
+        check_set("short lowercase names", NKEYS, seeds[s]);
+
+        // firstlast + a two-letter suffix, like jamessmithab
+        int n = 0;
+        for (int f = 0; f < nfirst; f++)
+            for (int l = 0; l < nlast; l++)
+                for (int x = 0; x < 26 * 26; x++) {
+                    char suffix[8];
+                    base26(x, suffix, 2);
+                    snprintf(keys[n++], KEY_LEN, "%s%s%s", first[f], last[l], suffix);
+                }
+        check_set("first+last+suffix", n, seeds[s]);
+
+        // Maximum-length names differing in four capitals somewhere
+        n = 200000;
+        for (int i = 0; i < n; i++) {
+            char tag[16];
+            memset(keys[i], 'a', 250);
+            keys[i][250] = '\0';
+            base26(i, tag, 4);
+            for (int k = 0; tag[k]; k++)
+                tag[k] -= 'a' - 'A';
+            memcpy(keys[i] + (i * 7) % 246, tag, 4);
+        }
+        check_set("250-char names", n, seeds[s]);
+
+        check_avalanche(8, seeds[s]);
+        check_avalanche(32, seeds[s]);
+    }
+
+    check("seed changes the hash", hash64("alice", 5, 1) != hash64("alice", 5, 2), "");
+    check("hash_seed is stable", hash_seed() == seeds[1] && seeds[1] != 0, "");
+
+    free(keys);
+    free(hashes);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,117 +1,276 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 #include "hash_table.h"
 
-HashTable* hash_table_create(uint32_t num_bins)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Control bytes: 0..127 holds the top 7 bits of a full slot's hash; the
+// low bits pick the home group
+#define CTRL_EMPTY   ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+static inline int8_t hash_h2(uint64_t h)
 {
-    HashTable *ht;
-    uint32_t i;
-   
-    ht = (HashTable*) malloc(sizeof(HashTable));
-    ht->num_bins = num_bins;
-    ht->bins = (List**) malloc(sizeof(List*) * num_bins);
+    return (int8_t)(h >> 57);
+}
 
-    for(i=0; i < num_bins; i++)
-        ht->bins[i] = list_create();
+#if defined(__SSE2__)
+// Bit i set: control byte i of the group equals b
+static inline uint32_t group_match(const int8_t *group, int8_t b)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(b)));
+}
 
-    ht->size = 0;
+// Bit i set: slot i is EMPTY or DELETED (the sign bit is set)
+static inline uint32_t group_match_free(const int8_t *group)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t group_match(const int8_t *group, int8_t b)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < HT_GROUP; i++)
+        mask |= (uint32_t)(group[i] == b) << i;
+    return mask;
+}
 
-    return ht;
+static inline uint32_t group_match_free(const int8_t *group)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < HT_GROUP; i++)
+        mask |= (uint32_t)(group[i] < 0) << i;
+    return mask;
 }
+#endif
 
-void hash_table_free(HashTable *ht)
+static inline uint32_t max_load(uint32_t num_bins)
 {
-    uint32_t i;
+    return num_bins - num_bins / 8;
+}
 
-    if(ht != NULL)
-    {
-        for(i=0; i < ht->num_bins; i++)
-            list_free(ht->bins[i]);
+// Smallest table that holds n entries under the load limit
+static uint32_t bins_for(uint32_t n)
+{
+    uint32_t bins = HT_GROUP;
+    while (max_load(bins) < n && bins < (1u << 31))
+        bins <<= 1;
+    return bins;
+}
 
-        free(ht->bins);
-        free(ht);
+// Groups are visited in triangular order from the hash's home group,
+// which reaches every group once since the group count is a power of two
+#define FOR_EACH_GROUP(ht, h, base)                                             \
+    for (uint32_t _mask = (ht)->num_bins / HT_GROUP - 1, _g = (uint32_t)(h) & _mask, \
+                  _i = 0, base = _g * HT_GROUP;                                 \
+         _i <= _mask;                                                           \
+         _g = (_g + ++_i) & _mask, base = _g * HT_GROUP)
+
+static int alloc_table(HashTable *ht, uint32_t num_bins)
+{
+    int8_t *ctrl = (int8_t*) malloc(num_bins);
+    HashSlot *slots = (HashSlot*) malloc(sizeof(HashSlot) * num_bins);
+    if (ctrl == NULL || slots == NULL) {
+        free(ctrl);
+        free(slots);
+        return -1;
     }
+
+    memset(ctrl, CTRL_EMPTY, num_bins);
+    ht->ctrl = ctrl;
+    ht->slots = slots;
+    ht->num_bins = num_bins;
+    ht->growth_left = max_load(num_bins);
+    return 0;
 }
 
-// From http://www.azillionmonkeys.com/qed/hash.html
-uint32_t hash(const char * data, int len)
+// First EMPTY or DELETED slot on h's probe sequence
+static uint32_t find_free(const HashTable *ht, uint64_t h)
+{
+    FOR_EACH_GROUP(ht, h, base) {
+        uint32_t m = group_match_free(ht->ctrl + base);
+        if (m != 0)
+            return base + (uint32_t)__builtin_ctz(m);
+    }
+    return 0;   // unreachable: the load limit keeps a slot free
+}
+
+// Rebuild into num_bins slots, dropping DELETED markers.  Stored hashes
+// mean no key is hashed or compared.
+static void rehash(HashTable *ht, uint32_t num_bins)
 {
-#define get16bits(d) (*((const uint16_t *) (d)))
+    HashTable old = *ht;
 
-    uint32_t hash = len, tmp;
-    int rem;
+    if (alloc_table(ht, num_bins) != 0) {
+        *ht = old;
+        return;
+    }
 
-    if (len <= 0 || data == NULL) return 0;
+    for (uint32_t i = 0; i < old.num_bins; i++) {
+        if (old.ctrl[i] < 0)
+            continue;
+        uint32_t idx = find_free(ht, old.slots[i].hash);
+        ht->ctrl[idx] = old.ctrl[i];
+        ht->slots[idx] = old.slots[i];
+    }
+    ht->growth_left -= ht->size;
+
+    free(old.ctrl);
+    free(old.slots);
+}
+
+static int64_t find_index(const HashTable *ht, const char *key, uint64_t h)
+{
+    int8_t tag = hash_h2(h);
 
-    rem = len & 3;
-    len >>= 2;
+    FOR_EACH_GROUP(ht, h, base) {
+        const int8_t *group = ht->ctrl + base;
+        for (uint32_t m = group_match(group, tag); m != 0; m &= m - 1) {
+            uint32_t idx = base + (uint32_t)__builtin_ctz(m);
+            const HashSlot *s = &ht->slots[idx];
+            if (s->hash == h && strcmp(s->key, key) == 0)
+                return idx;
+        }
+        // A probe never continues past a group with an EMPTY slot
+        if (group_match(group, CTRL_EMPTY) != 0)
+            break;
+    }
+    return -1;
+}
+
+HashTable* hash_table_create(uint32_t num_bins)
+{
+    HashTable *ht = (HashTable*) malloc(sizeof(HashTable));
+    if (ht == NULL)
+        return NULL;
+
+    ht->size = 0;
+    ht->seed = hash_seed();
+    if (alloc_table(ht, bins_for(num_bins)) != 0) {
+        free(ht);
+        return NULL;
+    }
+    return ht;
+}
 
-    /* Main loop */
-    for (;len > 0; len--) {
-        hash  += get16bits (data);
-        tmp    = (get16bits (data+2) << 11) ^ hash;
-        hash   = (hash << 16) ^ tmp;
-        data  += 2*sizeof (uint16_t);
-        hash  += hash >> 11;
+void hash_table_free(HashTable *ht)
+{
+    if(ht != NULL)
+    {
+        free(ht->ctrl);
+        free(ht->slots);
+        free(ht);
     }
+}
 
-    /* Handle end cases */
-    switch (rem) {
-        case 3: hash += get16bits (data);
-                hash ^= hash << 16;
-                hash ^= ((signed char)data[sizeof (uint16_t)]) << 18;
-                hash += hash >> 11;
-                break;
-        case 2: hash += get16bits (data);
-                hash ^= hash << 11;
-                hash += hash >> 17;
-                break;
-        case 1: hash += (signed char)*data;
-                hash ^= hash << 10;
-                hash += hash >> 1;
+static uint64_t process_seed;
+
+uint64_t hash_seed(void)
+{
+    uint64_t seed = __atomic_load_n(&process_seed, __ATOMIC_ACQUIRE);
+    if (seed != 0)
+        return seed;
+
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        // No entropy source: still differ between processes and runs
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = hash_mix((uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 32),
+                        (uint64_t)(uintptr_t)&seed ^ (uint64_t)ts.tv_sec);
     }
+    if (seed == 0)
+        seed = HASH_P2;
+
+    // The first thread to get here picks the seed for everyone
+    uint64_t expected = 0;
+    if (!__atomic_compare_exchange_n(&process_seed, &expected, seed, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        seed = expected;
+    return seed;
+}
 
-    /* Force "avalanching" of final 127 bits */
-    hash ^= hash << 3;
-    hash += hash >> 5;
-    hash ^= hash << 4;
-    hash += hash >> 17;
-    hash ^= hash << 25;
-    hash += hash >> 6;
+uint32_t hash(const char * data, int len)
+{
+    if (len <= 0 || data == NULL) return 0;
+    uint64_t h = hash64(data, (size_t)len, hash_seed());
+    return (uint32_t)(h ^ (h >> 32));
+}
 
-    return hash;
+static inline uint64_t key_hash(const HashTable *ht, const char *key)
+{
+    return hash64(key, strlen(key), ht->seed);
 }
 
 void hash_table_add(HashTable *ht, char *key, void *val)
 {
-    uint32_t idx = hash(key, strlen(key)) % ht->num_bins;
+    uint64_t h = key_hash(ht, key);
 
     // Do not permit duplicates
-    if(list_find(ht->bins[idx], key) == NULL)
-    {
-        ht->size -= list_size(ht->bins[idx]);
-        list_add(ht->bins[idx], key, val);
-        ht->size += list_size(ht->bins[idx]);
+    if (find_index(ht, key, h) >= 0)
+        return;
+
+    uint32_t idx = find_free(ht, h);
+    if (ht->ctrl[idx] == CTRL_EMPTY && ht->growth_left == 0) {
+        // Mostly DELETED markers: clean up in place.  Otherwise grow.
+        rehash(ht, ht->size < max_load(ht->num_bins) / 2 ? ht->num_bins : ht->num_bins * 2);
+        idx = find_free(ht, h);
     }
+
+    if (ht->ctrl[idx] == CTRL_EMPTY)
+        ht->growth_left--;
+    ht->ctrl[idx] = hash_h2(h);
+    ht->slots[idx].hash = h;
+    ht->slots[idx].key = key;
+    ht->slots[idx].val = val;
+    ht->size++;
 }
 
 void* hash_table_find(HashTable *ht, const char *key)
 {
-    uint32_t idx = hash(key, strlen(key)) % ht->num_bins;
-    return list_find(ht->bins[idx], key);
+    int64_t idx = find_index(ht, key, key_hash(ht, key));
+    return idx < 0 ? NULL : ht->slots[idx].val;
 }
 
 void hash_table_del(HashTable *ht, const char *key)
 {
-    uint32_t idx = hash(key, strlen(key)) % ht->num_bins;
+    int64_t idx = find_index(ht, key, key_hash(ht, key));
+    if (idx < 0)
+        return;
 
-    ht->size -= list_size(ht->bins[idx]);
-    list_del(ht->bins[idx], key);
-    ht->size += list_size(ht->bins[idx]);
+    // If the group already has an EMPTY slot no probe ever went past it,
+    // so this slot can be EMPTY too; otherwise later probes must not stop
+    uint32_t base = (uint32_t)idx & ~(uint32_t)(HT_GROUP - 1);
+    if (group_match(ht->ctrl + base, CTRL_EMPTY) != 0) {
+        ht->ctrl[idx] = CTRL_EMPTY;
+        ht->growth_left++;
+    } else {
+        ht->ctrl[idx] = CTRL_DELETED;
+    }
+    ht->size--;
 }
 
 uint32_t hash_table_size(const HashTable *ht)
 {
     return ht->size;
 }
+
+int hash_table_next(const HashTable *ht, uint32_t *pos, char **key, void **val)
+{
+    for (uint32_t i = *pos; i < ht->num_bins; i++) {
+        if (ht->ctrl[i] >= 0) {
+            *key = ht->slots[i].key;
+            *val = ht->slots[i].val;
+            *pos = i + 1;
+            return 1;
+        }
+    }
+    *pos = ht->num_bins;
+    return 0;
+}
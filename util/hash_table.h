@@ -2,28 +2,57 @@
  * This is a simple hash table that maps a char* key to a void* data.
  * It does not permit multiple entires with the same key.
  * See hash_table_example.c for an example of how to use it.
- * Feel free to change this as you desire.
+ *
+ * Open addressing in the style of Swiss tables: one control byte per
+ * slot holds 7 bits of the key's hash (or EMPTY/DELETED), and lookups
+ * compare a whole group of 16 control bytes at once, with SSE2 where
+ * available.  Only slots whose control byte matches are looked at, and
+ * their stored 64-bit hash is compared before the key itself.  The table
+ * doubles when it is 7/8 full.  Keys are not copied.
+ *
+ * Keys are hashed with hash64 (hash.h) under a seed drawn once per
+ * process, so colliding usernames can't be chosen in advance.
  */
 
 #ifndef __HASH_TABLE_H__
 #define __HASH_TABLE_H__
 
-#include "list.h"
 #include <stdint.h>
+#include "hash.h"
+
+#define HT_GROUP 16             // control bytes probed together
+
+typedef struct _HashSlot
+{
+    uint64_t hash;
+    char *key;
+    void *val;
+} HashSlot;
 
 typedef struct _HashTable
 {
-    uint32_t num_bins;
-    List **bins;
+    uint32_t num_bins;          // slots: a power of two, at least HT_GROUP
+    int8_t *ctrl;               // num_bins control bytes
+    HashSlot *slots;
     uint32_t size;
+    uint32_t growth_left;       // inserts into EMPTY slots before a rehash
+    uint64_t seed;              // hash_seed() when the table was created
 } HashTable;
 
+// num_bins is a hint for the expected number of entries
 HashTable* hash_table_create(uint32_t num_bins);
 void hash_table_free(HashTable *ht);
+// Random per-process seed, drawn on first use
+uint64_t hash_seed(void);
+// hash64 under hash_seed(), folded to 32 bits
 uint32_t hash(const char * data, int len);
 void hash_table_add(HashTable *ht, char *key, void *val);
 void* hash_table_find(HashTable *ht, const char *key);
 void hash_table_del(HashTable *ht, const char *key);
 uint32_t hash_table_size(const HashTable *ht);
 
+// Visit every entry: start with *pos = 0, returns 0 after the last.
+// The entry just returned may be deleted during the walk.
+int hash_table_next(const HashTable *ht, uint32_t *pos, char **key, void **val);
+
 #endif
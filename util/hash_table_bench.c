@@ -0,0 +1,209 @@
+// Microbenchmark for util/hash_table.c against the chained table it replaced
+// Usage: hash-table-bench [-n entries] [-b bins] [-r reps]
+//
+// Each table is created with the same bins hint (default 1024, what the
+// card cache uses) and filled with "user<i>" keys.  Lookups and deletes
+// visit the keys in a shuffled order.  Every pass builds a fresh table;
+// the fastest of `reps` passes is reported, one JSON line per operation.
+
+#include "hash_table.h"
+#include "list.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The previous implementation: a fixed array of List bins
+typedef struct
+{
+    uint32_t num_bins;
+    List **bins;
+} ChainedTable;
+
+static ChainedTable* chained_create(uint32_t num_bins)
+{
+    ChainedTable *ht = (ChainedTable*) malloc(sizeof(ChainedTable));
+    ht->num_bins = num_bins;
+    ht->bins = (List**) malloc(sizeof(List*) * num_bins);
+    for (uint32_t i = 0; i < num_bins; i++)
+        ht->bins[i] = list_create();
+    return ht;
+}
+
+static void chained_free(ChainedTable *ht)
+{
+    for (uint32_t i = 0; i < ht->num_bins; i++)
+        list_free(ht->bins[i]);
+    free(ht->bins);
+    free(ht);
+}
+
+static void chained_add(ChainedTable *ht, char *key, void *val)
+{
+    uint32_t idx = hash(key, strlen(key)) % ht->num_bins;
+    if (list_find(ht->bins[idx], key) == NULL)
+        list_add(ht->bins[idx], key, val);
+}
+
+static void* chained_find(ChainedTable *ht, const char *key)
+{
+    return list_find(ht->bins[hash(key, strlen(key)) % ht->num_bins], key);
+}
+
+static void chained_del(ChainedTable *ht, const char *key)
+{
+    list_del(ht->bins[hash(key, strlen(key)) % ht->num_bins], key);
+}
+
+typedef enum { OP_INSERT, OP_FIND_HIT, OP_FIND_MISS, OP_DELETE } bench_op_t;
+
+static const char *op_names[] = { "insert", "find_hit", "find_miss", "delete" };
+
+static char **make_keys(uint32_t n, const char *prefix)
+{
+    char **keys = (char**) malloc(sizeof(char*) * n);
+    for (uint32_t i = 0; i < n; i++) {
+        keys[i] = (char*) malloc(24);
+        snprintf(keys[i], 24, "%s%u", prefix, i);
+    }
+    return keys;
+}
+
+static void shuffle(char **keys, uint32_t n)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = n - 1; i > 0; i--) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        uint32_t j = (uint32_t)(x % (i + 1));
+        char *t = keys[i]; keys[i] = keys[j]; keys[j] = t;
+    }
+}
+
+static void report(const char *impl, bench_op_t op, uint32_t n, uint32_t bins, uint64_t ns)
+{
+    printf("{\"bench\":\"hash_table\",\"impl\":\"%s\",\"op\":\"%s\",\"entries\":%u,"
+           "\"bins\":%u,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n",
+           impl, op_names[op], n, bins, (double)ns / n, n * 1e9 / ns);
+    fflush(stdout);
+}
+
+static int run(uint32_t n, uint32_t bins, int reps)
+{
+    char **keys = make_keys(n, "user");
+    char **order = (char**) malloc(sizeof(char*) * n);
+    char **missing = make_keys(n, "nobody");
+    uint64_t t0, ns[4], best[2][4];
+    int errors = 0;
+
+    memcpy(order, keys, sizeof(char*) * n);
+    shuffle(order, n);
+
+    for (int i = 0; i < 4; i++)
+        best[0][i] = best[1][i] = UINT64_MAX;
+
+    for (int rep = 0; rep < reps; rep++) {
+        // Open addressing
+        HashTable *ht = hash_table_create(bins);
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            hash_table_add(ht, keys[i], keys[i]);
+        ns[OP_INSERT] = bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            errors += hash_table_find(ht, order[i]) != order[i];
+        ns[OP_FIND_HIT] = bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            errors += hash_table_find(ht, missing[i]) != NULL;
+        ns[OP_FIND_MISS] = bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            hash_table_del(ht, order[i]);
+        ns[OP_DELETE] = bench_now_ns() - t0;
+        errors += hash_table_size(ht) != 0;
+        hash_table_free(ht);
+
+        for (int op = OP_INSERT; op <= OP_DELETE; op++)
+            if (ns[op] < best[0][op]) best[0][op] = ns[op];
+
+        // Chained
+        ChainedTable *ct = chained_create(bins);
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            chained_add(ct, keys[i], keys[i]);
+        ns[OP_INSERT] = bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            errors += chained_find(ct, order[i]) != order[i];
+        ns[OP_FIND_HIT] = bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            errors += chained_find(ct, missing[i]) != NULL;
+        ns[OP_FIND_MISS] = bench_now_ns() - t0;
+
+        t0 = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++)
+            chained_del(ct, order[i]);
+        ns[OP_DELETE] = bench_now_ns() - t0;
+        chained_free(ct);
+
+        for (int op = OP_INSERT; op <= OP_DELETE; op++)
+            if (ns[op] < best[1][op]) best[1][op] = ns[op];
+    }
+
+    for (int op = OP_INSERT; op <= OP_DELETE; op++)
+        report("swiss", op, n, bins, best[0][op]);
+    for (int op = OP_INSERT; op <= OP_DELETE; op++)
+        report("chained", op, n, bins, best[1][op]);
+
+    for (uint32_t i = 0; i < n; i++) {
+        free(keys[i]);
+        free(missing[i]);
+    }
+    free(keys);
+    free(missing);
+    free(order);
+
+    if (errors != 0) {
+        fprintf(stderr, "hash-table-bench: %d wrong results at %u entries\n", errors, n);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t sizes[] = { 1000, 16000, 128000 };
+    int nsizes = 3;
+    uint32_t bins = 1024;
+    int reps = 5;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:b:r:")) != -1) {
+        switch (c) {
+            case 'n': sizes[0] = (uint32_t)strtoul(optarg, NULL, 10); nsizes = 1; break;
+            case 'b': bins = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'r': reps = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: hash-table-bench [-n entries] [-b bins] [-r reps]\n");
+                return 1;
+        }
+    }
+    if (bins < 1)
+        bins = 1;
+    if (reps < 1)
+        reps = 1;
+
+    int rc = 0;
+    for (int i = 0; i < nsizes; i++) {
+        if (sizes[i] > 0 && run(sizes[i], bins, reps) != 0)
+            rc = 1;
+    }
+    return rc;
+}
@@ -19,5 +19,27 @@ int main()
 
     printf("Size: %d\n", hash_table_size(ht));
 
+    // Grow well past the initial size, then delete every other key
+    static char keys[10000][8];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+        hash_table_add(ht, keys[i], keys[i]);
+    }
+    for (int i = 0; i < 10000; i += 2)
+        hash_table_del(ht, keys[i]);
+
+    int found = 0;
+    for (int i = 0; i < 10000; i++)
+        found += hash_table_find(ht, keys[i]) == (i % 2 ? keys[i] : NULL);
+    printf("Lookups after growth: %s\n", found == 10000 ? "OK" : "FAIL");
+
+    uint32_t pos = 0, visited = 0;
+    char *key;
+    void *val;
+    while (hash_table_next(ht, &pos, &key, &val))
+        visited++;
+    printf("Size: %d, visited %u\n", hash_table_size(ht), visited);
+
+    hash_table_free(ht);
     return EXIT_SUCCESS;
 }
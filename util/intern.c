@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "hash_table.h"
+
+#define INTERN_CHUNK_SIZE 65536     // arena bytes per chunk, unless a name is longer
+
+struct _InternChunk
+{
+    InternChunk *next;
+    size_t size;
+    char data[];
+};
+
+// Copy s into the arena, null-terminated
+static const char* arena_copy(InternTable *it, const char *s, size_t len)
+{
+    InternChunk *chunk = it->chunks;
+    if (chunk == NULL || chunk->size - it->chunk_used < len + 1) {
+        size_t size = (len + 1 > INTERN_CHUNK_SIZE) ? len + 1 : INTERN_CHUNK_SIZE;
+        chunk = (InternChunk*) malloc(sizeof(InternChunk) + size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = it->chunks;
+        chunk->size = size;
+        it->chunks = chunk;
+        it->chunk_used = 0;
+    }
+
+    char *copy = chunk->data + it->chunk_used;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    it->chunk_used += len + 1;
+    return copy;
+}
+
+// Slot of s's ID in the index, or of the empty slot where it would go
+static uint32_t find_slot(const InternTable *it, const char *s, size_t len, uint64_t h)
+{
+    uint32_t i = (uint32_t)h & it->index_mask;
+    for (;;) {
+        InternId id = it->index[i];
+        if (id == 0)
+            return i;
+        const InternName *name = &it->names[id - 1];
+        if (name->hash == h && name->len == len && memcmp(name->str, s, len) == 0)
+            return i;
+        i = (i + 1) & it->index_mask;
+    }
+}
+
+static int grow_index(InternTable *it)
+{
+    uint32_t size = (it->index_mask + 1) * 2;
+    InternId *index = (InternId*) calloc(size, sizeof(InternId));
+    if (index == NULL)
+        return -1;
+
+    free(it->index);
+    it->index = index;
+    it->index_mask = size - 1;
+    for (InternId id = 1; id <= it->count; id++) {
+        uint32_t i = (uint32_t)it->names[id - 1].hash & it->index_mask;
+        while (index[i] != 0)
+            i = (i + 1) & it->index_mask;
+        index[i] = id;
+    }
+    return 0;
+}
+
+InternTable* intern_create(uint32_t size_hint)
+{
+    InternTable *it = (InternTable*) calloc(1, sizeof(InternTable));
+    if (it == NULL)
+        return NULL;
+
+    uint32_t size = 16;
+    while (size < (uint64_t)size_hint * 2 && size < (1u << 31))
+        size *= 2;
+
+    it->capacity = size / 2;
+    it->names = (InternName*) malloc(sizeof(InternName) * it->capacity);
+    it->index = (InternId*) calloc(size, sizeof(InternId));
+    if (it->names == NULL || it->index == NULL) {
+        free(it->names);
+        free(it->index);
+        free(it);
+        return NULL;
+    }
+    it->index_mask = size - 1;
+    it->seed = hash_seed();
+    return it;
+}
+
+void intern_free(InternTable *it)
+{
+    if (it == NULL)
+        return;
+
+    while (it->chunks != NULL) {
+        InternChunk *next = it->chunks->next;
+        free(it->chunks);
+        it->chunks = next;
+    }
+    free(it->names);
+    free(it->index);
+    free(it);
+}
+
+InternId intern(InternTable *it, const char *s, size_t len)
+{
+    if (len > UINT32_MAX)
+        return 0;
+
+    uint64_t h = hash64(s, len, it->seed);
+    uint32_t slot = find_slot(it, s, len, h);
+    if (it->index[slot] != 0)
+        return it->index[slot];
+
+    // Keep the index at most half full
+    if (it->count + 1 > (it->index_mask + 1) / 2) {
+        if (grow_index(it) != 0)
+            return 0;
+        slot = find_slot(it, s, len, h);
+    }
+    if (it->count == it->capacity) {
+        uint32_t capacity = it->capacity * 2;
+        InternName *names = (InternName*) realloc(it->names, sizeof(InternName) * capacity);
+        if (names == NULL)
+            return 0;
+        it->names = names;
+        it->capacity = capacity;
+    }
+
+    const char *copy = arena_copy(it, s, len);
+    if (copy == NULL)
+        return 0;
+
+    InternName *name = &it->names[it->count++];
+    name->str = copy;
+    name->len = (uint32_t)len;
+    name->hash = h;
+    it->index[slot] = it->count;
+    return it->count;
+}
+
+InternId intern_lookup(const InternTable *it, const char *s, size_t len)
+{
+    uint64_t h = hash64(s, len, it->seed);
+    return it->index[find_slot(it, s, len, h)];
+}
@@ -0,0 +1,73 @@
+/*
+ * Interned strings: each distinct name is stored once, with its length
+ * and hash, and referred to by a small integer ID.  Two interned names
+ * are equal exactly when their IDs are, so holders of IDs compare with
+ * one integer compare and never copy or strlen the name.
+ *
+ * IDs are handed out in order starting at 1; 0 means "no name".  Names
+ * live in an append-only arena and are never removed, so an ID and the
+ * pointer from intern_str stay valid until intern_free.  Lookups hash
+ * with hash64 under hash_seed() (hash_table.h) and probe an
+ * open-addressed index of IDs.
+ */
+
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t InternId;
+
+typedef struct _InternName
+{
+    const char *str;            // null-terminated, in the arena
+    uint32_t len;
+    uint64_t hash;
+} InternName;
+
+typedef struct _InternChunk InternChunk;
+
+typedef struct _InternTable
+{
+    InternName *names;          // names[id - 1]
+    uint32_t count;
+    uint32_t capacity;
+    InternId *index;            // power of two, at most half full; 0 = empty
+    uint32_t index_mask;
+    InternChunk *chunks;        // newest first
+    size_t chunk_used;          // bytes used in the newest chunk
+    uint64_t seed;
+} InternTable;
+
+// size_hint: expected number of names
+InternTable* intern_create(uint32_t size_hint);
+void intern_free(InternTable *it);
+// ID of s[0..len), adding it if new; 0 if out of memory.  s need not be
+// null-terminated.
+InternId intern(InternTable *it, const char *s, size_t len);
+// ID of s[0..len), or 0 if it was never interned
+InternId intern_lookup(const InternTable *it, const char *s, size_t len);
+
+// id must be one returned by intern()
+static inline const char* intern_str(const InternTable *it, InternId id)
+{
+    return it->names[id - 1].str;
+}
+
+static inline uint32_t intern_len(const InternTable *it, InternId id)
+{
+    return it->names[id - 1].len;
+}
+
+static inline uint64_t intern_hash(const InternTable *it, InternId id)
+{
+    return it->names[id - 1].hash;
+}
+
+static inline uint32_t intern_count(const InternTable *it)
+{
+    return it->count;
+}
+
+#endif
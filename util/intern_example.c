@@ -0,0 +1,39 @@
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main()
+{
+    InternTable *it = intern_create(4);
+
+    InternId alice = intern(it, "Alice", 5);
+    InternId bob = intern(it, "Bob", 3);
+    printf("Alice -> %u, Bob -> %u\n", alice, bob);
+
+    // Not null-terminated: only the first len bytes count
+    printf("Alice again -> %u\n", intern(it, "Alice and more", 5));
+    printf("Lookup Bob -> %u\n", intern_lookup(it, "Bob", 3));
+    printf("Lookup Charlie -> %s\n", intern_lookup(it, "Charlie", 7) == 0 ? "Not Found" : "FAIL");
+    printf("Name %u -> %s (%u bytes)\n", alice, intern_str(it, alice), intern_len(it, alice));
+
+    // Grow well past the hint, with names up to the 250-character limit
+    static char names[10000][251];
+    int ok = 1;
+    for (int i = 0; i < 10000; i++) {
+        int len = 1 + i % 240;
+        memset(names[i], 'a' + i % 26, len);
+        snprintf(names[i] + len, sizeof(names[i]) - len, "%d", i);
+        ok &= intern(it, names[i], strlen(names[i])) == (InternId)(i + 3);
+    }
+    for (int i = 0; i < 10000; i++) {
+        InternId id = intern_lookup(it, names[i], strlen(names[i]));
+        ok &= id == (InternId)(i + 3) && strcmp(intern_str(it, id), names[i]) == 0 &&
+              intern_len(it, id) == strlen(names[i]);
+    }
+    ok &= intern_lookup(it, "Alice", 5) == alice && intern_count(it) == 10002;
+    printf("Lookups after growth: %s\n", ok ? "OK" : "FAIL");
+
+    intern_free(it);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
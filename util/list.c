@@ -3,30 +3,116 @@
 #include <assert.h>
 #include "list.h"
 
+struct _ListChunk
+{
+    struct _ListChunk *next;
+    uint32_t cap;
+    ListElem elems[];
+};
+
+static void arena_init(ListArena *arena)
+{
+    memset(arena, 0, sizeof(*arena));
+}
+
+static void arena_release(ListArena *arena)
+{
+    ListChunk *chunk = arena->chunks;
+    while(chunk != NULL)
+    {
+        ListChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->free_elems = NULL;
+}
+
+static ListElem* arena_alloc(ListArena *arena)
+{
+    ListElem *elem = arena->free_elems;
+    if(elem != NULL)
+    {
+        arena->free_elems = elem->next;
+        arena->stats.node_allocs++;
+        arena->stats.node_reuses++;
+        return elem;
+    }
+
+    ListChunk *chunk = arena->chunks;
+    if(chunk == NULL || arena->chunk_used == chunk->cap)
+    {
+        uint32_t cap = chunk == NULL ? LIST_CHUNK_MIN : chunk->cap * 2;
+        if(cap > LIST_CHUNK_MAX)
+            cap = LIST_CHUNK_MAX;
+
+        size_t bytes = sizeof(ListChunk) + sizeof(ListElem) * cap;
+        chunk = (ListChunk*) malloc(bytes);
+        if(chunk == NULL)
+            return NULL;
+        chunk->cap = cap;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->chunk_used = 0;
+        arena->stats.chunk_allocs++;
+        arena->stats.bytes += bytes;
+    }
+
+    arena->stats.node_allocs++;
+    return &chunk->elems[arena->chunk_used++];
+}
+
+static void arena_put(ListArena *arena, ListElem *elem)
+{
+    arena->stats.node_frees++;
+    elem->next = arena->free_elems;
+    arena->free_elems = elem;
+}
+
 List* list_create()
 {
     List *list = (List*) malloc(sizeof(List));
     list->head = list->tail = NULL;
     list->size = 0;
+    arena_init(&list->slab);
+    list->arena = &list->slab;
+    return list;
+}
+
+List* list_create_in(ListArena *arena)
+{
+    List *list = list_create();
+    list->arena = arena;
     return list;
 }
 
+// Frees the slabs, never the nodes one by one
 void list_free(List *list)
 {
     if(list != NULL)
     {
-        ListElem *curr = list->head;
-        ListElem *next;
-        while(curr != NULL)
-        {
-            next = curr->next;
-            free(curr);
-            curr = next;
-        }
+        arena_release(&list->slab);
         free(list);
     }
 }
 
+ListArena* list_arena_create()
+{
+    ListArena *arena = (ListArena*) malloc(sizeof(ListArena));
+    if(arena != NULL)
+        arena_init(arena);
+    return arena;
+}
+
+void list_arena_free(ListArena *arena)
+{
+    if(arena != NULL)
+    {
+        arena_release(arena);
+        free(arena);
+    }
+}
+
 void* list_find(List *list, const char *key)
 {
     if(list == NULL)
@@ -48,7 +134,9 @@ void list_add(List *list, char *key, void *val)
     // Allow duplicates
     // assert(list_find(list, key) == NULL);
 
-    ListElem *elem = (ListElem*) malloc(sizeof(ListElem));
+    ListElem *elem = arena_alloc(list->arena);
+    if(elem == NULL)
+        return;
     elem->key = key;
     elem->val = val;
     elem->next = NULL;
@@ -56,7 +144,10 @@ void list_add(List *list, char *key, void *val)
     if(list->tail == NULL)
         list->head = list->tail = elem;
     else
+    {
         list->tail->next = elem;
+        list->tail = elem;
+    }
 
     list->size++;
 }
@@ -84,7 +175,7 @@ void list_del(List *list, const char *key)
 
             list->size--;
 
-            free(curr);
+            arena_put(list->arena, curr);
             return;
         }
 
@@ -97,3 +188,8 @@ uint32_t list_size(const List *list)
 {
     return list->size;
 }
+
+const ListAllocStats* list_alloc_stats(const List *list)
+{
+    return &list->arena->stats;
+}
@@ -2,7 +2,18 @@
  * This is a simple list that stores key-data pairs.
  * It DOES permit multiple entires with the same key.
  * See list_example.c for an example of how to use it.
- * Feel free to change this as you desire.
+ *
+ * Nodes come from slabs rather than one malloc each, and deleted nodes
+ * go on a free list for the next add.  By default every list has its own
+ * slabs.  Lists created with list_create_in share a ListArena instead:
+ * a node deleted from one can be reused by any list in the arena,
+ * list_free releases only the List itself, and list_arena_free releases
+ * every node of every list in the arena together.
+ *
+ * Slabs are only released with their list or arena, so memory stays at
+ * its high-water mark until then.  Releasing costs one free() per slab,
+ * never one per node; slabs grow to LIST_CHUNK_MAX nodes, so that is
+ * about n / LIST_CHUNK_MAX calls for n nodes, not constant time.
  */
 
 #ifndef __LIST_H__
@@ -10,6 +21,9 @@
 
 #include <stdint.h>
 
+#define LIST_CHUNK_MIN 16       // nodes in a list's first slab
+#define LIST_CHUNK_MAX 4096     // slabs double up to this many nodes
+
 typedef struct _ListElem
 {
     char *key;
@@ -17,20 +31,45 @@ typedef struct _ListElem
     struct _ListElem *next;
 } ListElem;
 
+typedef struct _ListAllocStats
+{
+    uint64_t node_allocs;       // nodes handed out, new or reused
+    uint64_t node_reuses;       // of those, taken from the free list
+    uint64_t node_frees;        // nodes returned by list_del
+    uint64_t chunk_allocs;      // slabs malloc'd
+    uint64_t bytes;             // bytes malloc'd for slabs
+} ListAllocStats;
+
+typedef struct _ListChunk ListChunk;
+
+typedef struct _ListArena
+{
+    ListElem *free_elems;
+    ListChunk *chunks;          // newest first
+    uint32_t chunk_used;        // nodes handed out from the newest slab
+    ListAllocStats stats;
+} ListArena;
+
 typedef struct _List
 {
     ListElem *head;
     ListElem *tail;
+    ListArena *arena;           // &slab, or a shared arena
     uint32_t size;
+    ListArena slab;             // this list's own nodes
 } List;
 
 List* list_create();
+List* list_create_in(ListArena *arena);
 void list_free(List *list);
 void list_add(List *list, char *key, void *val);
 void* list_find(List *list, const char *key);
 void list_del(List *list, const char *key);
 uint32_t list_size(const List *list);
+const ListAllocStats* list_alloc_stats(const List *list);
 
-#endif
-
+ListArena* list_arena_create();
+// Every list created in the arena must be freed first (or never used again)
+void list_arena_free(ListArena *arena);
 
+#endif
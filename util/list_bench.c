@@ -0,0 +1,178 @@
+// Microbenchmark for util/list.c node allocation
+// Usage: list-bench [-n nodes] [-l lists] [-r reps]
+//
+// Compares one malloc per node (the previous list.c), per-list slabs and
+// a shared arena.  Nodes are spread round-robin over `lists` lists, as
+// hash table bins would be, so the malloc version's nodes interleave in
+// the heap.  Phases: build (list_add), walk (list_find of a missing key,
+// touching every node), churn (delete the head and add a node, n times)
+// and free.  The fastest of `reps` passes is reported, one JSON line per
+// phase.
+
+#include "list.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef enum { IMPL_MALLOC, IMPL_SLAB, IMPL_ARENA } impl_t;
+typedef enum { PHASE_BUILD, PHASE_WALK, PHASE_CHURN, PHASE_FREE } phase_t;
+
+static const char *impl_names[] = { "malloc", "slab", "arena" };
+static const char *phase_names[] = { "build", "walk", "churn", "free" };
+
+// The previous allocation scheme: a malloc per node, freed one by one
+static void malloc_add(List *list, char *key, void *val)
+{
+    ListElem *elem = (ListElem*) malloc(sizeof(ListElem));
+    elem->key = key;
+    elem->val = val;
+    elem->next = NULL;
+    if (list->tail == NULL)
+        list->head = list->tail = elem;
+    else {
+        list->tail->next = elem;
+        list->tail = elem;
+    }
+    list->size++;
+}
+
+static void malloc_del(List *list, const char *key)
+{
+    ListElem *curr = list->head, *prev = NULL;
+    while (curr != NULL) {
+        if (strcmp(curr->key, key) == 0) {
+            if (curr == list->tail)
+                list->tail = prev;
+            if (prev == NULL)
+                list->head = curr->next;
+            else
+                prev->next = curr->next;
+            list->size--;
+            free(curr);
+            return;
+        }
+        prev = curr;
+        curr = curr->next;
+    }
+}
+
+static void malloc_free(List *list)
+{
+    ListElem *curr = list->head;
+    while (curr != NULL) {
+        ListElem *next = curr->next;
+        free(curr);
+        curr = next;
+    }
+    free(list);
+}
+
+static void run(impl_t impl, uint32_t n, uint32_t nlists, char **keys, uint64_t *ns)
+{
+    List **lists = (List**) malloc(sizeof(List*) * nlists);
+    ListArena *arena = (impl == IMPL_ARENA) ? list_arena_create() : NULL;
+    uint64_t t0;
+
+    for (uint32_t i = 0; i < nlists; i++) {
+        if (impl == IMPL_MALLOC) {
+            lists[i] = (List*) calloc(1, sizeof(List));
+        } else {
+            lists[i] = (impl == IMPL_ARENA) ? list_create_in(arena) : list_create();
+        }
+    }
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++) {
+        if (impl == IMPL_MALLOC)
+            malloc_add(lists[i % nlists], keys[i], keys[i]);
+        else
+            list_add(lists[i % nlists], keys[i], keys[i]);
+    }
+    ns[PHASE_BUILD] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < nlists; i++)
+        bench_consume(list_find(lists[i], "missing"));
+    ns[PHASE_WALK] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++) {
+        List *list = lists[i % nlists];
+        if (impl == IMPL_MALLOC) {
+            malloc_del(list, list->head->key);
+            malloc_add(list, keys[i], keys[i]);
+        } else {
+            list_del(list, list->head->key);
+            list_add(list, keys[i], keys[i]);
+        }
+    }
+    ns[PHASE_CHURN] = bench_now_ns() - t0;
+
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < nlists; i++) {
+        if (impl == IMPL_MALLOC)
+            malloc_free(lists[i]);
+        else
+            list_free(lists[i]);
+    }
+    list_arena_free(arena);
+    ns[PHASE_FREE] = bench_now_ns() - t0;
+
+    free(lists);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n = 1000000;
+    uint32_t nlists = 1024;
+    int reps = 5;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:l:r:")) != -1) {
+        switch (c) {
+            case 'n': n = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'l': nlists = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'r': reps = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: list-bench [-n nodes] [-l lists] [-r reps]\n");
+                return 1;
+        }
+    }
+    if (nlists < 1)
+        nlists = 1;
+    if (n < nlists)
+        n = nlists;
+    if (reps < 1)
+        reps = 1;
+
+    // Distinct keys, so list_del removes exactly the head
+    char **keys = (char**) malloc(sizeof(char*) * n);
+    for (uint32_t i = 0; i < n; i++) {
+        keys[i] = (char*) malloc(16);
+        snprintf(keys[i], 16, "k%u", i);
+    }
+
+    for (int impl = IMPL_MALLOC; impl <= IMPL_ARENA; impl++) {
+        uint64_t best[4] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+        for (int rep = 0; rep < reps; rep++) {
+            uint64_t ns[4];
+            run(impl, n, nlists, keys, ns);
+            for (int p = PHASE_BUILD; p <= PHASE_FREE; p++)
+                if (ns[p] < best[p]) best[p] = ns[p];
+        }
+        for (int p = PHASE_BUILD; p <= PHASE_FREE; p++) {
+            printf("{\"bench\":\"list\",\"impl\":\"%s\",\"phase\":\"%s\",\"nodes\":%u,"
+                   "\"lists\":%u,\"ns_per_node\":%.2f,\"ms\":%.3f}\n",
+                   impl_names[impl], phase_names[p], n, nlists,
+                   (double)best[p] / n, best[p] / 1e6);
+        }
+        fflush(stdout);
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+        free(keys[i]);
+    free(keys);
+    return 0;
+}
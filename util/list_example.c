@@ -17,8 +17,31 @@ int main()
     printf("Size = %d\n", ls->size);
     list_add(ls, "Alice", "456");
     printf("Size = %d\n", ls->size);
+
+    // A deleted node is reused by the next add
+    list_del(ls, "Bob");
+    list_add(ls, "Dave", "789");
+    const ListAllocStats *st = list_alloc_stats(ls);
+    printf("Dave -> '%s', %llu nodes, %llu reused, %llu slab\n", (char*) list_find(ls, "Dave"),
+           (unsigned long long)st->node_allocs, (unsigned long long)st->node_reuses,
+           (unsigned long long)st->chunk_allocs);
     list_free(ls);
 
+    // Lists in an arena share its free nodes and are released together
+    ListArena *arena = list_arena_create();
+    List *a = list_create_in(arena), *b = list_create_in(arena);
+    list_add(a, "Alice", "1");
+    list_add(b, "Bob", "2");
+    printf("Alice -> '%s', Bob -> '%s'\n", (char*) list_find(a, "Alice"), (char*) list_find(b, "Bob"));
+    list_del(a, "Alice");
+    list_add(b, "Carol", "3");
+    st = list_alloc_stats(b);
+    printf("Carol -> '%s', %llu nodes, %llu reused\n", (char*) list_find(b, "Carol"),
+           (unsigned long long)st->node_allocs, (unsigned long long)st->node_reuses);
+    list_free(a);
+    list_free(b);
+    list_arena_free(arena);
+
 	return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,316 @@
+// Encoding and decoding of protocol messages in either wire format
+
+#include "wire.h"
+#include <string.h>
+
+void wire_set_username(wire_msg_t *msg, const char *username)
+{
+    size_t len = strlen(username);
+    if (len >= USERNAME_SIZE) len = USERNAME_SIZE - 1;
+    memcpy(msg->username, username, len);
+    msg->username[len] = '\0';
+    msg->username_len = (uint8_t)len;
+}
+
+static int encode_legacy(const wire_msg_t *msg, unsigned char *buf, size_t max_len)
+{
+    size_t len;
+
+    switch (msg->msg_type) {
+        case MSG_LOGIN_REQ: {
+            msg_login_req_t *m = (msg_login_req_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            memcpy(m->auth_token, msg->auth_token, AUTH_TOKEN_SIZE);
+            memcpy(m->pin, msg->pin, PIN_SIZE);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_LOGIN_RESP: {
+            msg_login_resp_t *m = (msg_login_resp_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->success = msg->success;
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_BALANCE_REQ: {
+            msg_balance_req_t *m = (msg_balance_req_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_BALANCE_RESP: {
+            msg_balance_resp_t *m = (msg_balance_resp_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->balance = htonl(msg->balance);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_REQ: {
+            msg_withdraw_req_t *m = (msg_withdraw_req_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->amount = htonl(msg->amount);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_RESP: {
+            msg_withdraw_resp_t *m = (msg_withdraw_resp_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->success = msg->success;
+            m->new_balance = htonl(msg->balance);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_BALANCE_INVAL: {
+            msg_balance_inval_t *m = (msg_balance_inval_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    msg_header_t *header = (msg_header_t*)buf;
+    header->msg_type = msg->msg_type;
+    prepare_username(header->username, msg->username);
+    return (int)len;
+}
+
+static int encode_compact(const wire_msg_t *msg, unsigned char *buf, size_t max_len)
+{
+    size_t len;
+
+    switch (msg->msg_type) {
+        case MSG_LOGIN_REQ: {
+            cmsg_login_req_t *m = (cmsg_login_req_t*)buf;
+            len = sizeof(*m) + msg->username_len;
+            if (max_len < len) return -1;
+            memcpy(m->auth_token, msg->auth_token, AUTH_TOKEN_SIZE);
+            memcpy(m->pin, msg->pin, PIN_SIZE);
+            m->seq_num = htonll(msg->seq_num);
+            m->username_len = msg->username_len;
+            memcpy(buf + sizeof(*m), msg->username, msg->username_len);
+            break;
+        }
+        case MSG_LOGIN_RESP: {
+            cmsg_login_resp_t *m = (cmsg_login_resp_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->success = msg->success;
+            m->account_id = htonl(msg->account_id);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_BALANCE_REQ: {
+            cmsg_balance_req_t *m = (cmsg_balance_req_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->account_id = htonl(msg->account_id);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_BALANCE_RESP: {
+            cmsg_balance_resp_t *m = (cmsg_balance_resp_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->account_id = htonl(msg->account_id);
+            m->balance = htonl(msg->balance);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_REQ: {
+            cmsg_withdraw_req_t *m = (cmsg_withdraw_req_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->account_id = htonl(msg->account_id);
+            m->amount = htonl(msg->amount);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_RESP: {
+            cmsg_withdraw_resp_t *m = (cmsg_withdraw_resp_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->account_id = htonl(msg->account_id);
+            m->success = msg->success;
+            m->new_balance = htonl(msg->balance);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        case MSG_BALANCE_INVAL: {
+            cmsg_balance_inval_t *m = (cmsg_balance_inval_t*)buf;
+            if (max_len < (len = sizeof(*m))) return -1;
+            m->account_id = htonl(msg->account_id);
+            m->seq_num = htonll(msg->seq_num);
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    cmsg_header_t *header = (cmsg_header_t*)buf;
+    header->version = WIRE_COMPACT;
+    header->msg_type = msg->msg_type;
+    return (int)len;
+}
+
+int wire_encode(const wire_msg_t *msg, unsigned char *buf, size_t max_len)
+{
+    if (msg->version == WIRE_COMPACT)
+        return encode_compact(msg, buf, max_len);
+    return encode_legacy(msg, buf, max_len);
+}
+
+static int decode_legacy(const unsigned char *buf, size_t len, wire_msg_t *msg)
+{
+    if (len < sizeof(msg_header_t)) return -1;
+
+    const msg_header_t *header = (const msg_header_t*)buf;
+    size_t ulen = strnlen(header->username, USERNAME_SIZE);
+    if (ulen >= USERNAME_SIZE) return -1;
+    memcpy(msg->username, header->username, ulen + 1);
+    msg->username_len = (uint8_t)ulen;
+    msg->version = WIRE_LEGACY;
+    msg->msg_type = header->msg_type;
+    msg->account_id = 0;
+
+    switch (msg->msg_type) {
+        case MSG_LOGIN_REQ: {
+            const msg_login_req_t *m = (const msg_login_req_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            memcpy(msg->auth_token, m->auth_token, AUTH_TOKEN_SIZE);
+            memcpy(msg->pin, m->pin, PIN_SIZE);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_LOGIN_RESP: {
+            const msg_login_resp_t *m = (const msg_login_resp_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->success = m->success;
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_BALANCE_REQ: {
+            const msg_balance_req_t *m = (const msg_balance_req_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_BALANCE_RESP: {
+            const msg_balance_resp_t *m = (const msg_balance_resp_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->balance = ntohl(m->balance);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_REQ: {
+            const msg_withdraw_req_t *m = (const msg_withdraw_req_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->amount = ntohl(m->amount);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_RESP: {
+            const msg_withdraw_resp_t *m = (const msg_withdraw_resp_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->success = m->success;
+            msg->balance = ntohl(m->new_balance);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_BALANCE_INVAL: {
+            const msg_balance_inval_t *m = (const msg_balance_inval_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+static int decode_compact(const unsigned char *buf, size_t len, wire_msg_t *msg)
+{
+    if (len < sizeof(cmsg_header_t)) return -1;
+
+    const cmsg_header_t *header = (const cmsg_header_t*)buf;
+    msg->version = WIRE_COMPACT;
+    msg->msg_type = header->msg_type;
+    msg->username_len = 0;
+    msg->username[0] = '\0';
+    msg->account_id = 0;
+
+    switch (msg->msg_type) {
+        case MSG_LOGIN_REQ: {
+            const cmsg_login_req_t *m = (const cmsg_login_req_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            if (m->username_len >= USERNAME_SIZE ||
+                len < sizeof(*m) + m->username_len) return -1;
+            memcpy(msg->auth_token, m->auth_token, AUTH_TOKEN_SIZE);
+            memcpy(msg->pin, m->pin, PIN_SIZE);
+            msg->seq_num = ntohll(m->seq_num);
+            msg->username_len = m->username_len;
+            memcpy(msg->username, buf + sizeof(*m), m->username_len);
+            msg->username[m->username_len] = '\0';
+            // Embedded nulls would make the name ambiguous
+            if (strlen(msg->username) != m->username_len) return -1;
+            break;
+        }
+        case MSG_LOGIN_RESP: {
+            const cmsg_login_resp_t *m = (const cmsg_login_resp_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->success = m->success;
+            msg->account_id = ntohl(m->account_id);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_BALANCE_REQ: {
+            const cmsg_balance_req_t *m = (const cmsg_balance_req_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->account_id = ntohl(m->account_id);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_BALANCE_RESP: {
+            const cmsg_balance_resp_t *m = (const cmsg_balance_resp_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->account_id = ntohl(m->account_id);
+            msg->balance = ntohl(m->balance);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_REQ: {
+            const cmsg_withdraw_req_t *m = (const cmsg_withdraw_req_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->account_id = ntohl(m->account_id);
+            msg->amount = ntohl(m->amount);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_WITHDRAW_RESP: {
+            const cmsg_withdraw_resp_t *m = (const cmsg_withdraw_resp_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->account_id = ntohl(m->account_id);
+            msg->success = m->success;
+            msg->balance = ntohl(m->new_balance);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        case MSG_BALANCE_INVAL: {
+            const cmsg_balance_inval_t *m = (const cmsg_balance_inval_t*)buf;
+            if (len < sizeof(*m)) return -1;
+            msg->account_id = ntohl(m->account_id);
+            msg->seq_num = ntohll(m->seq_num);
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+int wire_decode(const unsigned char *buf, size_t len, wire_msg_t *msg)
+{
+    if (len < 1) return -1;
+    if (buf[0] == WIRE_COMPACT)
+        return decode_compact(buf, len, msg);
+    return decode_legacy(buf, len, msg);
+}
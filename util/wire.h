@@ -0,0 +1,33 @@
+// Encoding and decoding of protocol messages in either wire format
+
+#ifndef __WIRE_H__
+#define __WIRE_H__
+
+#include "protocol.h"
+
+// Decoded form of any protocol message.  Only the fields that belong to
+// msg_type are meaningful.
+typedef struct {
+    uint8_t version;                      // WIRE_LEGACY or WIRE_COMPACT
+    uint8_t msg_type;                     // One of MSG_* constants
+    uint8_t username_len;                 // Legacy messages and compact login requests
+    char username[USERNAME_SIZE];         // Null-terminated
+    uint32_t account_id;                  // Compact messages other than login requests
+    uint8_t auth_token[AUTH_TOKEN_SIZE];  // Login request
+    char pin[PIN_SIZE];                   // Login request
+    uint8_t success;                      // Login and withdraw responses
+    int32_t amount;                       // Withdraw request
+    int32_t balance;                      // Balance and withdraw responses
+    uint64_t seq_num;
+} wire_msg_t;
+
+// Set username/username_len, truncating to USERNAME_SIZE - 1
+void wire_set_username(wire_msg_t *msg, const char *username);
+
+// Encode msg into buf; returns the encoded length or -1
+int wire_encode(const wire_msg_t *msg, unsigned char *buf, size_t max_len);
+
+// Decode buf into msg; returns 0 or -1 if malformed
+int wire_decode(const unsigned char *buf, size_t len, wire_msg_t *msg);
+
+#endif